@@ -0,0 +1,287 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "ahagz_soft.h"
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h> /* for sysconf */
+
+/* zlib-backed stand-in for the AHA card's ahagz_api, see ahagz_soft.h.
+ *
+ * The "card" is a set of worker threads, one per CPU, shared by every
+ * stream in the process and started the first time a stream is opened.
+ * Streams with input waiting sit on a queue until a worker picks them up.
+ */
+
+enum {
+	AHAGZ_SOFT_IDLE,
+	AHAGZ_SOFT_QUEUED,
+	AHAGZ_SOFT_DONE,
+	AHAGZ_SOFT_FAILED
+};
+
+#define RET_DONE 0x8000
+#define RET_ERROR 0x8002
+
+#define GZIP_HEADER 10
+#define GZIP_TRAILER 8
+
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Signalled when a stream is queued */
+static pthread_cond_t engine_work = PTHREAD_COND_INITIALIZER;
+/* Signalled when a stream finishes */
+static pthread_cond_t engine_done = PTHREAD_COND_INITIALIZER;
+static aha_stream_t *queue_head = NULL;
+static aha_stream_t *queue_tail = NULL;
+
+static void put_le32(unsigned char *buf, uint32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/* Compresses a stream's input into a single gzip member, returns its size
+ * or 0 if it didn't fit */
+static uint32_t compress_member(aha_stream_t *as)
+{
+	unsigned char *out = (unsigned char *)as->out;
+	z_stream strm;
+	uint32_t len;
+	int ret;
+
+	if (as->out_size < GZIP_HEADER + GZIP_TRAILER)
+		return 0;
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		return 0;
+	strm.next_in = (Bytef *)as->in;
+	strm.avail_in = as->in_len;
+	strm.next_out = out + GZIP_HEADER;
+	strm.avail_out = as->out_size - GZIP_HEADER - GZIP_TRAILER;
+	ret = deflate(&strm, Z_FINISH);
+	len = GZIP_HEADER + strm.total_out;
+	deflateEnd(&strm);
+	if (ret != Z_STREAM_END)
+		return 0;
+
+	memset(out, 0, GZIP_HEADER);
+	out[0] = 0x1f;
+	out[1] = 0x8b;
+	out[2] = Z_DEFLATED;
+	out[9] = 0x03;	/* OS: Unix */
+	put_le32(out + len, crc32(crc32(0, NULL, 0), (const Bytef *)as->in,
+				as->in_len));
+	put_le32(out + len + 4, as->in_len);
+	return len + GZIP_TRAILER;
+}
+
+static void *engine_worker(void *arg)
+{
+	aha_stream_t *as;
+	uint32_t len;
+
+	(void)arg;
+	pthread_mutex_lock(&engine_lock);
+	for (;;) {
+		while (!queue_head)
+			pthread_cond_wait(&engine_work, &engine_lock);
+		as = queue_head;
+		queue_head = as->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&engine_lock);
+
+		len = compress_member(as);
+
+		pthread_mutex_lock(&engine_lock);
+		as->out_len = len;
+		as->state = len ? AHAGZ_SOFT_DONE : AHAGZ_SOFT_FAILED;
+		pthread_cond_broadcast(&engine_done);
+	}
+	return NULL;
+}
+
+static uint32_t engine_channels(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? cpus : 1;
+}
+
+static void engine_start(void)
+{
+	pthread_t thread;
+	uint32_t i;
+
+	for (i = 0; i < engine_channels(); ++i) {
+		if (pthread_create(&thread, NULL, engine_worker, NULL) == 0)
+			pthread_detach(thread);
+	}
+}
+
+int ahagz_api_channels_available(aha_stream_t *as, uint32_t *ncomp,
+		uint32_t *ndecomp)
+{
+	(void)as;
+	if (ncomp)
+		*ncomp = engine_channels();
+	if (ndecomp)
+		*ndecomp = 0;
+	return 0;
+}
+
+int ahagz_api_open(aha_stream_t *as, int channel, int flags)
+{
+	(void)channel;
+	(void)flags;
+	pthread_once(&engine_once, engine_start);
+	memset(as, 0, sizeof(*as));
+	as->state = AHAGZ_SOFT_IDLE;
+	return 0;
+}
+
+int ahagz_api_reinitialize(aha_stream_t *as, int channel, int flags)
+{
+	(void)channel;
+	(void)flags;
+	pthread_mutex_lock(&engine_lock);
+	if (as->state == AHAGZ_SOFT_QUEUED) {
+		pthread_mutex_unlock(&engine_lock);
+		return -1;
+	}
+	memset(as, 0, sizeof(*as));
+	as->state = AHAGZ_SOFT_IDLE;
+	pthread_mutex_unlock(&engine_lock);
+	return 0;
+}
+
+int ahagz_api_close(aha_stream_t *as)
+{
+	/* Let anything still being compressed finish, as it writes to the
+	 * caller's buffers */
+	pthread_mutex_lock(&engine_lock);
+	while (as->state == AHAGZ_SOFT_QUEUED)
+		pthread_cond_wait(&engine_done, &engine_lock);
+	pthread_mutex_unlock(&engine_lock);
+	return 0;
+}
+
+int ahagz_api_addoutput(aha_stream_t *as, char *buffer, uint32_t len)
+{
+	as->out = buffer;
+	as->out_size = len;
+	return 0;
+}
+
+int ahagz_api_addinput(aha_stream_t *as, char *buffer, uint32_t len,
+		int first, int last, int flags, void *dict, uint32_t dict_len)
+{
+	/* Each input buffer is always a whole gzip member */
+	(void)first;
+	(void)last;
+	(void)flags;
+	(void)dict;
+	(void)dict_len;
+	if (!as->out)
+		return -1;
+
+	pthread_mutex_lock(&engine_lock);
+	if (as->state != AHAGZ_SOFT_IDLE) {
+		pthread_mutex_unlock(&engine_lock);
+		return -1;
+	}
+	as->in = buffer;
+	as->in_len = len;
+	as->state = AHAGZ_SOFT_QUEUED;
+	as->next = NULL;
+	if (queue_tail)
+		queue_tail->next = as;
+	else
+		queue_head = as;
+	queue_tail = as;
+	pthread_cond_signal(&engine_work);
+	pthread_mutex_unlock(&engine_lock);
+	return 0;
+}
+
+int64_t ahagz_api_waitstat(aha_stream_t *as, uint32_t *in_cnt,
+		uint32_t *out_cnt, uint32_t timeout_ms)
+{
+	struct timeval now;
+	struct timespec deadline;
+	int64_t ret = 0;
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout_ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&engine_lock);
+	while (as->state == AHAGZ_SOFT_QUEUED) {
+		if (pthread_cond_timedwait(&engine_done, &engine_lock,
+				&deadline) == ETIMEDOUT)
+			break;
+	}
+	switch (as->state) {
+		case AHAGZ_SOFT_DONE:
+			ret = RET_DONE;
+			break;
+		case AHAGZ_SOFT_FAILED:
+			ret = RET_ERROR;
+			break;
+		default:
+			/* Still busy */
+			ret = 0;
+	}
+	if (in_cnt)
+		*in_cnt = ret == RET_DONE ? as->in_len : 0;
+	if (out_cnt)
+		*out_cnt = ret == RET_DONE ? as->out_len : 0;
+	pthread_mutex_unlock(&engine_lock);
+	return ret;
+}
+
+int64_t ahagz_api_output_size(aha_stream_t *as)
+{
+	int64_t ret;
+
+	pthread_mutex_lock(&engine_lock);
+	ret = as->state == AHAGZ_SOFT_DONE ? (int64_t)as->out_len : -1;
+	pthread_mutex_unlock(&engine_lock);
+	return ret;
+}
@@ -0,0 +1,76 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* A software stand-in for the AHA card's ahagz_api, backed by zlib.
+ *
+ * Only the calls that iow-hwzlib.c makes are provided, with the same
+ * asynchronous behaviour: adding an input buffer queues it for compression
+ * on a worker thread and returns straight away, and ahagz_api_waitstat()
+ * waits for the result. Each input buffer becomes one gzip member, with the
+ * plain 10 byte header the card writes.
+ *
+ * This lets the hwgzip writer be built, tested and benchmarked on machines
+ * without the card; configure picks it when the ahagz_api library isn't
+ * available (or --without-aha is given).
+ */
+
+#ifndef AHAGZ_SOFT_H
+#define AHAGZ_SOFT_H 1
+
+#include <inttypes.h>
+#include <pthread.h>
+
+/* Returned by ahagz_api_waitstat() when the card hands a buffer back before
+ * finishing, which never happens here. Like the real card, a finished
+ * stream gives 0x8000, anything below that means it is still busy and
+ * anything else is an error */
+#define RET_BUFF_RECLAIM 0x8001
+
+typedef struct aha_stream {
+	const char *in;
+	uint32_t in_len;
+	char *out;
+	uint32_t out_size;
+	uint32_t out_len;
+	/* One of the AHAGZ_SOFT_* states, protected by the engine's lock */
+	int state;
+	/* Next stream waiting for a worker */
+	struct aha_stream *next;
+} aha_stream_t;
+
+int ahagz_api_channels_available(aha_stream_t *as, uint32_t *ncomp,
+		uint32_t *ndecomp);
+int ahagz_api_open(aha_stream_t *as, int channel, int flags);
+int ahagz_api_reinitialize(aha_stream_t *as, int channel, int flags);
+int ahagz_api_close(aha_stream_t *as);
+int ahagz_api_addoutput(aha_stream_t *as, char *buffer, uint32_t len);
+int ahagz_api_addinput(aha_stream_t *as, char *buffer, uint32_t len,
+		int first, int last, int flags, void *dict, uint32_t dict_len);
+int64_t ahagz_api_waitstat(aha_stream_t *as, uint32_t *in_cnt,
+		uint32_t *out_cnt, uint32_t timeout_ms);
+int64_t ahagz_api_output_size(aha_stream_t *as);
+
+#endif
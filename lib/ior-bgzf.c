@@ -0,0 +1,649 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include <zlib.h>
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+/* Libwandio IO module implementing a blocked gzip reader
+ *
+ * This reads gzip files made up of many small members that each record
+ * their own compressed size in the gzip header: BGZF files (a "BC" extra
+ * field, as written by bgzf_wopen() or htslib) and the files written by the
+ * AHA hardware compressor (an "EF" extra field). Because the member
+ * boundaries can be found without inflating anything, the main thread just
+ * splits the compressed data into runs of whole members and the runs are
+ * inflated in parallel on a wandio_pool. The trailer of each member gives
+ * its uncompressed size, so every run's output buffer is sized up front.
+ *
+ * The same sizes make seeking cheap: we remember where each member starts,
+ * both in the file and in the output, as we pass it. Seeking restarts at the
+ * member holding the target (after skipping whole members by looking at
+ * nothing but their headers and trailers, if the target is further on than
+ * we have got) and only has to inflate that member to find its place. If
+ * the file was written with a ".gzi" index (see bgzf_wopen()) we start off
+ * knowing where every member is, so we never have to skip through the file.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+/* Roughly how much compressed data to hand to each job */
+#define JOB_INPUT (1024*1024)
+/* How much to read from the parent at once */
+#define READ_SIZE (1024*1024)
+/* A gzip header up to and including XLEN */
+#define GZIP_FIXED_HEADER 12
+
+struct bgzfjob_t {
+	z_stream strm;
+	/* A run of whole members */
+	Bytef *inbuff;
+	size_t in_len;
+	size_t in_size;
+	/* Their inflated contents */
+	Bytef *outbuff;
+	size_t out_len;
+	size_t out_size;
+	bool failed;
+};
+
+/* Where a member starts */
+struct bgzf_mark_t {
+	int64_t in;		/* Offset in the compressed file */
+	int64_t out;		/* Uncompressed offset */
+};
+
+struct bgzf_t {
+	io_t *parent;
+	enum err_t err;
+	/* Uncompressed offset of the next byte we hand out */
+	int64_t position;
+	/* Offset in the parent where the file starts, -1 if the parent can't
+	 * tell us (so we can't go back) */
+	int64_t in_start;
+	/* Where the first member still in the stage starts */
+	int64_t in_next;
+	int64_t out_next;
+	/* Every member start we know of, in file order */
+	struct bgzf_mark_t *marks;
+	uint64_t nmarks;
+	uint64_t max_marks;
+	/* Compressed data read from the parent but not yet given to a job */
+	Bytef *stage;
+	size_t stage_start;
+	size_t stage_len;
+	size_t stage_size;
+	bool parent_eof;
+
+	struct wandio_pool *pool;
+	struct bgzfjob_t *job;
+	unsigned int slots;
+	/* Number of the next job to be filled */
+	uint64_t next;
+	/* The job we are currently handing data out of, and how far into it
+	 * we are */
+	struct bgzfjob_t *current;
+	size_t offset;
+};
+
+extern io_source_t bgzf_source;
+
+#define DATA(io) ((struct bgzf_t *)((io)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+static uint32_t get_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *buf)
+{
+	return get_le32(buf) | ((uint64_t)get_le32(buf + 4) << 32);
+}
+
+int64_t wandio_gzip_block_size(const uint8_t *header, int64_t len)
+{
+	unsigned int xlen;
+	const uint8_t *field, *end;
+
+	if (len < GZIP_FIXED_HEADER)
+		return -1;
+	if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 0x08 ||
+			!(header[3] & 0x04))	/* FEXTRA */
+		return 0;
+	xlen = header[10] | (header[11] << 8);
+	if (len < GZIP_FIXED_HEADER + xlen)
+		return -1;
+
+	field = header + GZIP_FIXED_HEADER;
+	end = field + xlen;
+	while (field + 4 <= end) {
+		unsigned int slen = field[2] | (field[3] << 8);
+		if (field + 4 + slen > end)
+			break;
+		/* BGZF stores the member size less one */
+		if (field[0] == 'B' && field[1] == 'C' && slen == 2)
+			return (field[4] | (field[5] << 8)) + 1;
+		/* The AHA card stores the member size itself */
+		if (field[0] == 'E' && field[1] == 'F' && slen == 4)
+			return get_le32(field + 4);
+		field += 4 + slen;
+	}
+	return 0;
+}
+
+/* Runs on a pool thread */
+static void bgzf_inflate_run(void *data, void *arg)
+{
+	struct bgzfjob_t *job = (struct bgzfjob_t *)data;
+
+	(void)arg;
+	job->failed = false;
+	job->strm.next_in = job->inbuff;
+	job->strm.avail_in = job->in_len;
+	job->strm.next_out = job->outbuff;
+	job->strm.avail_out = job->out_len;
+
+	/* zlib checks each member's CRC and length for us */
+	while (job->strm.avail_in > 0) {
+		inflateReset(&job->strm);
+		if (inflate(&job->strm, Z_FINISH) != Z_STREAM_END) {
+			job->failed = true;
+			return;
+		}
+	}
+	if (job->strm.avail_out != 0)
+		job->failed = true;
+}
+
+/* Remembers that a member starts at "in" in the file and "out" in the
+ * output, unless we knew that already */
+static void add_mark(io_t *io, int64_t in, int64_t out)
+{
+	struct bgzf_mark_t *marks;
+
+	if (DATA(io)->nmarks && in <= DATA(io)->marks[DATA(io)->nmarks-1].in)
+		return;
+	if (DATA(io)->nmarks == DATA(io)->max_marks) {
+		marks = realloc(DATA(io)->marks, (DATA(io)->max_marks * 2 + 64) *
+				sizeof(struct bgzf_mark_t));
+		/* Seeking will just be slower without it */
+		if (!marks)
+			return;
+		DATA(io)->marks = marks;
+		DATA(io)->max_marks = DATA(io)->max_marks * 2 + 64;
+	}
+	DATA(io)->marks[DATA(io)->nmarks].in = in;
+	DATA(io)->marks[DATA(io)->nmarks].out = out;
+	DATA(io)->nmarks++;
+}
+
+/* Reads the member starts out of an htslib style ".gzi" index: a count and
+ * then a compressed and uncompressed offset for every member but the
+ * first, all little endian 64 bit numbers */
+static void load_index(io_t *io, io_t *index)
+{
+	uint8_t entry[16];
+	uint64_t count, i;
+	int64_t in = 0, out = 0;
+
+	if (wandio_read(index, entry, 8) != 8)
+		goto bad_index;
+	count = get_le64(entry);
+	add_mark(io, in, out);
+	for (i = 0; i < count; ++i) {
+		if (wandio_read(index, entry, sizeof(entry)) != sizeof(entry))
+			goto bad_index;
+		/* Both offsets only ever go up */
+		if ((int64_t)get_le64(entry) <= in || 
+				(int64_t)get_le64(entry + 8) < out)
+			goto bad_index;
+		in = get_le64(entry);
+		out = get_le64(entry + 8);
+		add_mark(io, in, out);
+	}
+	return;
+
+bad_index:
+	/* We can still find our own way around, just more slowly */
+	fprintf(stderr, "Ignoring unreadable blocked gzip index\n");
+	DATA(io)->nmarks = 0;
+}
+
+io_t *bgzf_open(io_t *parent, const struct wandio_options *opts, 
+		io_t *index)
+{
+	io_t *io;
+	unsigned int threads;
+	unsigned int i;
+	if (!parent)
+		return NULL;
+	io = calloc(1, sizeof(io_t));
+	io->source = &bgzf_source;
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct bgzf_t));
+
+	DATA(io)->parent = parent;
+	DATA(io)->err = ERR_OK;
+	DATA(io)->in_start = wandio_tell(parent);
+
+	threads = wandio_pool_threads(opts);
+	DATA(io)->slots = threads ? threads * 2 : 1;
+	DATA(io)->job = calloc(DATA(io)->slots, sizeof(struct bgzfjob_t));
+	for (i = 0; i < DATA(io)->slots; ++i) {
+		/* 16 means expect a gzip header */
+		struct bgzfjob_t *job = &DATA(io)->job[i];
+		if (inflateInit2(&job->strm, 15 | 16) != Z_OK)
+			DATA(io)->err = ERR_ERROR;
+		/* Both of these grow if they need to */
+		job->in_size = JOB_INPUT;
+		job->inbuff = malloc(job->in_size);
+		job->out_size = JOB_INPUT;
+		job->outbuff = malloc(job->out_size);
+	}
+	DATA(io)->pool = wandio_pool_create(threads, DATA(io)->slots,
+			bgzf_inflate_run, NULL, "bgzf");
+	wandio_pool_count_stalls(DATA(io)->pool, &io->stats.consumer_stalls,
+			&io->stats.consumer_stall_ns);
+
+	if (index) {
+		load_index(io, index);
+		wandio_destroy(index);
+	}
+
+	return io;
+}
+
+/* Makes sure there are at least len bytes of compressed data staged.
+ * Returns false if the file ends first */
+static bool stage_data(io_t *io, size_t len)
+{
+	int64_t bytes_read;
+
+	while (DATA(io)->stage_len < len) {
+		if (DATA(io)->parent_eof)
+			return false;
+		/* Move what's left to the front and make room for more */
+		memmove(DATA(io)->stage, DATA(io)->stage + DATA(io)->stage_start,
+				DATA(io)->stage_len);
+		DATA(io)->stage_start = 0;
+		if (DATA(io)->stage_size < DATA(io)->stage_len + 
+				(len > READ_SIZE ? len : READ_SIZE)) {
+			DATA(io)->stage_size = DATA(io)->stage_len + 
+				(len > READ_SIZE ? len : READ_SIZE);
+			DATA(io)->stage = realloc(DATA(io)->stage, 
+					DATA(io)->stage_size);
+		}
+		bytes_read = wandio_read(DATA(io)->parent, 
+				DATA(io)->stage + DATA(io)->stage_len,
+				DATA(io)->stage_size - DATA(io)->stage_len);
+		if (bytes_read < 0) {
+			DATA(io)->err = ERR_ERROR;
+			return false;
+		}
+		if (bytes_read == 0)
+			DATA(io)->parent_eof = true;
+		DATA(io)->stage_len += bytes_read;
+	}
+	return true;
+}
+
+/* Makes sure the whole of the next member is staged. Returns its size, 0
+ * at the end of the file or -1 on error */
+static int64_t stage_member(io_t *io)
+{
+	int64_t size;
+	const Bytef *member;
+
+	if (!stage_data(io, GZIP_FIXED_HEADER))
+		goto out_of_data;
+	member = DATA(io)->stage + DATA(io)->stage_start;
+	size = wandio_gzip_block_size(member, DATA(io)->stage_len);
+	if (size < 0) {
+		if (!stage_data(io, GZIP_FIXED_HEADER + 
+				(member[10] | (member[11] << 8))))
+			goto out_of_data;
+		member = DATA(io)->stage + DATA(io)->stage_start;
+		size = wandio_gzip_block_size(member, DATA(io)->stage_len);
+	}
+	if (size < GZIP_FIXED_HEADER + 8) {
+		fprintf(stderr, "gzip member without a block size in a blocked gzip file\n");
+		DATA(io)->err = ERR_ERROR;
+		return -1;
+	}
+	if (!stage_data(io, (size_t)size))
+		goto out_of_data;
+	return size;
+
+out_of_data:
+	if (DATA(io)->err == ERR_ERROR)
+		return -1;
+	if (DATA(io)->stage_len != 0) {
+		fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+		DATA(io)->err = ERR_ERROR;
+		return -1;
+	}
+	return 0;
+}
+
+/* Moves past the member at the front of the stage, which is "size" bytes
+ * long and inflates to "isize" bytes */
+static void pass_member(io_t *io, int64_t size, uint32_t isize)
+{
+	add_mark(io, DATA(io)->in_next, DATA(io)->out_next);
+	DATA(io)->stage_start += size;
+	DATA(io)->stage_len -= size;
+	DATA(io)->in_next += size;
+	DATA(io)->out_next += isize;
+}
+
+/* Moves whole members from the staged data into a job. Returns the number
+ * of members, 0 at the end of the file or -1 on error */
+static int fill_job(io_t *io, struct bgzfjob_t *job)
+{
+	int members = 0;
+	int64_t size;
+	uint32_t isize;
+	const Bytef *member;
+
+	job->in_len = 0;
+	job->out_len = 0;
+	while (job->in_len < JOB_INPUT) {
+		size = stage_member(io);
+		if (size < 0)
+			return -1;
+		if (size == 0)
+			break;
+		member = DATA(io)->stage + DATA(io)->stage_start;
+		isize = get_le32(member + size - 4);
+
+		if (job->in_size < job->in_len + size) {
+			job->in_size = job->in_len + size + JOB_INPUT;
+			job->inbuff = realloc(job->inbuff, job->in_size);
+		}
+		if (job->out_size < job->out_len + isize) {
+			job->out_size = (job->out_len + isize) * 2;
+			job->outbuff = realloc(job->outbuff, job->out_size);
+		}
+		memcpy(job->inbuff + job->in_len, member, size);
+		job->in_len += size;
+		job->out_len += isize;
+		pass_member(io, size, isize);
+		members++;
+	}
+	return members;
+}
+
+/* Makes sure there is data in the current job, starting the next ones if
+ * we've finished with it. Returns the amount of data available, 0 at the
+ * end of the file or -1 on error */
+static int64_t next_data(io_t *io)
+{
+	struct bgzfjob_t *job;
+
+	/* Runs made up of empty members (such as the BGZF end of file marker)
+	 * have nothing to offer, so skip straight over them */
+	while (!DATA(io)->current || 
+			DATA(io)->offset >= DATA(io)->current->out_len) {
+		DATA(io)->current = NULL;
+
+		/* Keep every slot busy, now that the job we were reading from
+		 * is free again */
+		while (DATA(io)->err == ERR_OK && 
+				(!DATA(io)->parent_eof || DATA(io)->stage_len) &&
+				wandio_pool_pending(DATA(io)->pool) < 
+				DATA(io)->slots) {
+			job = &DATA(io)->job[DATA(io)->next % DATA(io)->slots];
+			if (fill_job(io, job) <= 0)
+				break;
+			wandio_pool_submit(DATA(io)->pool, job);
+			DATA(io)->next++;
+		}
+
+		/* Hand out everything that was read ok before any error */
+		job = wandio_pool_wait(DATA(io)->pool, true);
+		if (!job && DATA(io)->err == ERR_ERROR) {
+			errno = EIO;
+			return -1;
+		}
+		if (!job)
+			return 0;
+		if (job->failed) {
+			fprintf(stderr, "Error inflating blocked gzip data\n");
+			DATA(io)->err = ERR_ERROR;
+			errno = EIO;
+			return -1;
+		}
+		DATA(io)->current = job;
+		DATA(io)->offset = 0;
+	}
+	return DATA(io)->current->out_len - DATA(io)->offset;
+}
+
+static int64_t bgzf_read(io_t *io, void *buffer, int64_t len)
+{
+	int64_t copied = 0;
+	int64_t avail;
+
+	while (copied < len) {
+		avail = next_data(io);
+		if (avail < 0)
+			return copied ? copied : -1;
+		if (avail == 0)
+			break;
+		avail = min(avail, len - copied);
+		memcpy((char *)buffer + copied, 
+				DATA(io)->current->outbuff + DATA(io)->offset,
+				avail);
+		DATA(io)->offset += avail;
+		DATA(io)->position += avail;
+		copied += avail;
+	}
+	return copied;
+}
+
+/* Hand out a pointer straight into the inflated data rather than copying */
+static int64_t bgzf_borrow(io_t *io, const void **buffer, int64_t len)
+{
+	int64_t avail = next_data(io);
+
+	if (avail <= 0)
+		return avail;
+	*buffer = DATA(io)->current->outbuff + DATA(io)->offset;
+	return min(avail, len);
+}
+
+static void bgzf_release(io_t *io, int64_t used)
+{
+	if (used > 0) {
+		DATA(io)->offset += used;
+		DATA(io)->position += used;
+	}
+}
+
+static int64_t bgzf_tell(io_t *io)
+{
+	return DATA(io)->position;
+}
+
+/* Throws away every job, along with anything else we had inflated, so that
+ * we carry on from the first member still in the stage */
+static void drop_jobs(io_t *io)
+{
+	while (wandio_pool_wait(DATA(io)->pool, true))
+		;
+	DATA(io)->current = NULL;
+	DATA(io)->offset = 0;
+	DATA(io)->position = DATA(io)->out_next;
+}
+
+/* Starts reading again from the member at "mark", or from the start of the
+ * file if mark is NULL */
+static int restart(io_t *io, const struct bgzf_mark_t *mark)
+{
+	int64_t in = mark ? mark->in : 0;
+
+	if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + in, SEEK_SET)
+			!= DATA(io)->in_start + in)
+		return -1;
+	DATA(io)->stage_start = 0;
+	DATA(io)->stage_len = 0;
+	DATA(io)->parent_eof = false;
+	DATA(io)->err = ERR_OK;
+	DATA(io)->in_next = in;
+	DATA(io)->out_next = mark ? mark->out : 0;
+	drop_jobs(io);
+	return 0;
+}
+
+/* Skips whole members, without inflating them, until the next one holds
+ * the uncompressed offset "target". Only to be used with no jobs running */
+static int skip_members(io_t *io, int64_t target)
+{
+	int64_t size;
+	uint32_t isize;
+
+	for (;;) {
+		size = stage_member(io);
+		if (size <= 0)
+			return size;
+		isize = get_le32(DATA(io)->stage + DATA(io)->stage_start + 
+				size - 4);
+		if (DATA(io)->out_next + isize > target)
+			return 0;
+		pass_member(io, size, isize);
+		DATA(io)->position = DATA(io)->out_next;
+	}
+}
+
+static int64_t bgzf_seek(io_t *io, int64_t offset, int whence)
+{
+	const struct bgzf_mark_t *mark = NULL;
+	int64_t avail;
+	uint64_t lo, hi, mid;
+
+	if (whence == SEEK_CUR)
+		offset += DATA(io)->position;
+	else if (whence != SEEK_SET) {
+		/* We don't know where the end is without reading to it */
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Find the last member that starts at or before the target */
+	lo = 0;
+	hi = DATA(io)->nmarks;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (DATA(io)->marks[mid].out <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0)
+		mark = &DATA(io)->marks[lo - 1];
+
+	/* Anything between here and the stage is already being inflated, so
+	 * just read forward through it. Otherwise start again at the right
+	 * member, going back to it if we have to */
+	if (offset < DATA(io)->position || offset >= DATA(io)->out_next) {
+		if (offset < DATA(io)->position || 
+				(mark && mark->in > DATA(io)->in_next)) {
+			if (DATA(io)->in_start < 0) {
+				errno = ESPIPE;
+				return -1;
+			}
+			if (restart(io, mark) < 0) {
+				DATA(io)->err = ERR_ERROR;
+				errno = EIO;
+				return -1;
+			}
+		}
+		else
+			drop_jobs(io);
+		if (skip_members(io, offset) < 0) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	/* Inflate the member and find our place in it */
+	while (DATA(io)->position < offset) {
+		avail = next_data(io);
+		if (avail < 0)
+			return -1;
+		if (avail == 0)
+			break;
+		avail = min(avail, offset - DATA(io)->position);
+		DATA(io)->offset += avail;
+		DATA(io)->position += avail;
+	}
+	return DATA(io)->position;
+}
+
+static void bgzf_close(io_t *io)
+{
+	unsigned int i;
+
+	wandio_pool_destroy(DATA(io)->pool);
+	for (i = 0; i < DATA(io)->slots; ++i) {
+		inflateEnd(&DATA(io)->job[i].strm);
+		free(DATA(io)->job[i].inbuff);
+		free(DATA(io)->job[i].outbuff);
+	}
+	free(DATA(io)->job);
+	free(DATA(io)->stage);
+	free(DATA(io)->marks);
+	wandio_destroy(DATA(io)->parent);
+	free(io->data);
+	free(io);
+}
+
+io_source_t bgzf_source = {
+	"bgzf",
+	bgzf_read,
+	NULL,	/* peek */
+	bgzf_tell,
+	bgzf_seek,
+	bgzf_close,
+	bgzf_borrow,
+	bgzf_release
+};
@@ -1,5 +1,6 @@
 
 #include "config.h"
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -9,9 +10,7 @@
 #include <errno.h>
 #include <blosc.h>
 
-#define BUF_IN_SIZE 1024*1024*2
-
-#define DEBUG
+//#define DEBUG
 
 #ifdef DEBUG
  #define debug(x...) printf(x)
@@ -19,186 +18,378 @@
  #define debug(x...)
 #endif
 
-/* Libwandio IO module implementing a blosc reader */
+/* Libwandio IO module implementing a blosc reader
+ *
+ * Files written by blosc_wopen() are framed (see iow-blosc.c for the
+ * layout): every chunk comes with its compressed and uncompressed length,
+ * and a chunk index at the end of the file says where each one starts.
+ * Older files are just blosc chunks back to back, in which case we find the
+ * lengths in each chunk's own header instead.
+ *
+ * Either way the chunks are read one at a time, exactly, and runs of them
+ * are handed to a wandio_pool to be decompressed with blosc_decompress_ctx().
+ * If the index could be read, seeking goes straight to the chunk that
+ * holds the target; otherwise we can only seek forwards.
+ */
+
+static const uint8_t blosc_magic[8] =
+		{ 0x89, 'B', 'L', 'O', 'S', 'C', 0x0d, 0x0a };
+
+#define RECORD_HEADER 8
+#define FOOTER_SIZE 32
+#define INDEX_ENTRY 16
 
-enum err_t {
-	ERR_OK	= 1,
-	ERR_EOF = 0,
-	ERR_ERROR = -1
+/* Small chunks are decompressed together until a job has at least this
+ * much */
+#define JOB_SIZE (1024*1024)
+
+struct bloscjob_t {
+	struct wandio_reader_job base;
+	uint8_t *inbuff;
+	size_t in_size;
+	size_t in_len;
+	size_t out_size;
 };
 
 struct blosc_t {
-	char inbuff[BUF_IN_SIZE];
-	char *next_in;
-	int avail_in;
-	char *next_out;
-	int avail_out;
 	io_t *parent;
-	enum err_t err;
-	//int outoffset; - not used here
-        size_t sincelastend;
+	/* False for old files without any framing */
+	bool framed;
+	/* Set once there are no more chunks to read */
+	bool last_chunk;
+	/* Set if the last chunk ended early, reported once everything before
+	 * it has been handed out */
+	bool read_failed;
+
+	struct wandio_reader reader;
+
+	/* Where each chunk's record starts, from the index if we managed to
+	 * read it */
+	struct wandio_seek_point *chunks;
+	size_t nchunks;
+	/* Where the file starts in the parent */
+	int64_t in_start;
 };
 
-extern io_source_t blosc_source; 
+extern io_source_t blosc_source;
 
 #define DATA(io) ((struct blosc_t *)((io)->data))
-#define min(a,b) ((a)<(b) ? (a) : (b))
 
-io_t *blosc_open(io_t *parent)
+static uint32_t read_le32(const uint8_t *buf)
 {
-	io_t *io;
-	if (!parent)
-		return NULL;
-	io = malloc(sizeof(io_t));
-	io->source = &blosc_source;
-	io->data = malloc(sizeof(struct blosc_t));
+	return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) |
+			((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
 
-        blosc_init();
+static uint64_t read_le64(const uint8_t *buf)
+{
+	return (uint64_t)read_le32(buf) | ((uint64_t)read_le32(buf + 4) << 32);
+}
 
+/* Runs on a pool thread */
+static void blosc_decode_chunks(void *data, io_t *io)
+{
+	struct bloscjob_t *job = (struct bloscjob_t *)data;
+	size_t in_pos = 0, out_pos = 0;
+	size_t nbytes, cbytes, blocksize;
+	int ret;
 
-	DATA(io)->parent = parent;
-	DATA(io)->next_in = NULL;
-	DATA(io)->avail_in = 0;
-	DATA(io)->next_out = NULL;
-	DATA(io)->avail_out = 0;
-	DATA(io)->err = ERR_OK;
-        DATA(io)->sincelastend = 1;
+	(void)io;
+	job->base.failed = true;
+	while (in_pos < job->in_len) {
+		blosc_cbuffer_sizes(job->inbuff + in_pos, &nbytes, &cbytes,
+				&blocksize);
+		ret = blosc_decompress_ctx(job->inbuff + in_pos,
+				job->base.out + out_pos, 
+				job->base.out_len - out_pos, 1);
+		if (ret < 0 || (size_t)ret != nbytes)
+			return;
+		in_pos += cbytes;
+		out_pos += nbytes;
+	}
+	job->base.failed = (out_pos != job->base.out_len);
+}
 
-	return io;
+/* Reads exactly len bytes from the parent. Returns 0 if we were already
+ * at the end of the file and -1 if it ended part way through */
+static int read_full(io_t *io, void *buffer, size_t len)
+{
+	size_t done = 0;
+	int64_t ret;
+
+	while (done < len) {
+		ret = wandio_read(DATA(io)->parent, (char *)buffer + done,
+				len - done);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			if (done == 0)
+				return 0;
+			fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+			return -1;
+		}
+		done += ret;
+	}
+	return 1;
 }
 
-//we provide some empty buffer with len, so inflate() will put some data into it
-//we usually have 1Mb empty buffer
-static int64_t blosc_read(io_t *io, void *buffer, int64_t len)
+/* Reads the chunk index from the end of the file, returns false if there
+ * isn't one we can use */
+static bool read_index(io_t *io)
 {
-	int dsize;
-	int bytes_read = 0;
+	uint8_t footer[FOOTER_SIZE];
+	uint8_t *index;
+	int64_t end;
+	uint64_t index_off, nchunks, i;
+
+	if (DATA(io)->in_start < 0)
+		return false;
+	end = wandio_seek(DATA(io)->parent, 0, SEEK_END);
+	if (end < DATA(io)->in_start + (int64_t)sizeof(blosc_magic) +
+			RECORD_HEADER + FOOTER_SIZE)
+		return false;
+	end -= DATA(io)->in_start;
+	if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + end -
+				FOOTER_SIZE, SEEK_SET) < 0 ||
+			read_full(io, footer, sizeof(footer)) != 1 ||
+			memcmp(footer + 24, blosc_magic, sizeof(blosc_magic)))
+		return false;
+
+	index_off = read_le64(footer);
+	nchunks = read_le64(footer + 8);
+	if (index_off > (uint64_t)end || nchunks > ((uint64_t)end -
+				index_off) / INDEX_ENTRY ||
+			index_off + nchunks * INDEX_ENTRY + FOOTER_SIZE !=
+				(uint64_t)end)
+		return false;
 
-	if (DATA(io)->err == ERR_EOF)
-		return 0; /* EOF */
-	if (DATA(io)->err == ERR_ERROR) {
-		errno = EIO;
-		return -1; /* ERROR! */
+	index = malloc(nchunks * INDEX_ENTRY + 1);
+	if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + index_off,
+				SEEK_SET) < 0 ||
+			read_full(io, index, nchunks * INDEX_ENTRY) < 0) {
+		free(index);
+		return false;
 	}
+	DATA(io)->chunks = calloc(nchunks + 1, 
+			sizeof(struct wandio_seek_point));
+	for (i = 0; i < nchunks; ++i) {
+		DATA(io)->chunks[i].comp_off = read_le64(index +
+				i * INDEX_ENTRY);
+		DATA(io)->chunks[i].unc_off = read_le64(index +
+				i * INDEX_ENTRY + 8);
+	}
+	free(index);
+	/* The end of the data is where the index starts */
+	DATA(io)->chunks[nchunks].comp_off = index_off;
+	DATA(io)->chunks[nchunks].unc_off = read_le64(footer + 16);
+	DATA(io)->nchunks = nchunks;
+	return true;
+}
 
-	debug("[wandio] %s() ENTER. buf: %p , len: %ld \n", __func__,
-		buffer, len);
-	DATA(io)->avail_out = (int)len;
-	DATA(io)->next_out = (char*)buffer;
-
-	//while we have some empty space in OUT buffer for decompressed data
-	while (DATA(io)->err == ERR_OK && DATA(io)->avail_out > 0) 
-	{	//if we have no more input data (compressed one)
-		while (DATA(io)->avail_in <= 0) 
-		{	//zeroing inbuff for blosc_decompress()
-			memset(DATA(io)->inbuff, 0x0, sizeof(DATA(io)->inbuff));
-			//fill inbuff with compressed data read from file
-			bytes_read = wandio_read(DATA(io)->parent, DATA(io)->inbuff,
-						     sizeof(DATA(io)->inbuff));
-			debug("[wandio] fill INBUF from file. bytes read: %d \n", bytes_read);
-			if (bytes_read == 0) 
-			{
-                                /* If we get EOF immediately after a 
-                                 * Z_STREAM_END, then we assume we've reached 
-                                 * the end of the file. If there was data 
-                                 * between the Z_STREAM_END and the EOF, the
-                                 * file has more likely been truncated.
-                                 */
-//XXX - probably we don't need sincelastend thing
-#if 0
-                                if (DATA(io)->sincelastend > 0) {
-                                        fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
-                                        errno = EIO;
-                                        DATA(io)->err = ERR_ERROR;
-                                        return -1;
-                                }
-#endif
+/* Makes sure a job buffer can hold another len bytes */
+static uint8_t *job_space(uint8_t **buff, size_t *size, size_t used,
+		size_t len)
+{
+	if (*size < used + len) {
+		*size = used + len > *size * 2 ? used + len : *size * 2;
+		*buff = realloc(*buff, *size);
+	}
+	return *buff + used;
+}
 
-                                /* EOF */
-				if (DATA(io)->avail_out == (int)len) 
-				{
-                                        DATA(io)->err = ERR_EOF;
-					return 0;
-				}
-				/* Return how much data we've managed to read so far. */
-				return len-DATA(io)->avail_out;
-			}
-			if (bytes_read < 0) /* Error */
-			{
-				/* errno should be set */
-				DATA(io)->err = ERR_ERROR;
-				/* Return how much data we managed to read ok */
-				if (DATA(io)->avail_out != (int)len)
-					return len-DATA(io)->avail_out;
-				/* Now return error */
-				return -1;
-			}
-			DATA(io)->next_in = DATA(io)->inbuff;
-			DATA(io)->avail_in = bytes_read;
-                        DATA(io)->sincelastend += bytes_read; //XXX - do we need it?
-		}
+/* Reads the next chunk into a job. Returns 1 if there was one, 0 if there
+ * are no more and -1 on error */
+static int read_chunk(io_t *io, struct bloscjob_t *job)
+{
+	uint8_t header[BLOSC_MAX_OVERHEAD];
+	size_t nbytes, cbytes, blocksize;
+	uint32_t rec_nbytes = 0, rec_cbytes = 0;
+	uint8_t *chunk;
+	int ret;
 
-		/* Decompress  (src, dest, dest_size) */
-		dsize = blosc_decompress(DATA(io)->next_in, DATA(io)->next_out, DATA(io)->avail_out);
-		if (dsize < 0) 
-		{
-			printf("Decompression error.  Error code: %d\n", dsize);
-			return dsize;
-		}
-		else
-		{
-			debug("[wandio] successfully decompressed %d bytes \n", dsize);
-			DATA(io)->next_in += bytes_read;
-			DATA(io)->avail_in -= bytes_read;
-			DATA(io)->avail_out -= dsize;
-			DATA(io)->next_out += dsize;
-		}
+	if (DATA(io)->framed) {
+		ret = read_full(io, header, RECORD_HEADER);
+		/* Only the end record is allowed to finish the file */
+		if (ret == 0)
+			fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+		if (ret != 1)
+			return -1;
+		rec_nbytes = read_le32(header);
+		rec_cbytes = read_le32(header + 4);
+		/* An empty record marks the end of the chunks */
+		if (rec_nbytes == 0 && rec_cbytes == 0)
+			return 0;
+	}
+
+	ret = read_full(io, header, BLOSC_MAX_OVERHEAD);
+	if (ret == 0 && !DATA(io)->framed)
+		return 0;
+	if (ret != 1)
+		return -1;
+	blosc_cbuffer_sizes(header, &nbytes, &cbytes, &blocksize);
+	if (cbytes < BLOSC_MAX_OVERHEAD || (DATA(io)->framed &&
+			(nbytes != rec_nbytes || cbytes != rec_cbytes))) {
+		fprintf(stderr, "Bad blosc chunk header\n");
+		return -1;
+	}
+
+	chunk = job_space(&job->inbuff, &job->in_size, job->in_len, cbytes);
+	memcpy(chunk, header, BLOSC_MAX_OVERHEAD);
+	if (read_full(io, chunk + BLOSC_MAX_OVERHEAD,
+				cbytes - BLOSC_MAX_OVERHEAD) < 0)
+		return -1;
+	job_space(&job->base.out, &job->out_size, job->base.out_len, nbytes);
+	job->in_len += cbytes;
+	job->base.out_len += nbytes;
+	return 1;
+}
+
+/* Reads runs of chunks into free jobs and starts decompressing them */
+static int blosc_fill(io_t *io)
+{
+	struct wandio_reader *r = &DATA(io)->reader;
+	struct bloscjob_t *job;
+	int ret = 1;
 
-#if 0
-		/* Decompress some data into the output buffer */
-		int err=inflate(&DATA(io)->strm, 0);
-		switch(err) {
-			case Z_OK:
-				DATA(io)->err = ERR_OK;
-				break;
-			case Z_STREAM_END:
-				/* You would think that an "EOF" on the stream would mean we'd
- 				 * want to pass on an EOF?  Nope.  Some tools (*cough* corel *cough*)
- 				 * annoyingly close and reopen the gzip stream leaving Z_STREAM_END
- 				 * mines for us to find.
- 				 */
-				inflateEnd(&DATA(io)->strm);
-				inflateInit2(&DATA(io)->strm, 15 | 32);
-				DATA(io)->err = ERR_OK;
-                                DATA(io)->sincelastend = 0;
-				break;
-			default:
-				errno=EIO;
-				DATA(io)->err = ERR_ERROR;
+	while (!DATA(io)->last_chunk &&
+			(job = wandio_reader_free_job(r)) != NULL) {
+		job->in_len = 0;
+		job->base.out_len = 0;
+		while (job->base.out_len < JOB_SIZE &&
+				(ret = read_chunk(io, job)) == 1)
+			;
+		if (ret <= 0)
+			DATA(io)->last_chunk = true;
+		if (ret < 0)
+			DATA(io)->read_failed = true;
+		if (job->in_len == 0)
+			break;
+		wandio_reader_submit(r, job);
+	}
+	return 0;
+}
+
+/* Everything before a short chunk has been handed out by now */
+static int blosc_idle(io_t *io, uint8_t **out, size_t *len)
+{
+	(void)out;
+	(void)len;
+	return DATA(io)->read_failed ? -1 : 0;
+}
+
+static int blosc_restart(io_t *io, size_t chunk)
+{
+	if (chunk >= DATA(io)->nchunks) {
+		DATA(io)->last_chunk = true;
+		return 0;
+	}
+	DATA(io)->last_chunk = false;
+	DATA(io)->read_failed = false;
+	if (wandio_seek(DATA(io)->parent, DATA(io)->in_start +
+			DATA(io)->chunks[chunk].comp_off, SEEK_SET) < 0)
+		return -1;
+	return 0;
+}
+
+static void blosc_free_job(void *data)
+{
+	struct bloscjob_t *job = (struct bloscjob_t *)data;
+
+	free(job->inbuff);
+	free(job->base.out);
+}
+
+static const struct wandio_reader_ops blosc_reader_ops = {
+	"blosc",
+	"blosc chunk",
+	sizeof(struct bloscjob_t),
+	blosc_decode_chunks,
+	blosc_fill,
+	blosc_idle,
+	blosc_restart,
+	blosc_free_job
+};
+
+io_t *blosc_open(io_t *parent, const struct wandio_options *opts)
+{
+	io_t *io;
+	uint8_t magic[sizeof(blosc_magic)];
+	if (!parent)
+		return NULL;
+	io = calloc(1, sizeof(io_t));
+	io->source = &blosc_source;
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct blosc_t));
+
+	DATA(io)->parent = parent;
+	DATA(io)->in_start = wandio_tell(parent);
+
+	if (wandio_peek(parent, magic, sizeof(magic)) == sizeof(magic) &&
+			memcmp(magic, blosc_magic, sizeof(magic)) == 0) {
+		DATA(io)->framed = true;
+		if (!read_index(io)) {
+			free(DATA(io)->chunks);
+			DATA(io)->chunks = NULL;
 		}
-#endif
+		/* Go back to the first chunk, or just skip the magic if we
+		 * can't seek */
+		if (DATA(io)->in_start >= 0) {
+			if (wandio_seek(parent, DATA(io)->in_start +
+					sizeof(magic), SEEK_SET) < 0)
+				goto fail;
+		} else if (read_full(io, magic, sizeof(magic)) != 1)
+			goto fail;
 	}
+
+	if (!wandio_reader_init(&DATA(io)->reader, &blosc_reader_ops, io,
+			wandio_pool_threads(opts), DATA(io)->chunks,
+			DATA(io)->nchunks))
+		goto fail;
+	return io;
+
+fail:
+	free(DATA(io)->chunks);
+	free(io->data);
+	free(io);
+	return NULL;
+}
+
+static int64_t blosc_read(io_t *io, void *buffer, int64_t len)
+{
+	debug("[wandio] %s() ENTER. buf: %p , len: %ld \n", __func__,
+		buffer, len);
 	/* Return the number of bytes decompressed */
-	return len - DATA(io)->avail_out;
+	return wandio_reader_read(&DATA(io)->reader, buffer, len);
+}
+
+static int64_t blosc_tell(io_t *io)
+{
+	return DATA(io)->reader.position;
+}
+
+static int64_t blosc_seek(io_t *io, int64_t offset, int whence)
+{
+	return wandio_reader_seek(&DATA(io)->reader, io, offset, whence);
 }
 
 static void blosc_close(io_t *io)
 {
 	debug("[wandio] %s() \n", __func__);
 
-	//wandio_write() should be here? XXX 
+	wandio_reader_destroy(&DATA(io)->reader);
+	free(DATA(io)->chunks);
 	wandio_destroy(DATA(io)->parent);
 	free(io->data);
 	free(io);
-
-	blosc_destroy();
 }
 
 io_source_t blosc_source = {
 	"blosc",
 	blosc_read,
 	NULL,	/* peek */
-	NULL,	/* tell */
-	NULL,	/* seek */
-	blosc_close
+	blosc_tell,
+	blosc_seek,
+	blosc_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
@@ -26,6 +26,7 @@
 
 
 #include "config.h"
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <bzlib.h>
 #include <sys/types.h>
@@ -35,7 +36,22 @@
 #include <string.h>
 #include <errno.h>
 
-/* Libwandio IO module implementing a bzip reader */
+/* Libwandio IO module implementing a bzip reader
+ *
+ * Without any threads this runs the data through a single decompressor,
+ * starting a new one at the end of each stream. Otherwise we find the
+ * blocks ourselves and decompress them in parallel on a wandio_pool: every
+ * bzip2 block starts with a 48 bit magic number and every stream ends with
+ * another, at any bit offset, so the main thread scans the compressed data
+ * for them (the streams written by a parallel writer are found the same
+ * way). Each block is shifted into a stream of its own, with a header and
+ * an end of stream marker carrying the block's CRC, which any decompressor
+ * will accept.
+ *
+ * The magic numbers can turn up inside compressed data too. A block split
+ * at one of those fails to decompress, so it is joined back up with what
+ * follows it and tried again in the main thread.
+ */
 
 enum err_t {
 	ERR_OK	= 1,
@@ -43,12 +59,66 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
+#define BLOCK_MAGIC 0x314159265359ULL
+#define EOS_MAGIC 0x177245385090ULL
+#define MAGIC_MASK 0xffffffffffffULL
+/* How much to read from the parent at once */
+#define READ_SIZE (1024*1024)
+/* A bzip2 block never compresses to anything like this big, so a failed
+ * block that has grown beyond it must be corrupt rather than just split */
+#define MAX_BLOCK_BITS (2*1024*1024*8ULL)
+
+struct bzjob_t {
+	/* The compressed block, starting "shift" bits into inbuff */
+	uint8_t *inbuff;
+	size_t in_size;
+	unsigned int shift;
+	uint64_t bits;
+	/* From the end of a stream to the next block, nothing to decode */
+	bool gap;
+	/* The block rewritten as a stream of its own */
+	char *stream;
+	size_t stream_size;
+	char *outbuff;
+	size_t out_len;
+	size_t out_size;
+	bool failed;
+};
+
 struct bz_t {
 	bz_stream strm;
 	char inbuff[1024*1024];
 	int outoffset;
 	io_t *parent;
 	enum err_t err;
+	/* Number of complete streams decompressed */
+	int streams;
+
+	/* Everything below is only used with threads */
+	uint8_t *stage;
+	size_t stage_len;
+	size_t stage_size;
+	bool parent_eof;
+	/* Next bit of the staged data to look for a magic number at */
+	uint64_t scan;
+	/* Where the block (or gap) that the scan is in started, if it has */
+	int64_t seg_start;
+	bool seg_gap;
+	/* For each byte, the magic numbers (and bit offsets) whose third
+	 * byte it could be */
+	uint16_t magic_byte[256];
+
+	struct wandio_pool *pool;
+	struct bzjob_t *job;
+	unsigned int slots;
+	/* Number of the next job to be filled */
+	uint64_t next;
+	/* Blocks that failed, waiting for the rest of their data */
+	struct bzjob_t carry;
+	/* The data we are currently handing out */
+	char *current;
+	size_t current_len;
+	size_t offset;
 };
 
 
@@ -57,16 +127,154 @@ extern io_source_t bz_source;
 #define DATA(io) ((struct bz_t *)((io)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-io_t *bz_open(io_t *parent)
+/* Appends bits from src (starting shift bits in) to dst, which must be
+ * zeroed from bit "at" onwards. Reads up to one byte past the end of src */
+static void append_bits(uint8_t *dst, uint64_t at, const uint8_t *src,
+		unsigned int shift, uint64_t bits)
+{
+	uint8_t *out = dst + at / 8;
+	unsigned int off = at % 8;
+	uint64_t i;
+	uint8_t byte;
+
+	for (i = 0; i < bits; i += 8, ++src, ++out) {
+		byte = src[0] << shift;
+		if (shift)
+			byte |= src[1] >> (8 - shift);
+		if (bits - i < 8)
+			byte &= 0xff << (8 - (bits - i));
+		out[0] |= byte >> off;
+		if (off)
+			out[1] |= byte << (8 - off);
+	}
+}
+
+/* Reads 56 bits from buf and returns the 48 starting at bit "shift" */
+static uint64_t get_bits48(const uint8_t *buf, unsigned int shift)
+{
+	uint64_t word = 0;
+	int i;
+
+	for (i = 0; i < 7; ++i)
+		word = (word << 8) | buf[i];
+	return (word >> (8 - shift)) & MAGIC_MASK;
+}
+
+/* Runs on a pool thread, and in the main thread to retry split blocks */
+static void bz_decompress_block(void *data, void *arg)
+{
+	struct bzjob_t *job = (struct bzjob_t *)data;
+	uint8_t eos[10];
+	uint32_t crc;
+	size_t stream_len;
+	bz_stream strm;
+	int err;
+
+	(void)arg;
+	job->out_len = 0;
+	job->failed = false;
+	if (job->gap)
+		return;
+	job->failed = true;
+	/* Far too short to be a real block */
+	if (job->bits < 128)
+		return;
+	crc = get_bits48(job->inbuff + 6, job->shift) >> 16;
+
+	/* A header claiming the largest block size, the block, then the end
+	 * of stream magic and the stream CRC, which for a single block is
+	 * just the block CRC */
+	stream_len = 4 + (job->bits + 80 + 7) / 8;
+	if (job->stream_size < stream_len + 1) {
+		job->stream_size = stream_len + 1;
+		job->stream = realloc(job->stream, job->stream_size);
+	}
+	memset(job->stream, 0, stream_len + 1);
+	memcpy(job->stream, "BZh9", 4);
+	append_bits((uint8_t *)job->stream, 32, job->inbuff, job->shift,
+			job->bits);
+	eos[0] = (EOS_MAGIC >> 40) & 0xff;
+	eos[1] = (EOS_MAGIC >> 32) & 0xff;
+	eos[2] = (EOS_MAGIC >> 24) & 0xff;
+	eos[3] = (EOS_MAGIC >> 16) & 0xff;
+	eos[4] = (EOS_MAGIC >> 8) & 0xff;
+	eos[5] = EOS_MAGIC & 0xff;
+	eos[6] = crc >> 24;
+	eos[7] = (crc >> 16) & 0xff;
+	eos[8] = (crc >> 8) & 0xff;
+	eos[9] = crc & 0xff;
+	append_bits((uint8_t *)job->stream, 32 + job->bits, eos, 0, 80);
+
+	memset(&strm, 0, sizeof(strm));
+	if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+		return;
+	strm.next_in = job->stream;
+	strm.avail_in = stream_len;
+	for (;;) {
+		if (job->out_len == job->out_size) {
+			job->out_size = job->out_size ? job->out_size * 2 : 
+					1024*1024;
+			job->outbuff = realloc(job->outbuff, job->out_size);
+		}
+		strm.next_out = job->outbuff + job->out_len;
+		strm.avail_out = job->out_size - job->out_len;
+		err = BZ2_bzDecompress(&strm);
+		job->out_len = job->out_size - strm.avail_out;
+		if (err == BZ_STREAM_END) {
+			job->failed = false;
+			break;
+		}
+		if (err != BZ_OK || (strm.avail_in == 0 && strm.avail_out > 0))
+			break;
+	}
+	BZ2_bzDecompressEnd(&strm);
+}
+
+static void bz_parallel_init(io_t *io, unsigned int threads)
+{
+	const uint64_t magic[2] = { BLOCK_MAGIC, EOS_MAGIC };
+	unsigned int i, shift;
+	uint64_t placed;
+
+	/* Whatever bit a magic number starts at, its third byte is one of
+	 * just a few values, so we only need to look closer at those */
+	for (i = 0; i < 2; ++i) {
+		for (shift = 0; shift < 8; ++shift) {
+			placed = magic[i] << (16 - shift);
+			DATA(io)->magic_byte[(placed >> 40) & 0xff] |= 
+					1 << (i * 8 + shift);
+		}
+	}
+	DATA(io)->seg_start = -1;
+
+	DATA(io)->slots = threads * 2;
+	DATA(io)->job = calloc(DATA(io)->slots, sizeof(struct bzjob_t));
+	DATA(io)->pool = wandio_pool_create(threads, DATA(io)->slots,
+			bz_decompress_block, NULL, "bzip");
+	wandio_pool_count_stalls(DATA(io)->pool, &io->stats.consumer_stalls,
+			&io->stats.consumer_stall_ns);
+}
+
+io_t *bz_open(io_t *parent, const struct wandio_options *opts)
 {
 	io_t *io;
+	unsigned int threads;
 	if (!parent)
 		return NULL;
-	io = malloc(sizeof(io_t));
+	io = calloc(1, sizeof(io_t));
 	io->source = &bz_source;
-	io->data = malloc(sizeof(struct bz_t));
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct bz_t));
 
 	DATA(io)->parent = parent;
+	DATA(io)->err = ERR_OK;
+	DATA(io)->streams = 0;
+
+	threads = wandio_pool_threads(opts);
+	if (threads) {
+		bz_parallel_init(io, threads);
+		return io;
+	}
 
 	DATA(io)->strm.next_in = NULL;
 	DATA(io)->strm.avail_in = 0;
@@ -75,7 +283,6 @@ io_t *bz_open(io_t *parent)
 	DATA(io)->strm.bzalloc = NULL;
 	DATA(io)->strm.bzfree = NULL;
 	DATA(io)->strm.opaque = NULL;
-	DATA(io)->err = ERR_OK;
 
 	BZ2_bzDecompressInit(&DATA(io)->strm, 
 		0, 	/* Verbosity */
@@ -84,6 +291,218 @@ io_t *bz_open(io_t *parent)
 	return io;
 }
 
+/* Reads more compressed data, dropping whatever we're finished with */
+static int stage_more(io_t *io)
+{
+	size_t keep;
+	int64_t bytes_read;
+
+	keep = DATA(io)->seg_start >= 0 ? (size_t)DATA(io)->seg_start / 8 :
+			DATA(io)->scan / 8;
+	memmove(DATA(io)->stage, DATA(io)->stage + keep, 
+			DATA(io)->stage_len - keep);
+	DATA(io)->stage_len -= keep;
+	DATA(io)->scan -= keep * 8;
+	if (DATA(io)->seg_start >= 0)
+		DATA(io)->seg_start -= keep * 8;
+
+	/* Room for a read, plus zeroes at the end to look past */
+	if (DATA(io)->stage_size < DATA(io)->stage_len + READ_SIZE + 8) {
+		DATA(io)->stage_size = (DATA(io)->stage_len + READ_SIZE + 8) * 2;
+		DATA(io)->stage = realloc(DATA(io)->stage, 
+				DATA(io)->stage_size);
+	}
+	bytes_read = wandio_read(DATA(io)->parent, 
+			DATA(io)->stage + DATA(io)->stage_len, READ_SIZE);
+	if (bytes_read < 0)
+		return -1;
+	if (bytes_read == 0) {
+		DATA(io)->parent_eof = true;
+		memset(DATA(io)->stage + DATA(io)->stage_len, 0, 8);
+	}
+	DATA(io)->stage_len += bytes_read;
+	return 0;
+}
+
+/* Finds the next block or gap in the compressed data. Returns 1 if there
+ * was one, 0 at the end of the file or -1 on error */
+static int next_segment(io_t *io, int64_t *start, int64_t *end, bool *gap)
+{
+	uint64_t pos, magic;
+	unsigned int shift;
+	uint16_t hits;
+	size_t byte;
+
+	for (;;) {
+		/* We look at seven bytes from each one, but at the end of the
+		 * file the zeroes after it are fine for the last bit */
+		while ((byte = DATA(io)->scan / 8) + (DATA(io)->parent_eof ? 
+				6 : 7) <= DATA(io)->stage_len) {
+			hits = DATA(io)->magic_byte[DATA(io)->stage[byte + 2]];
+			for (shift = DATA(io)->scan % 8; shift < 8; ++shift) {
+				if (!(hits & (0x101 << shift)))
+					continue;
+				magic = get_bits48(DATA(io)->stage + byte, 
+						shift);
+				if (magic != BLOCK_MAGIC && magic != EOS_MAGIC)
+					continue;
+
+				pos = byte * 8 + shift;
+				DATA(io)->scan = pos + 1;
+				*start = DATA(io)->seg_start;
+				*end = pos;
+				*gap = DATA(io)->seg_gap;
+				DATA(io)->seg_start = pos;
+				DATA(io)->seg_gap = (magic == EOS_MAGIC);
+				/* Anything before the first magic is just the
+				 * stream header */
+				if (*start >= 0)
+					return 1;
+			}
+			DATA(io)->scan = (byte + 1) * 8;
+		}
+
+		if (DATA(io)->parent_eof) {
+			/* The rest of the file is the last segment */
+			if (DATA(io)->seg_start < 0)
+				return 0;
+			*start = DATA(io)->seg_start;
+			*end = DATA(io)->stage_len * 8;
+			*gap = DATA(io)->seg_gap;
+			DATA(io)->seg_start = -1;
+			DATA(io)->scan = *end;
+			return 1;
+		}
+		if (stage_more(io) < 0)
+			return -1;
+	}
+}
+
+/* Copies the bits of a segment of the staged data into a job */
+static void fill_job(io_t *io, struct bzjob_t *job, int64_t start, 
+		int64_t end, bool gap)
+{
+	size_t first = start / 8;
+	size_t len = (end + 7) / 8 - first;
+
+	/* One more byte for append_bits() to read */
+	if (job->in_size < len + 1) {
+		job->in_size = len + 1;
+		job->inbuff = realloc(job->inbuff, job->in_size);
+	}
+	memcpy(job->inbuff, DATA(io)->stage + first, len);
+	job->inbuff[len] = 0;
+	job->shift = start % 8;
+	job->bits = end - start;
+	job->gap = gap;
+}
+
+/* Adds a job's bits onto the end of the failed block(s) in carry */
+static void carry_job(io_t *io, struct bzjob_t *job)
+{
+	struct bzjob_t *carry = &DATA(io)->carry;
+	size_t need = (carry->bits + job->bits + 7) / 8 + 2;
+
+	if (carry->in_size < need) {
+		carry->inbuff = realloc(carry->inbuff, need * 2);
+		memset(carry->inbuff + carry->in_size, 0, 
+				need * 2 - carry->in_size);
+		carry->in_size = need * 2;
+	}
+	append_bits(carry->inbuff, carry->bits, job->inbuff, job->shift,
+			job->bits);
+	carry->bits += job->bits;
+}
+
+/* Makes sure there is decompressed data to hand out, starting the next
+ * blocks once we've finished with a job. Returns the amount of data 
+ * available, 0 at the end of the file or -1 on error */
+static int64_t next_data(io_t *io)
+{
+	struct bzjob_t *carry = &DATA(io)->carry;
+	struct bzjob_t *job;
+	int64_t start, end;
+	bool gap;
+	int ret;
+
+	while (DATA(io)->offset >= DATA(io)->current_len) {
+		/* Keep every slot busy, now that the job we were reading from
+		 * is free again */
+		while (wandio_pool_pending(DATA(io)->pool) < DATA(io)->slots) {
+			ret = next_segment(io, &start, &end, &gap);
+			if (ret < 0)
+				return -1;
+			if (ret == 0)
+				break;
+			job = &DATA(io)->job[DATA(io)->next % DATA(io)->slots];
+			fill_job(io, job, start, end, gap);
+			wandio_pool_submit(DATA(io)->pool, job);
+			DATA(io)->next++;
+		}
+
+		job = wandio_pool_wait(DATA(io)->pool, true);
+		if (!job) {
+			if (carry->bits == 0)
+				return 0;
+			fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+			return -1;
+		}
+
+		if (carry->bits > 0) {
+			/* Whatever this job made of it, its data really
+			 * belongs on the end of the block that failed */
+			carry_job(io, job);
+			bz_decompress_block(carry, NULL);
+			if (carry->failed) {
+				if (carry->bits > MAX_BLOCK_BITS)
+					return -1;
+				continue;
+			}
+			carry->bits = 0;
+			job = carry;
+		}
+		else if (job->failed) {
+			/* Maybe split at something that just looked like a
+			 * magic number, we'll see when we have more */
+			if (carry->inbuff)
+				memset(carry->inbuff, 0, carry->in_size);
+			carry_job(io, job);
+			continue;
+		}
+		DATA(io)->current = job->outbuff;
+		DATA(io)->current_len = job->out_len;
+		DATA(io)->offset = 0;
+	}
+	return DATA(io)->current_len - DATA(io)->offset;
+}
+
+static int64_t bz_read_parallel(io_t *io, void *buffer, int64_t len)
+{
+	int64_t copied = 0;
+	int64_t avail;
+
+	while (copied < len) {
+		avail = next_data(io);
+		if (avail < 0) {
+			fprintf(stderr, "Error decompressing bzip2 block\n");
+			DATA(io)->err = ERR_ERROR;
+			if (copied)
+				break;
+			errno = EIO;
+			return -1;
+		}
+		if (avail == 0) {
+			DATA(io)->err = ERR_EOF;
+			break;
+		}
+		avail = min(avail, len - copied);
+		memcpy((char *)buffer + copied, 
+				DATA(io)->current + DATA(io)->offset, avail);
+		DATA(io)->offset += avail;
+		copied += avail;
+	}
+	return copied;
+}
 
 static int64_t bz_read(io_t *io, void *buffer, int64_t len)
 {
@@ -94,6 +513,9 @@ static int64_t bz_read(io_t *io, void *buffer, int64_t len)
 		return -1; /* ERROR! */
 	}
 
+	if (DATA(io)->pool)
+		return bz_read_parallel(io, buffer, len);
+
 	DATA(io)->strm.avail_out = len;
 	DATA(io)->strm.next_out = buffer;
 
@@ -124,8 +546,22 @@ static int64_t bz_read(io_t *io, void *buffer, int64_t len)
 				DATA(io)->err = ERR_OK;
 				break;
 			case BZ_STREAM_END:
-				DATA(io)->err = ERR_EOF;
+				/* Parallel writers produce one stream after
+				 * another, so keep going with whatever input
+				 * is left */
+				BZ2_bzDecompressEnd(&DATA(io)->strm);
+				BZ2_bzDecompressInit(&DATA(io)->strm, 0, 0);
+				DATA(io)->streams++;
+				DATA(io)->err = ERR_OK;
 				break;
+			case BZ_DATA_ERROR_MAGIC:
+				/* Like bunzip2, ignore trailing garbage once
+				 * we've seen a whole stream */
+				if (DATA(io)->streams > 0) {
+					DATA(io)->err = ERR_EOF;
+					break;
+				}
+				/* Fall through */
 			default:
 				errno=EIO;
 				DATA(io)->err = ERR_ERROR;
@@ -137,7 +573,23 @@ static int64_t bz_read(io_t *io, void *buffer, int64_t len)
 
 static void bz_close(io_t *io)
 {
-	BZ2_bzDecompressEnd(&DATA(io)->strm);
+	unsigned int i;
+
+	if (DATA(io)->pool) {
+		wandio_pool_destroy(DATA(io)->pool);
+		for (i = 0; i < DATA(io)->slots; ++i) {
+			free(DATA(io)->job[i].inbuff);
+			free(DATA(io)->job[i].stream);
+			free(DATA(io)->job[i].outbuff);
+		}
+		free(DATA(io)->job);
+		free(DATA(io)->carry.inbuff);
+		free(DATA(io)->carry.stream);
+		free(DATA(io)->carry.outbuff);
+		free(DATA(io)->stage);
+	}
+	else
+		BZ2_bzDecompressEnd(&DATA(io)->strm);
 	wandio_destroy(DATA(io)->parent);
 	free(io->data);
 	free(io);
@@ -149,6 +601,7 @@ io_source_t bz_source = {
 	NULL,	/* peek */
 	NULL,	/* tell */
 	NULL,	/* seek */
-	bz_close
+	bz_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
-
@@ -169,7 +169,7 @@ static int fill_buffer(io_t *io)
 
 io_t *http_open(const char *filename)
 {
-	io_t *io = malloc(sizeof(io_t));
+	io_t *io = calloc(1, sizeof(io_t));
         if (!io) return NULL;
 	io->data = malloc(sizeof(struct http_t));
         if (!io->data) {
@@ -312,5 +312,7 @@ io_source_t http_source = {
 	NULL,
 	http_tell,
 	http_seek,
-	http_close
+	http_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
@@ -0,0 +1,176 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <lz4frame.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Libwandio IO module implementing an lz4 reader
+ *
+ * This reads the lz4 frame format. The decompressor moves on from one frame
+ * to the next and skips skippable frames, so both files written by the lz4
+ * tool and those written by lz4_wopen() (a run of independent frames) can
+ * be read.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+struct lz4_t {
+	LZ4F_dctx *dctx;
+	uint8_t inbuff[1024*1024];
+	size_t in_len;
+	size_t in_pos;
+	io_t *parent;
+	enum err_t err;
+	/* Set between frames, where the file is allowed to end */
+	bool frame_done;
+};
+
+
+extern io_source_t lz4_source;
+
+#define DATA(io) ((struct lz4_t *)((io)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+io_t *lz4_open(io_t *parent, const struct wandio_options *opts)
+{
+	io_t *io;
+
+	/* Frames are decoded one after the other in the calling thread */
+	(void)opts;
+	if (!parent)
+		return NULL;
+	io = calloc(1, sizeof(io_t));
+	io->source = &lz4_source;
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct lz4_t));
+
+	DATA(io)->parent = parent;
+	DATA(io)->err = ERR_OK;
+	DATA(io)->frame_done = true;
+	DATA(io)->in_len = 0;
+	DATA(io)->in_pos = 0;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&DATA(io)->dctx,
+				LZ4F_VERSION))) {
+		free(io->data);
+		free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+static int64_t lz4_read(io_t *io, void *buffer, int64_t len)
+{
+	int64_t bytes_read;
+	int64_t done = 0;
+	size_t in_size, out_size, ret;
+
+	if (DATA(io)->err == ERR_EOF)
+		return 0; /* EOF */
+	if (DATA(io)->err == ERR_ERROR) {
+		errno=EIO;
+		return -1; /* ERROR! */
+	}
+
+	while (done < len) {
+		if (DATA(io)->in_pos == DATA(io)->in_len) {
+			bytes_read = wandio_read(DATA(io)->parent,
+					DATA(io)->inbuff, 
+					sizeof(DATA(io)->inbuff));
+			if (bytes_read == 0) {
+				if (DATA(io)->frame_done) {
+					DATA(io)->err = ERR_EOF;
+					break;
+				}
+				fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+				bytes_read = -1;
+				errno = EIO;
+			}
+			if (bytes_read < 0) {
+				/* errno should be set */
+				DATA(io)->err = ERR_ERROR;
+				/* Return how much data we managed to read ok */
+				if (done > 0)
+					break;
+				return -1;
+			}
+			DATA(io)->in_len = bytes_read;
+			DATA(io)->in_pos = 0;
+		}
+
+		in_size = DATA(io)->in_len - DATA(io)->in_pos;
+		out_size = len - done;
+		ret = LZ4F_decompress(DATA(io)->dctx, (char *)buffer + done, 
+				&out_size, DATA(io)->inbuff + DATA(io)->in_pos,
+				&in_size, NULL);
+		if (LZ4F_isError(ret)) {
+			fprintf(stderr, "Error decompressing lz4 data: %s\n",
+					LZ4F_getErrorName(ret));
+			DATA(io)->err = ERR_ERROR;
+			if (done > 0)
+				break;
+			errno = EIO;
+			return -1;
+		}
+		DATA(io)->in_pos += in_size;
+		done += out_size;
+		/* Only a zero hint means the frame is finished */
+		DATA(io)->frame_done = (ret == 0);
+	}
+	/* Return the number of bytes decompressed */
+	return done;
+}
+
+static void lz4_close(io_t *io)
+{
+	LZ4F_freeDecompressionContext(DATA(io)->dctx);
+	wandio_destroy(DATA(io)->parent);
+	free(io->data);
+	free(io);
+}
+
+io_source_t lz4_source = {
+	"lz4",
+	lz4_read,
+	NULL,	/* peek */
+	NULL,	/* tell */
+	NULL,	/* seek */
+	lz4_close,
+	NULL,	/* borrow */
+	NULL	/* release */
+};
@@ -25,6 +25,7 @@
  */
 
 #include "config.h"
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <lzma.h>
 #include <sys/types.h>
@@ -34,7 +35,26 @@
 #include <string.h>
 #include <errno.h>
 
-/* Libwandio IO module implementing an lzma reader */
+/* Libwandio IO module implementing an lzma reader
+ *
+ * If the file can be seeked, we start by reading the index at the end of
+ * each xz stream, which gives the offset and size of every block both
+ * before and after compression. The blocks can then be decoded
+ * independently: they are read in order and handed to a wandio_pool, and
+ * seeking just means starting again from the block that holds the target.
+ * Blocks too big to sensibly decode in one go (such as a whole file written
+ * by the single-threaded encoder) are streamed through the main thread
+ * instead.
+ *
+ * Anything else (a pipe, a network stream, or a liblzma too old to read
+ * the index for us) is simply decoded as a stream, which can only seek
+ * forwards.
+ */
+
+/* lzma_file_info_decoder() only became a stable interface in 5.4.0 */
+#if LZMA_VERSION >= 50040002
+#define HAVE_LZMA_FILE_INFO 1
+#endif
 
 enum err_t {
 	ERR_OK	= 1,
@@ -42,12 +62,51 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
+/* Blocks bigger than this (uncompressed) are streamed rather than being
+ * decoded in one go on the pool */
+#define MAX_JOB_BLOCK (32*1024*1024)
+
+/* What else we need to know about an xz block, from the index. Where it
+ * starts is in the seek points */
+struct lzmablock_t {
+	uint64_t total_size;	/* Size including header, padding and check */
+	uint64_t unc_size;
+	lzma_check check;
+};
+
+struct lzmajob_t {
+	struct wandio_reader_job base;
+	struct lzmablock_t *block;
+	uint8_t *inbuff;
+	size_t in_size;
+	size_t out_size;
+};
+
 struct lzma_t {
 	uint8_t inbuff[1024*1024];
 	lzma_stream strm;
 	io_t *parent;
 	int outoffset;
 	enum err_t err;
+
+	/* Only uses the pool when we have the index */
+	struct wandio_reader reader;
+
+	/* Everything below is only used when we have the index */
+	struct lzmablock_t *blocks;
+	struct wandio_seek_point *points;
+	size_t nblocks;
+	/* Where the file starts in the parent, and where the parent is now */
+	int64_t in_start;
+	int64_t in_pos;
+
+	/* A block being streamed through strm, with the compressed bytes
+	 * of it still to be read */
+	bool streaming;
+	uint64_t stream_left;
+	lzma_block big;
+	lzma_filter big_filters[LZMA_FILTERS_MAX + 1];
+	uint8_t *big_out;
 };
 
 
@@ -56,19 +115,372 @@ extern io_source_t lzma_source;
 #define DATA(io) ((struct lzma_t *)((io)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-io_t *lzma_open(io_t *parent)
+/* Frees the options that lzma_block_header_decode() allocated */
+static void free_filters(lzma_filter *filters)
+{
+	int i;
+
+	for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+		free(filters[i].options);
+		filters[i].options = NULL;
+	}
+}
+
+/* Runs on a pool thread */
+static void lzma_decode_block(void *data, io_t *io)
+{
+	struct lzmajob_t *job = (struct lzmajob_t *)data;
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block block;
+	size_t in_pos, out_pos = 0;
+	lzma_ret ret;
+
+	(void)io;
+	memset(&block, 0, sizeof(block));
+	block.version = 1;
+	block.check = job->block->check;
+	block.filters = filters;
+	block.header_size = lzma_block_header_size_decode(job->inbuff[0]);
+	job->base.failed = true;
+	if (block.header_size > job->block->total_size ||
+			lzma_block_header_decode(&block, NULL, job->inbuff) 
+			!= LZMA_OK)
+		return;
+
+	in_pos = block.header_size;
+	ret = lzma_block_buffer_decode(&block, NULL, job->inbuff, &in_pos, 
+			job->block->total_size, job->base.out, &out_pos, 
+			job->block->unc_size);
+	free_filters(filters);
+	job->base.failed = (ret != LZMA_OK || 
+			out_pos != job->block->unc_size);
+}
+
+/* Reads exactly len bytes from the parent, at offset "off" into the file */
+static int read_at(io_t *io, uint64_t off, uint8_t *buffer, size_t len)
+{
+	int64_t ret;
+
+	if (DATA(io)->in_pos != (int64_t)off) {
+		if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + off, 
+				SEEK_SET) < 0)
+			return -1;
+		DATA(io)->in_pos = off;
+	}
+	while (len > 0) {
+		ret = wandio_read(DATA(io)->parent, buffer, len);
+		if (ret <= 0)
+			return -1;
+		DATA(io)->in_pos += ret;
+		buffer += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+#ifdef HAVE_LZMA_FILE_INFO
+/* Reads the index of every stream in the file, which tells us where each
+ * block is */
+static lzma_index *read_index(io_t *io)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_index *index = NULL;
+	int64_t end, bytes_read;
+	lzma_ret ret;
+	bool eof = false;
+
+	if (DATA(io)->in_start < 0)
+		return NULL;
+	end = wandio_seek(DATA(io)->parent, 0, SEEK_END);
+	if (end < DATA(io)->in_start || 
+			wandio_seek(DATA(io)->parent, DATA(io)->in_start, 
+				SEEK_SET) < 0)
+		return NULL;
+	if (lzma_file_info_decoder(&strm, &index, UINT64_MAX, 
+				end - DATA(io)->in_start) != LZMA_OK)
+		goto fail;
+
+	for (;;) {
+		if (strm.avail_in == 0 && !eof) {
+			bytes_read = wandio_read(DATA(io)->parent, 
+					DATA(io)->inbuff,
+					sizeof(DATA(io)->inbuff));
+			if (bytes_read < 0)
+				goto fail;
+			eof = (bytes_read == 0);
+			strm.next_in = DATA(io)->inbuff;
+			strm.avail_in = bytes_read;
+		}
+		ret = lzma_code(&strm, eof ? LZMA_FINISH : LZMA_RUN);
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret == LZMA_SEEK_NEEDED) {
+			if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + 
+					strm.seek_pos, SEEK_SET) < 0)
+				goto fail;
+			strm.avail_in = 0;
+			eof = false;
+			continue;
+		}
+		if (ret != LZMA_OK)
+			goto fail;
+	}
+	lzma_end(&strm);
+	return index;
+
+fail:
+	lzma_end(&strm);
+	if (index)
+		lzma_index_end(index, NULL);
+	return NULL;
+}
+#endif
+
+/* Starts streaming a block that is too big to hand to the pool */
+static int start_streaming(io_t *io, size_t i)
+{
+	struct lzmablock_t *block = &DATA(io)->blocks[i];
+	uint64_t comp_off = DATA(io)->points[i].comp_off;
+	uint8_t *header = DATA(io)->inbuff;
+
+	memset(&DATA(io)->big, 0, sizeof(DATA(io)->big));
+	DATA(io)->big.version = 1;
+	DATA(io)->big.check = block->check;
+	DATA(io)->big.filters = DATA(io)->big_filters;
+	DATA(io)->big_filters[0].id = LZMA_VLI_UNKNOWN;
+
+	if (read_at(io, comp_off, header, 1) < 0)
+		return -1;
+	DATA(io)->big.header_size = lzma_block_header_size_decode(header[0]);
+	if (DATA(io)->big.header_size > block->total_size ||
+			read_at(io, comp_off + 1, header + 1, 
+				DATA(io)->big.header_size - 1) < 0 ||
+			lzma_block_header_decode(&DATA(io)->big, NULL, header)
+				!= LZMA_OK)
+		return -1;
+	if (lzma_block_decoder(&DATA(io)->strm, &DATA(io)->big) != LZMA_OK) {
+		free_filters(DATA(io)->big_filters);
+		return -1;
+	}
+	if (!DATA(io)->big_out)
+		DATA(io)->big_out = malloc(sizeof(DATA(io)->inbuff));
+	DATA(io)->strm.avail_in = 0;
+	DATA(io)->stream_left = block->total_size - DATA(io)->big.header_size;
+	DATA(io)->streaming = true;
+	return 0;
+}
+
+static void stop_streaming(io_t *io)
+{
+	lzma_end(&DATA(io)->strm);
+	memset(&DATA(io)->strm, 0, sizeof(DATA(io)->strm));
+	free_filters(DATA(io)->big_filters);
+	DATA(io)->streaming = false;
+}
+
+/* Decodes the next chunk of the block being streamed, returns its size */
+static int64_t stream_more(io_t *io)
+{
+	int64_t bytes_read, produced;
+	lzma_ret ret = LZMA_OK;
+
+	DATA(io)->strm.next_out = DATA(io)->big_out;
+	DATA(io)->strm.avail_out = sizeof(DATA(io)->inbuff);
+	while (DATA(io)->strm.avail_out > 0) {
+		if (DATA(io)->strm.avail_in == 0) {
+			if (DATA(io)->stream_left == 0)
+				return -1; /* Truncated block */
+			bytes_read = wandio_read(DATA(io)->parent, 
+					DATA(io)->inbuff,
+					min(DATA(io)->stream_left, 
+						sizeof(DATA(io)->inbuff)));
+			if (bytes_read <= 0)
+				return -1;
+			DATA(io)->in_pos += bytes_read;
+			DATA(io)->stream_left -= bytes_read;
+			DATA(io)->strm.next_in = DATA(io)->inbuff;
+			DATA(io)->strm.avail_in = bytes_read;
+		}
+		ret = lzma_code(&DATA(io)->strm, LZMA_RUN);
+		if (ret == LZMA_STREAM_END)
+			break;
+		if (ret != LZMA_OK)
+			return -1;
+	}
+	produced = sizeof(DATA(io)->inbuff) - DATA(io)->strm.avail_out;
+	if (ret == LZMA_STREAM_END)
+		stop_streaming(io);
+	return produced;
+}
+
+/* Reads blocks into free jobs and starts decoding them */
+static int lzma_fill(io_t *io)
+{
+	struct wandio_reader *r = &DATA(io)->reader;
+	struct lzmajob_t *job;
+	struct lzmablock_t *block;
+
+	/* A block being streamed reads from the parent itself */
+	if (DATA(io)->streaming)
+		return 0;
+	while (r->next_point < DATA(io)->nblocks &&
+			(job = wandio_reader_free_job(r)) != NULL) {
+		block = &DATA(io)->blocks[r->next_point];
+		if (block->unc_size > MAX_JOB_BLOCK)
+			break;
+		if (job->in_size < block->total_size) {
+			job->in_size = block->total_size;
+			job->inbuff = realloc(job->inbuff, job->in_size);
+		}
+		if (job->out_size < block->unc_size) {
+			job->out_size = block->unc_size;
+			job->base.out = realloc(job->base.out, job->out_size);
+		}
+		if (read_at(io, DATA(io)->points[r->next_point].comp_off, 
+				job->inbuff, block->total_size) < 0)
+			return -1;
+		job->block = block;
+		job->base.out_len = block->unc_size;
+		wandio_reader_submit(r, job);
+		r->next_point++;
+	}
+	return 0;
+}
+
+/* Nothing is in flight, so we're either at the end of the file or at a
+ * block that has to be streamed */
+static int lzma_idle(io_t *io, uint8_t **out, size_t *len)
+{
+	struct wandio_reader *r = &DATA(io)->reader;
+	int64_t ret;
+
+	if (!DATA(io)->streaming) {
+		if (r->next_point == DATA(io)->nblocks)
+			return 0;
+		if (start_streaming(io, r->next_point++) < 0)
+			return -1;
+	}
+	ret = stream_more(io);
+	if (ret < 0)
+		return -1;
+	*out = DATA(io)->big_out;
+	*len = ret;
+	return 1;
+}
+
+static int lzma_restart(io_t *io, size_t point)
+{
+	(void)point;
+	if (DATA(io)->streaming)
+		stop_streaming(io);
+	return 0;
+}
+
+static void lzma_free_job(void *data)
+{
+	struct lzmajob_t *job = (struct lzmajob_t *)data;
+
+	free(job->inbuff);
+	free(job->base.out);
+}
+
+static const struct wandio_reader_ops lzma_reader_ops = {
+	"xz",
+	"xz block",
+	sizeof(struct lzmajob_t),
+	lzma_decode_block,
+	lzma_fill,
+	lzma_idle,
+	lzma_restart,
+	lzma_free_job
+};
+
+/* Tries to set up block-at-a-time decoding, returns false if we can't */
+static bool lzma_open_blocks(io_t *io, const struct wandio_options *opts)
+{
+#ifdef HAVE_LZMA_FILE_INFO
+	lzma_index *index;
+	lzma_index_iter iter;
+	struct lzmablock_t *block;
+	struct wandio_seek_point *point;
+	size_t count;
+
+	index = read_index(io);
+	if (!index)
+		return false;
+
+	/* Always allocate something, a NULL list means we're streaming. The
+	 * last seek point is the end of the data */
+	count = lzma_index_block_count(index) + 1;
+	DATA(io)->blocks = calloc(count, sizeof(struct lzmablock_t));
+	DATA(io)->points = calloc(count, sizeof(struct wandio_seek_point));
+	lzma_index_iter_init(&iter, index);
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK)) {
+		if (!iter.stream.flags) 
+			goto fail;
+		point = &DATA(io)->points[DATA(io)->nblocks];
+		block = &DATA(io)->blocks[DATA(io)->nblocks++];
+		point->comp_off = iter.block.compressed_file_offset;
+		point->unc_off = iter.block.uncompressed_file_offset;
+		block->total_size = iter.block.total_size;
+		block->unc_size = iter.block.uncompressed_size;
+		block->check = iter.stream.flags->check;
+		point[1].comp_off = point->comp_off + block->total_size;
+		point[1].unc_off = point->unc_off + block->unc_size;
+	}
+	lzma_index_end(index, NULL);
+	index = NULL;
+
+	if (!wandio_reader_init(&DATA(io)->reader, &lzma_reader_ops, io,
+			wandio_pool_threads(opts), DATA(io)->points, 
+			DATA(io)->nblocks))
+		goto fail;
+	/* Force the first read to seek to the first block */
+	DATA(io)->in_pos = -1;
+	return true;
+
+fail:
+	if (index)
+		lzma_index_end(index, NULL);
+	free(DATA(io)->blocks);
+	free(DATA(io)->points);
+	DATA(io)->blocks = NULL;
+	DATA(io)->points = NULL;
+	DATA(io)->nblocks = 0;
+	return false;
+#else
+	(void)io;
+	(void)opts;
+	return false;
+#endif
+}
+
+io_t *lzma_open(io_t *parent, const struct wandio_options *opts)
 {
 	io_t *io;
 	if (!parent)
 		return NULL;
-	io = malloc(sizeof(io_t));
+	io = calloc(1, sizeof(io_t));
 	io->source = &lzma_source;
-	io->data = malloc(sizeof(struct lzma_t));
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct lzma_t));
 
 	DATA(io)->parent = parent;
 
         memset(&DATA(io)->strm, 0, sizeof(DATA(io)->strm));
 	DATA(io)->err = ERR_OK;
+	DATA(io)->in_start = wandio_tell(parent);
+
+	if (lzma_open_blocks(io, opts))
+		return io;
+
+	/* If reading the index failed part way through, start again */
+	if (DATA(io)->in_start >= 0 && 
+			wandio_seek(parent, DATA(io)->in_start, SEEK_SET) < 0) {
+		free(io->data);
+		free(io);
+		return NULL;
+	}
 
         if (lzma_auto_decoder(&DATA(io)->strm, UINT64_MAX, 0) != LZMA_OK) {
             free(io->data);
@@ -80,9 +492,10 @@ io_t *lzma_open(io_t *parent)
 	return io;
 }
 
-
 static int64_t lzma_read(io_t *io, void *buffer, int64_t len)
 {
+	int64_t out;
+
 	if (DATA(io)->err == ERR_EOF)
 		return 0; /* EOF */
 	if (DATA(io)->err == ERR_ERROR) {
@@ -90,6 +503,9 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len)
 		return -1; /* ERROR! */
 	}
 
+	if (DATA(io)->blocks)
+		return wandio_reader_read(&DATA(io)->reader, buffer, len);
+
 	DATA(io)->strm.avail_out = len;
 	DATA(io)->strm.next_out = buffer;
 
@@ -106,14 +522,18 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len)
 				}
                                 /* Return how much data we've managed to read
                                  * so far. */
-				return len-DATA(io)->strm.avail_out;
+				out = len-DATA(io)->strm.avail_out;
+				DATA(io)->reader.position += out;
+				return out;
 			}
 			if (bytes_read < 0) { /* Error */
 				/* errno should be set */
 				DATA(io)->err = ERR_ERROR;
 				/* Return how much data we managed to read ok */
 				if (DATA(io)->strm.avail_out != (uint32_t)len) {
-					return len-DATA(io)->strm.avail_out;
+					out = len-DATA(io)->strm.avail_out;
+					DATA(io)->reader.position += out;
+					return out;
 				}
 				/* Now return error */
 				return -1;
@@ -136,11 +556,29 @@ static int64_t lzma_read(io_t *io, void *buffer, int64_t len)
 		}
 	}
 	/* Return the number of bytes decompressed */
-	return len-DATA(io)->strm.avail_out;
+	out = len-DATA(io)->strm.avail_out;
+	DATA(io)->reader.position += out;
+	return out;
+}
+
+static int64_t lzma_tell(io_t *io)
+{
+	return DATA(io)->reader.position;
+}
+
+static int64_t lzma_seek(io_t *io, int64_t offset, int whence)
+{
+	return wandio_reader_seek(&DATA(io)->reader, io, offset, whence);
 }
 
 static void lzma_close(io_t *io)
 {
+	wandio_reader_destroy(&DATA(io)->reader);
+	if (DATA(io)->streaming)
+		free_filters(DATA(io)->big_filters);
+	free(DATA(io)->big_out);
+	free(DATA(io)->blocks);
+	free(DATA(io)->points);
 	lzma_end(&DATA(io)->strm);
 	wandio_destroy(DATA(io)->parent);
 	free(io->data);
@@ -151,8 +589,9 @@ io_source_t lzma_source = {
 	"lzma",
 	lzma_read,
 	NULL,	/* peek */
-	NULL,	/* tell */
-	NULL,	/* seek */
-	lzma_close
+	lzma_tell,
+	lzma_seek,
+	lzma_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
-
@@ -0,0 +1,567 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+/* This reads lzo files in the format written by lzop (and by lzo_wopen()).
+ *
+ * Every block in an lzop file starts with its uncompressed and compressed
+ * lengths, so the main thread can split the file into runs of whole blocks
+ * without decompressing anything. The runs are then decompressed, and their
+ * checksums verified, in parallel on a wandio_pool.
+ */
+
+#include "config.h"
+#include <lzo/lzo1x.h>
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+
+enum {
+	M_LZO1X_1     =     1,
+	M_LZO1X_1_15  =     2,
+	M_LZO1X_999   =     3,
+};
+
+enum {
+	F_ADLER32_D     = 0x00000001L,
+	F_ADLER32_C     = 0x00000002L,
+	F_H_EXTRA_FIELD = 0x00000040L,
+	F_CRC32_D       = 0x00000100L,
+	F_CRC32_C       = 0x00000200L,
+	F_MULTIPART     = 0x00000400L,
+	F_H_FILTER      = 0x00000800L,
+	F_H_CRC32       = 0x00001000L,
+};
+
+/* The largest block lzop will write, anything bigger is corrupt */
+enum { MAX_BLOCK_SIZE = 64*1024*1024 };
+
+static const unsigned char lzop_magic[9] =
+    { 0x89, 0x4c, 0x5a, 0x4f, 0x00, 0x0d, 0x0a, 0x1a, 0x0a };
+
+/* Libwandio IO module implementing a lzo reader */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+static const int ADLER32_INIT_VALUE = 1;
+static const int CRC32_INIT_VALUE = 0;
+
+/* Roughly how much uncompressed data to give each job */
+#define JOB_OUTPUT (1024*1024)
+/* How much to read from the parent at once */
+#define READ_SIZE (1024*1024)
+
+struct lzoblock_t {
+	size_t in_off;
+	uint32_t src_len;
+	uint32_t dst_len;
+	/* Only checked if the header flags say they are there */
+	uint32_t d_adler;
+	uint32_t d_crc;
+	uint32_t c_adler;
+	uint32_t c_crc;
+};
+
+struct lzojob_t {
+	/* A run of whole blocks, without their headers */
+	struct lzoblock_t *block;
+	unsigned int blocks;
+	unsigned int block_size;
+	unsigned char *inbuff;
+	size_t in_len;
+	size_t in_size;
+	/* Their decompressed contents */
+	unsigned char *outbuff;
+	size_t out_len;
+	size_t out_size;
+	bool failed;
+};
+
+struct lzo_t {
+	io_t *parent;
+	enum err_t err;
+	/* From the file header */
+	uint32_t flags;
+	/* Compressed data read from the parent but not yet given to a job */
+	unsigned char *stage;
+	size_t stage_start;
+	size_t stage_len;
+	size_t stage_size;
+	bool parent_eof;
+	/* Seen the zero length block that ends the file */
+	bool finished;
+	/* Set if the blocks ran out early or couldn't be read, reported once
+	 * everything before that has been handed out */
+	bool read_failed;
+
+	struct wandio_pool *pool;
+	struct lzojob_t *job;
+	unsigned int slots;
+	/* Number of the next job to be filled */
+	uint64_t next;
+	/* The job we are currently handing data out of, and how far into it
+	 * we are */
+	struct lzojob_t *current;
+	size_t offset;
+};
+
+extern io_source_t lzo_source;
+
+#define DATA(io) ((struct lzo_t *)((io)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+static uint32_t read32(const unsigned char *buf)
+{
+	return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | 
+			buf[3];
+}
+
+static uint16_t read16(const unsigned char *buf)
+{
+	return (buf[0] << 8) | buf[1];
+}
+
+/* Runs on a pool thread */
+static void lzo_decompress_run(void *data, void *arg)
+{
+	struct lzojob_t *job = (struct lzojob_t *)data;
+	uint32_t flags = *(uint32_t *)arg;
+	struct lzoblock_t *block;
+	const unsigned char *in;
+	unsigned char *out = job->outbuff;
+	lzo_uint out_len;
+	unsigned int i;
+
+	job->failed = true;
+	for (i = 0; i < job->blocks; ++i) {
+		block = &job->block[i];
+		in = job->inbuff + block->in_off;
+
+		if (block->src_len < block->dst_len) {
+			if ((flags & F_ADLER32_C) && block->c_adler != 
+					lzo_adler32(ADLER32_INIT_VALUE, in, 
+						block->src_len))
+				return;
+			if ((flags & F_CRC32_C) && block->c_crc != 
+					lzo_crc32(CRC32_INIT_VALUE, in, 
+						block->src_len))
+				return;
+			out_len = block->dst_len;
+			if (lzo1x_decompress_safe(in, block->src_len, out,
+					&out_len, NULL) != LZO_E_OK || 
+					out_len != block->dst_len)
+				return;
+		}
+		else
+			/* Stored uncompressed */
+			memcpy(out, in, block->dst_len);
+
+		if ((flags & F_ADLER32_D) && block->d_adler != 
+				lzo_adler32(ADLER32_INIT_VALUE, out, 
+					block->dst_len))
+			return;
+		if ((flags & F_CRC32_D) && block->d_crc != 
+				lzo_crc32(CRC32_INIT_VALUE, out, 
+					block->dst_len))
+			return;
+		out += block->dst_len;
+	}
+	job->failed = false;
+}
+
+/* Makes sure there are at least len bytes of compressed data staged.
+ * Returns false if the file ends first */
+static bool stage_data(io_t *io, size_t len)
+{
+	int64_t bytes_read;
+
+	while (DATA(io)->stage_len < len) {
+		if (DATA(io)->parent_eof)
+			return false;
+		/* Move what's left to the front and make room for more */
+		memmove(DATA(io)->stage, DATA(io)->stage + DATA(io)->stage_start,
+				DATA(io)->stage_len);
+		DATA(io)->stage_start = 0;
+		if (DATA(io)->stage_size < DATA(io)->stage_len + 
+				(len > READ_SIZE ? len : READ_SIZE)) {
+			DATA(io)->stage_size = DATA(io)->stage_len + 
+				(len > READ_SIZE ? len : READ_SIZE);
+			DATA(io)->stage = realloc(DATA(io)->stage, 
+					DATA(io)->stage_size);
+		}
+		bytes_read = wandio_read(DATA(io)->parent, 
+				DATA(io)->stage + DATA(io)->stage_len,
+				DATA(io)->stage_size - DATA(io)->stage_len);
+		if (bytes_read < 0) {
+			DATA(io)->read_failed = true;
+			return false;
+		}
+		if (bytes_read == 0)
+			DATA(io)->parent_eof = true;
+		DATA(io)->stage_len += bytes_read;
+	}
+	return true;
+}
+
+/* Reads and checks the lzop file header. Returns 0 on success, -1 if the
+ * file is one we can't read */
+static int read_header(io_t *io)
+{
+	const unsigned char *header;
+	size_t len, extra;
+	uint16_t version;
+	uint32_t checksum;
+
+	/* Everything up to and including the length of the name */
+	if (!stage_data(io, sizeof(lzop_magic) + 25))
+		return -1;
+	header = DATA(io)->stage;
+	if (memcmp(header, lzop_magic, sizeof(lzop_magic)) != 0)
+		return -1;
+
+	len = sizeof(lzop_magic);
+	version = read16(header + len);
+	if (version < 0x0940) {
+		fprintf(stderr, "lzop file format version %x is too old\n", 
+				version);
+		return -1;
+	}
+	/* Version, library version, version needed to extract */
+	len += 6;
+	switch (header[len]) {
+		case M_LZO1X_1:
+		case M_LZO1X_1_15:
+		case M_LZO1X_999:
+			break;
+		default:
+			fprintf(stderr, "Unsupported lzop compression method %d\n",
+					header[len]);
+			return -1;
+	}
+	/* Method and level */
+	len += 2;
+	DATA(io)->flags = read32(header + len);
+	len += 4;
+	if (DATA(io)->flags & (F_MULTIPART | F_H_FILTER)) {
+		fprintf(stderr, "Multipart and filtered lzop files are not supported\n");
+		return -1;
+	}
+	/* Mode and mtime */
+	len += 12;
+	/* Name */
+	len += 1 + header[len];
+	if (!stage_data(io, len + 4))
+		return -1;
+	header = DATA(io)->stage;
+
+	if (DATA(io)->flags & F_H_CRC32)
+		checksum = lzo_crc32(CRC32_INIT_VALUE, 
+				header + sizeof(lzop_magic), 
+				len - sizeof(lzop_magic));
+	else
+		checksum = lzo_adler32(ADLER32_INIT_VALUE, 
+				header + sizeof(lzop_magic), 
+				len - sizeof(lzop_magic));
+	if (checksum != read32(header + len)) {
+		fprintf(stderr, "lzop header checksum mismatch\n");
+		return -1;
+	}
+	len += 4;
+
+	/* We have no use for the extra field, but it still has to be 
+	 * skipped */
+	if (DATA(io)->flags & F_H_EXTRA_FIELD) {
+		if (!stage_data(io, len + 4))
+			return -1;
+		extra = read32(DATA(io)->stage + len);
+		len += 4 + extra + 4;
+		if (extra > MAX_BLOCK_SIZE || !stage_data(io, len))
+			return -1;
+	}
+
+	DATA(io)->stage_start = len;
+	DATA(io)->stage_len -= len;
+	return 0;
+}
+
+io_t *lzo_open(io_t *parent, const struct wandio_options *opts)
+{
+	io_t *io;
+	unsigned int threads;
+	if (!parent)
+		return NULL;
+	if (lzo_init() != LZO_E_OK)
+		return NULL;
+	io = calloc(1, sizeof(io_t));
+	io->source = &lzo_source;
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct lzo_t));
+
+	DATA(io)->parent = parent;
+	DATA(io)->err = ERR_OK;
+
+	if (read_header(io) < 0) {
+		fprintf(stderr, "Unable to read lzop file header\n");
+		free(DATA(io)->stage);
+		free(io->data);
+		free(io);
+		return NULL;
+	}
+
+	threads = wandio_pool_threads(opts);
+	DATA(io)->slots = threads ? threads * 2 : 1;
+	DATA(io)->job = calloc(DATA(io)->slots, sizeof(struct lzojob_t));
+	DATA(io)->pool = wandio_pool_create(threads, DATA(io)->slots,
+			lzo_decompress_run, &DATA(io)->flags, "lzo");
+	wandio_pool_count_stalls(DATA(io)->pool, &io->stats.consumer_stalls,
+			&io->stats.consumer_stall_ns);
+
+	return io;
+}
+
+/* Moves whole blocks from the staged data into a job. Returns the number
+ * of blocks, which is 0 at the end of the file or if the first one
+ * couldn't be read */
+static int fill_job(io_t *io, struct lzojob_t *job)
+{
+	const unsigned char *in;
+	struct lzoblock_t *block;
+	uint32_t flags = DATA(io)->flags;
+	size_t header_len;
+
+	job->blocks = 0;
+	job->in_len = 0;
+	job->out_len = 0;
+	while (job->out_len < JOB_OUTPUT && !DATA(io)->finished) {
+		if (!stage_data(io, 4))
+			goto out_of_data;
+		in = DATA(io)->stage + DATA(io)->stage_start;
+		if (read32(in) == 0) {
+			/* End of file marker */
+			DATA(io)->finished = true;
+			break;
+		}
+
+		if (!stage_data(io, 8))
+			goto out_of_data;
+		in = DATA(io)->stage + DATA(io)->stage_start;
+		if (job->blocks == job->block_size) {
+			job->block_size = job->block_size ? 
+					job->block_size * 2 : 16;
+			job->block = realloc(job->block, job->block_size * 
+					sizeof(struct lzoblock_t));
+		}
+		block = &job->block[job->blocks];
+		block->dst_len = read32(in);
+		block->src_len = read32(in + 4);
+		if (block->dst_len > MAX_BLOCK_SIZE || block->src_len == 0 ||
+				block->src_len > block->dst_len) {
+			fprintf(stderr, "Corrupt lzo block header\n");
+			goto failed;
+		}
+
+		/* Whichever checksums the file header said we would have */
+		header_len = 8;
+		if (flags & F_ADLER32_D)
+			header_len += 4;
+		if (flags & F_CRC32_D)
+			header_len += 4;
+		if (block->src_len < block->dst_len) {
+			if (flags & F_ADLER32_C)
+				header_len += 4;
+			if (flags & F_CRC32_C)
+				header_len += 4;
+		}
+		if (!stage_data(io, header_len + block->src_len))
+			goto out_of_data;
+		in = DATA(io)->stage + DATA(io)->stage_start + 8;
+		if (flags & F_ADLER32_D) {
+			block->d_adler = read32(in);
+			in += 4;
+		}
+		if (flags & F_CRC32_D) {
+			block->d_crc = read32(in);
+			in += 4;
+		}
+		if (block->src_len < block->dst_len) {
+			if (flags & F_ADLER32_C) {
+				block->c_adler = read32(in);
+				in += 4;
+			}
+			if (flags & F_CRC32_C) {
+				block->c_crc = read32(in);
+				in += 4;
+			}
+		}
+
+		if (job->in_size < job->in_len + block->src_len) {
+			job->in_size = (job->in_len + block->src_len) * 2;
+			job->inbuff = realloc(job->inbuff, job->in_size);
+		}
+		if (job->out_size < job->out_len + block->dst_len) {
+			job->out_size = (job->out_len + block->dst_len) * 2;
+			job->outbuff = realloc(job->outbuff, job->out_size);
+		}
+		memcpy(job->inbuff + job->in_len, in, block->src_len);
+		block->in_off = job->in_len;
+		job->in_len += block->src_len;
+		job->out_len += block->dst_len;
+		job->blocks++;
+		DATA(io)->stage_start += header_len + block->src_len;
+		DATA(io)->stage_len -= header_len + block->src_len;
+	}
+	return job->blocks;
+
+out_of_data:
+	if (!DATA(io)->read_failed)
+		fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+failed:
+	/* The blocks before this one are still worth handing out */
+	DATA(io)->read_failed = true;
+	return job->blocks;
+}
+
+/* Makes sure there is data in the current job, starting the next ones if
+ * we've finished with it. Returns the amount of data available, 0 at the
+ * end of the file or -1 on error */
+static int64_t next_data(io_t *io)
+{
+	struct lzojob_t *job;
+
+	if (DATA(io)->err == ERR_ERROR) {
+		errno = EIO;
+		return -1;
+	}
+	while (!DATA(io)->current || 
+			DATA(io)->offset >= DATA(io)->current->out_len) {
+		DATA(io)->current = NULL;
+
+		/* Keep every slot busy, now that the job we were reading from
+		 * is free again */
+		while (!DATA(io)->read_failed && !DATA(io)->finished &&
+				wandio_pool_pending(DATA(io)->pool) < 
+				DATA(io)->slots) {
+			job = &DATA(io)->job[DATA(io)->next % DATA(io)->slots];
+			if (fill_job(io, job) <= 0)
+				break;
+			wandio_pool_submit(DATA(io)->pool, job);
+			DATA(io)->next++;
+		}
+
+		/* Hand out everything that was read ok before any error */
+		job = wandio_pool_wait(DATA(io)->pool, true);
+		if (!job && DATA(io)->read_failed) {
+			DATA(io)->err = ERR_ERROR;
+			errno = EIO;
+			return -1;
+		}
+		if (!job)
+			return 0;
+		if (job->failed) {
+			fprintf(stderr, "Error decompressing lzo data\n");
+			DATA(io)->err = ERR_ERROR;
+			errno = EIO;
+			return -1;
+		}
+		DATA(io)->current = job;
+		DATA(io)->offset = 0;
+	}
+	return DATA(io)->current->out_len - DATA(io)->offset;
+}
+
+static int64_t lzo_read(io_t *io, void *buffer, int64_t len)
+{
+	int64_t copied = 0;
+	int64_t avail;
+
+	while (copied < len) {
+		avail = next_data(io);
+		if (avail < 0)
+			return copied ? copied : -1;
+		if (avail == 0)
+			break;
+		avail = min(avail, len - copied);
+		memcpy((char *)buffer + copied, 
+				DATA(io)->current->outbuff + DATA(io)->offset,
+				avail);
+		DATA(io)->offset += avail;
+		copied += avail;
+	}
+	return copied;
+}
+
+/* Hand out a pointer straight into the decompressed data rather than 
+ * copying */
+static int64_t lzo_borrow(io_t *io, const void **buffer, int64_t len)
+{
+	int64_t avail = next_data(io);
+
+	if (avail <= 0)
+		return avail;
+	*buffer = DATA(io)->current->outbuff + DATA(io)->offset;
+	return min(avail, len);
+}
+
+static void lzo_release(io_t *io, int64_t used)
+{
+	if (used > 0)
+		DATA(io)->offset += used;
+}
+
+static void lzo_close(io_t *io)
+{
+	unsigned int i;
+
+	wandio_pool_destroy(DATA(io)->pool);
+	for (i = 0; i < DATA(io)->slots; ++i) {
+		free(DATA(io)->job[i].block);
+		free(DATA(io)->job[i].inbuff);
+		free(DATA(io)->job[i].outbuff);
+	}
+	free(DATA(io)->job);
+	free(DATA(io)->stage);
+	wandio_destroy(DATA(io)->parent);
+	free(io->data);
+	free(io);
+}
+
+io_source_t lzo_source = {
+	"lzo",
+	lzo_read,
+	NULL,	/* peek */
+	NULL,	/* tell */
+	NULL,	/* seek */
+	lzo_close,
+	lzo_borrow,
+	lzo_release
+};
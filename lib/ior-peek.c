@@ -34,6 +34,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 /* Libwandio IO module implementing a peeking reader.
  *
@@ -56,7 +57,9 @@ struct peek_t {
 	io_t *child;
 	char *buffer;
 	int64_t length; /* Length of buffer */
+	int64_t size; /* Allocated size of buffer */
 	int64_t offset; /* Offset into buffer */
+	bool child_borrowed; /* Is the outstanding borrow from the child? */
 };
 
 extern io_source_t peek_source;
@@ -69,15 +72,18 @@ io_t *peek_open(io_t *child)
 	io_t *io;
 	if (!child)
 		return NULL;
-	io =  malloc(sizeof(io_t));
+	io =  calloc(1, sizeof(io_t));
 	io->data = malloc(sizeof(struct peek_t));
 	io->source = &peek_source;
+	io->child = child;
 
 	/* Wrap the peeking reader around the "child" */
 	DATA(io)->child = child;
 	DATA(io)->buffer = NULL;
 	DATA(io)->length = 0;
+	DATA(io)->size = 0;
 	DATA(io)->offset = 0;	
+	DATA(io)->child_borrowed = false;
 
 	return io;
 }
@@ -93,16 +99,19 @@ static int64_t refill_buffer(io_t *io, int64_t len)
 	 * and then round up to the nearest multiple of MIN_READ_SIZE 
 	 */
 	bytes_read = len < PEEK_SIZE ? PEEK_SIZE : len;
-	bytes_read = bytes_read < DATA(io)->length ? DATA(io)->length : bytes_read;
-	bytes_read += MIN_READ_SIZE - (bytes_read % MIN_READ_SIZE);
+	bytes_read = bytes_read < DATA(io)->size ? DATA(io)->size : bytes_read;
+	if (bytes_read % MIN_READ_SIZE)
+		bytes_read += MIN_READ_SIZE - (bytes_read % MIN_READ_SIZE);
 	/* Is the current buffer big enough? */
-	if (DATA(io)->length < bytes_read) {
+	if (DATA(io)->size < bytes_read) {
 		int res = 0;
 		void *buf_ptr = (void *)(DATA(io)->buffer);
 
 		if (buf_ptr)
 			free(buf_ptr);
-		DATA(io)->length = bytes_read;
+		DATA(io)->buffer = NULL;
+		DATA(io)->size = 0;
+		DATA(io)->length = 0;
 		DATA(io)->offset = 0;
 #if _POSIX_C_SOURCE >= 200112L || _XOPEN_SOURCE >= 600
 		/* We need to do this as read() of O_DIRECT might happen into 
@@ -111,7 +120,7 @@ static int64_t refill_buffer(io_t *io, int64_t len)
 		 * will arrive soon, and thus 4k is the minimum I'm willing to 
 		 * live with.
 		 */
-		res = posix_memalign(&buf_ptr, 4096, DATA(io)->length);
+		res = posix_memalign(&buf_ptr, 4096, bytes_read);
 		if (res != 0) {
 			fprintf(stderr, "Error aligning IO buffer: %d\n",
 					res);
@@ -120,17 +129,16 @@ static int64_t refill_buffer(io_t *io, int64_t len)
 		DATA(io)->buffer = buf_ptr;
 #else
 		res = 0;	/* << Silly warning */ 
-		DATA(io)->buffer = malloc(DATA(io)->length);
+		DATA(io)->buffer = malloc(bytes_read);
 #endif
+		DATA(io)->size = bytes_read;
 	}
-	else
-		DATA(io)->length = bytes_read;
 
 	assert(DATA(io)->buffer);
 
 	/* Now actually attempt to read that many bytes */
-	bytes_read = DATA(io)->child->source->read(	
-			DATA(io)->child, DATA(io)->buffer, bytes_read);
+	bytes_read = wandio_read(DATA(io)->child, DATA(io)->buffer, 
+			bytes_read);
 
 	DATA(io)->offset = 0;
 	DATA(io)->length = bytes_read;
@@ -143,6 +151,17 @@ static int64_t refill_buffer(io_t *io, int64_t len)
 	
 }
 
+/* Throw away the buffer and whatever is left in it */
+static void free_buffer(io_t *io)
+{
+	if (DATA(io)->buffer)
+		free(DATA(io)->buffer);
+	DATA(io)->buffer = NULL;
+	DATA(io)->offset = 0;
+	DATA(io)->length = 0;
+	DATA(io)->size = 0;
+}
+
 static int64_t peek_read(io_t *io, void *buffer, int64_t len)
 {
 	int64_t ret = 0;
@@ -177,8 +196,8 @@ static int64_t peek_read(io_t *io, void *buffer, int64_t len)
 		 */
 		if ((len % MIN_READ_SIZE  == 0) && ((ptrdiff_t)buffer % 4096)==0) {
 			assert(((ptrdiff_t)buffer % 4096) == 0);
-			bytes_read = DATA(io)->child->source->read(
-					DATA(io)->child, buffer, len);
+			bytes_read = wandio_read(DATA(io)->child, buffer, 
+					len);
 			/* Error? */
 			if (bytes_read < 1) {
 				/* Return if we have managed to get some data ok */
@@ -210,10 +229,7 @@ static int64_t peek_read(io_t *io, void *buffer, int64_t len)
 	/* Have we read past the end of the buffer? */
 	if (DATA(io)->buffer && DATA(io)->offset >= DATA(io)->length) {
 		/* If so, free the memory it used */
-		free(DATA(io)->buffer);
-		DATA(io)->buffer = NULL;
-		DATA(io)->offset = 0;
-		DATA(io)->length = 0;
+		free_buffer(io);
 	}
 
 	return ret;
@@ -257,12 +273,18 @@ static int64_t peek_peek(io_t *io, void *buffer, int64_t len)
 		int64_t read_amount = len - (DATA(io)->length - DATA(io)->offset);
 		/* Round the read_amount up to the nearest MB */
 		read_amount += PEEK_SIZE - ((DATA(io)->length + read_amount) % PEEK_SIZE);
-		DATA(io)->buffer = alignedrealloc(DATA(io)->buffer, 
-			DATA(io)->length, 
-			DATA(io)->length + read_amount, &res);
-
-		if (DATA(io)->buffer == NULL) {
-			return res;	
+		if (DATA(io)->size < DATA(io)->length + read_amount) {
+			DATA(io)->buffer = alignedrealloc(DATA(io)->buffer, 
+				DATA(io)->length, 
+				DATA(io)->length + read_amount, &res);
+
+			if (DATA(io)->buffer == NULL) {
+				DATA(io)->size = 0;
+				DATA(io)->length = 0;
+				DATA(io)->offset = 0;
+				return res;	
+			}
+			DATA(io)->size = DATA(io)->length + read_amount;
 		}
 
 		/* Use the child reader to read more data into our managed
@@ -286,18 +308,105 @@ static int64_t peek_peek(io_t *io, void *buffer, int64_t len)
 	return ret;
 }
 
+/* Returns how much data we are holding that hasn't been read yet */
+static int64_t buffered(io_t *io)
+{
+	if (!DATA(io)->buffer || DATA(io)->length < 0)
+		return 0;
+	return DATA(io)->length - DATA(io)->offset;
+}
+
 static int64_t peek_tell(io_t *io)
 {
+	int64_t ret;
+
 	/* We don't actually maintain a read offset as such, so we want to
-	 * return the child's read offset */
-	return wandio_tell(DATA(io)->child);
+	 * return the child's read offset less anything we have buffered */
+	ret = wandio_tell(DATA(io)->child);
+	if (ret < 0)
+		return ret;
+	return ret - buffered(io);
 }
 
 static int64_t peek_seek(io_t *io, int64_t offset, int whence)
 {
-	/* Again, we don't have a genuine read offset so we need to pass this
-	 * one on to the child */
-	return wandio_seek(DATA(io)->child,offset,whence);
+	int64_t ret, pos;
+
+	/* If it lands in what we've got buffered, just skip up to it. The
+	 * child has already read past it, and may not be able to go back */
+	if (whence != SEEK_END && buffered(io) > 0 &&
+			(pos = peek_tell(io)) >= 0) {
+		if (whence == SEEK_CUR) {
+			offset += pos;
+			whence = SEEK_SET;
+		}
+		if (offset >= pos && offset - pos <= buffered(io)) {
+			DATA(io)->offset += offset - pos;
+			return offset;
+		}
+	}
+
+	/* Otherwise, we don't have a genuine read offset so we need to pass
+	 * this one on to the child. Whatever we had buffered is no longer
+	 * wanted */
+	if (whence == SEEK_CUR)
+		offset -= buffered(io);
+	ret = wandio_seek(DATA(io)->child,offset,whence);
+	if (ret < 0)
+		return ret;
+
+	free_buffer(io);
+	return ret;
+}
+
+/* Hand out data without copying it into the caller's buffer. Anything we
+ * already hold (e.g. because it was peeked at) has to be handed out first,
+ * after that we pass straight through to the child if it supports
+ * borrowing. If it doesn't, we read into our own buffer and lend that out
+ * instead, which still saves the caller a copy.
+ */
+static int64_t peek_borrow(io_t *io, const void **buffer, int64_t len)
+{
+	int64_t bytes_read;
+
+        /* Have we previously encountered an error? */
+        if (DATA(io)->length < 0) {
+                return DATA(io)->length;
+        }
+
+	if (!DATA(io)->buffer || DATA(io)->offset >= DATA(io)->length) {
+		if (DATA(io)->child->source->borrow) {
+			DATA(io)->child_borrowed = true;
+			return wandio_read_borrow(DATA(io)->child, buffer, 
+					len);
+		}
+
+		bytes_read = refill_buffer(io, MIN(len, PEEK_SIZE));
+		if (bytes_read < 1)
+			return bytes_read;
+	}
+
+	DATA(io)->child_borrowed = false;
+	*buffer = DATA(io)->buffer + DATA(io)->offset;
+	return MIN(len, DATA(io)->length - DATA(io)->offset);
+}
+
+static void peek_release(io_t *io, int64_t used)
+{
+	if (DATA(io)->child_borrowed) {
+		DATA(io)->child_borrowed = false;
+		wandio_read_release(DATA(io)->child, used);
+		return;
+	}
+
+	DATA(io)->offset += used;
+
+	/* Have we read past the end of the buffer? Keep the memory around,
+	 * the next borrow will most likely want to refill it */
+	if (DATA(io)->buffer && DATA(io)->offset >= DATA(io)->length) {
+		DATA(io)->offset = 0;
+		DATA(io)->length = 0;
+	}
 }
 
 static void peek_close(io_t *io)
@@ -316,6 +425,8 @@ io_source_t peek_source = {
 	peek_peek,
 	peek_tell,
 	peek_seek,
-	peek_close
+	peek_close,
+	peek_borrow,
+	peek_release
 };
 
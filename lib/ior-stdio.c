@@ -47,9 +47,9 @@ extern io_source_t stdio_source;
 
 #define DATA(io) ((struct stdio_t *)((io)->data))
 
-io_t *stdio_open(const char *filename)
+io_t *stdio_open(const char *filename, const struct wandio_options *opts)
 {
-	io_t *io = malloc(sizeof(io_t));
+	io_t *io = calloc(1, sizeof(io_t));
 	io->data = malloc(sizeof(struct stdio_t));
 
 	if (strcmp(filename,"-") == 0)
@@ -58,12 +58,13 @@ io_t *stdio_open(const char *filename)
 		DATA(io)->fd = open(filename,
 			O_RDONLY
 #ifdef O_DIRECT
-			|(force_directio_read?O_DIRECT:0)
+			|(opts->direct_io?O_DIRECT:0)
 #endif
 			);
 	io->source = &stdio_source;
 
 	if (DATA(io)->fd == -1) {
+		free(io->data);
 		free(io);
 		return NULL;
 	}
@@ -99,6 +100,8 @@ io_source_t stdio_source = {
 	NULL,
 	stdio_tell,
 	stdio_seek,
-	stdio_close
+	stdio_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
 
@@ -45,55 +45,202 @@
  *
  * This module enables another IO reader, called the "parent", to perform its
  * reading using a separate thread. The reading thread reads data into a
- * series of 1MB buffers. Once all the buffers are full, it waits for the
- * main thread to free up some of the buffers by consuming data from them. The 
- * reading thread also uses a pthread condition to indicate to the main thread
- * that there is data available in the buffers. 
+ * series of buffers (1MB by default). Once all the buffers are full, it
+ * waits for the
+ * main thread to free up some of the buffers by consuming data from them.
+ *
+ * The buffers form a single-producer/single-consumer ring: the reading
+ * thread only ever advances "head" and the main thread only ever advances
+ * "tail", so handing a buffer over is just a store to one of those indices.
+ * Either side only sleeps (on a wandio_event) when the ring is really empty
+ * or really full.
+ *
+ * Slices are only allocated once the reading thread actually gets ahead of
+ * the main thread, up to the ring depth given in the options. Slices the main
+ * thread has finished with go back to a list of spares for the reading
+ * thread to reuse, so a small file or a reader that keeps up costs a slice
+ * or two rather than the whole ring's worth of memory.
  */
 
 /* 1MB Buffer */
 #define BUFFERSIZE (1024*1024)
+#define BUFFERS 50
 
 extern io_source_t thread_source;
 
+static void thread_close(io_t *io);
+
 /* This structure defines a single buffer or "slice" */
 struct buffer_t {
-	char buffer[BUFFERSIZE];	/* The buffer itself */
 	int len;			/* The size of the buffer */
-	enum { EMPTY = 0, FULL = 1 } state;	/* Is the buffer in use? */
+	struct buffer_t *next;		/* The next spare slice */
+	char buffer[];			/* The buffer itself */
 };
 
 struct state_t {
-	/* The collection of buffers (or slices) */
-	struct buffer_t *buffer;
-	/* The index of the buffer to read into next */
-	int in_buffer;
-	/* The read offset into the current buffer */
-	int64_t offset;
+	/* The ring of filled buffers (or slices) */
+	struct buffer_t **buffer;
+	/* The number of slices in the ring, and the most we'll allocate */
+	unsigned int nbuffers;
+	/* The size of each slice */
+	int slice_size;
+	/* Print the number of times we had to wait when closing */
+	bool stats;
 	/* The reading thread */
 	pthread_t producer;
-	/* Indicates that there is a free buffer to read into */
-	pthread_cond_t space_avail;
-	/* Indicates that there is data in one of the buffers */
-	pthread_cond_t data_ready;
-	/* The mutex for the read buffers */
-	pthread_mutex_t mutex;
 	/* The parent reader */
 	io_t *io;
 	/* Indicates whether the main thread is concluding */
 	bool closing;
+	/* Whether the reading thread has been started (and not yet joined) */
+	bool producing;
+
+	/* Number of slices filled by the reading thread */
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Signalled when the reading thread fills a slice */
+	struct wandio_event data_ready;
+	/* Slices that the reading thread can reuse */
+	struct buffer_t *spare;
+	/* The number of slices allocated so far */
+	unsigned int allocated;
+	/* Number of consumed slices moved onto the spare list */
+	uint32_t reclaimed;
+	/* The ring index of the next slice to be moved onto the spare list */
+	int reclaim_buffer;
+	/* The ring index of the next slice to be filled */
+	int fill_buffer;
+
+	/* Number of slices consumed by the main thread */
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* The index of the buffer to read from next */
+	int in_buffer;
+	/* The read offset into the current buffer */
+	int64_t offset;
+	/* The offset in the parent of the next byte we hand out, -1 if the
+	 * parent doesn't know */
+	int64_t position;
+	/* Signalled when the main thread frees up a slice */
+	struct wandio_event space_avail;
 };
 
 #define DATA(x) ((struct state_t *)((x)->data))
-#define INBUFFER(x) (DATA(x)->buffer[DATA(x)->in_buffer])
+#define INBUFFER(x) (*DATA(x)->buffer[DATA(x)->in_buffer])
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
+/* Wait until there is a free slice for the reading thread to fill, returns
+ * false if we are shutting down instead */
+static bool wait_for_space(io_t *state, uint32_t head)
+{
+	uint32_t token;
+	uint64_t start = 0;
+
+	while (head - __atomic_load_n(&DATA(state)->tail, __ATOMIC_ACQUIRE)
+			>= DATA(state)->nbuffers) {
+		if (__atomic_load_n(&DATA(state)->closing, __ATOMIC_SEQ_CST))
+			return false;
+		if (!start)
+			start = wandio_clock_ns();
+		token = wandio_event_prepare(&DATA(state)->space_avail);
+		if (head - __atomic_load_n(&DATA(state)->tail, __ATOMIC_SEQ_CST)
+				< DATA(state)->nbuffers ||
+				__atomic_load_n(&DATA(state)->closing,
+					__ATOMIC_SEQ_CST)) {
+			wandio_event_cancel(&DATA(state)->space_avail);
+			continue;
+		}
+		wandio_event_wait(&DATA(state)->space_avail, token);
+	}
+	if (start)
+		wandio_stat_stall(&state->stats.producer_stalls,
+				&state->stats.producer_stall_ns, start);
+	return !__atomic_load_n(&DATA(state)->closing, __ATOMIC_SEQ_CST);
+}
+
+/* Move any slices the main thread has finished with onto the spare list */
+static void reclaim_slices(io_t *state)
+{
+	uint32_t tail = __atomic_load_n(&DATA(state)->tail, __ATOMIC_ACQUIRE);
+	struct buffer_t *slice;
+
+	while (DATA(state)->reclaimed != tail) {
+		slice = DATA(state)->buffer[DATA(state)->reclaim_buffer];
+		DATA(state)->buffer[DATA(state)->reclaim_buffer] = NULL;
+		slice->next = DATA(state)->spare;
+		DATA(state)->spare = slice;
+
+		DATA(state)->reclaim_buffer = (DATA(state)->reclaim_buffer+1)
+				% DATA(state)->nbuffers;
+		DATA(state)->reclaimed++;
+	}
+}
+
+/* Find a slice for the reading thread to fill: reuse a spare one if we
+ * can, allocate a new one if we're still under our limit, otherwise wait
+ * for the main thread to finish with one. Returns NULL if we are shutting
+ * down instead */
+static struct buffer_t *get_slice(io_t *state, uint32_t head)
+{
+	struct buffer_t *slice;
+
+	for (;;) {
+		reclaim_slices(state);
+		if (DATA(state)->spare) {
+			slice = DATA(state)->spare;
+			DATA(state)->spare = slice->next;
+			return slice;
+		}
+		if (DATA(state)->allocated < DATA(state)->nbuffers) {
+			slice = malloc(sizeof(struct buffer_t) + 
+					DATA(state)->slice_size);
+			if (slice) {
+				DATA(state)->allocated++;
+				return slice;
+			}
+		}
+		if (!wait_for_space(state, head))
+			return NULL;
+	}
+}
+
+/* Wait until the reading thread has filled the slice the main thread wants
+ * to read from next. Returns false if there is no reading thread to wait
+ * for, i.e. it could not be restarted after a seek */
+static bool wait_for_data(io_t *state)
+{
+	uint32_t tail = DATA(state)->tail;
+	uint32_t token;
+	uint64_t start;
+
+	if (__atomic_load_n(&DATA(state)->head, __ATOMIC_ACQUIRE) != tail)
+		return true;
+	if (!DATA(state)->producing) {
+		errno = EIO;
+		return false;
+	}
+
+	start = wandio_clock_ns();
+	do {
+		token = wandio_event_prepare(&DATA(state)->data_ready);
+		if (__atomic_load_n(&DATA(state)->head, __ATOMIC_SEQ_CST)
+				!= tail) {
+			wandio_event_cancel(&DATA(state)->data_ready);
+			break;
+		}
+		wandio_event_wait(&DATA(state)->data_ready, token);
+	} while (__atomic_load_n(&DATA(state)->head, __ATOMIC_ACQUIRE) == tail);
+	wandio_stat_stall(&state->stats.consumer_stalls,
+			&state->stats.consumer_stall_ns, start);
+	return true;
+}
+
 /* The reading thread */
 static void *thread_producer(void* userdata)
 {
 	io_t *state = (io_t*) userdata;
-	int buffer=0;
+	/* Carry on from wherever the last reading thread stopped */
+	uint32_t head=DATA(state)->head;
 	bool running = true;
+	struct buffer_t *slice;
 
 #ifdef PR_SET_NAME
 	char namebuf[17];
@@ -110,109 +257,145 @@ static void *thread_producer(void* userdata)
 	}
 #endif
 
-	pthread_mutex_lock(&DATA(state)->mutex);
 	do {
 		/* If all the buffers are full, we need to wait for one to
-		 * become free otherwise we have nowhere to write to! */
-		while (DATA(state)->buffer[buffer].state == FULL) {
-			if (DATA(state)->closing)
-				break;
-			pthread_cond_wait(&DATA(state)->space_avail, &DATA(state)->mutex);
-		}
+		 * become free otherwise we have nowhere to write to! Don't
+		 * bother reading any more data if we are shutting up shop */
+		slice = get_slice(state, head);
+		if (!slice)
+			break;
 
-		/* Don't bother reading any more data if we are shutting up
-		 * shop */
-		if (DATA(state)->closing) {
+		/* Stop as soon as we're asked to, e.g. by a seek, rather than
+		 * carrying on until the ring is full */
+		if (__atomic_load_n(&DATA(state)->closing, __ATOMIC_SEQ_CST)) {
+			slice->next = DATA(state)->spare;
+			DATA(state)->spare = slice;
 			break;
 		}
-		pthread_mutex_unlock(&DATA(state)->mutex);
 
 		/* Get the parent reader to fill the buffer */
-		DATA(state)->buffer[buffer].len=wandio_read(
+		slice->len=wandio_read(
 				DATA(state)->io,
-				DATA(state)->buffer[buffer].buffer,
-				sizeof(DATA(state)->buffer[buffer].buffer));
-
-		pthread_mutex_lock(&DATA(state)->mutex);
-
-		DATA(state)->buffer[buffer].state = FULL;
+				slice->buffer,
+				DATA(state)->slice_size);
 
 		/* If we've not reached the end of the file keep going */
-		running = (DATA(state)->buffer[buffer].len > 0 );
+		running = (slice->len > 0 );
+		DATA(state)->buffer[DATA(state)->fill_buffer] = slice;
 
-		/* Signal that there is data available for the main thread */
-		pthread_cond_signal(&DATA(state)->data_ready);
+		/* Hand the slice over and let the main thread know that
+		 * there is data available */
+		__atomic_store_n(&DATA(state)->head, ++head, __ATOMIC_SEQ_CST);
+		wandio_event_signal(&DATA(state)->data_ready);
 
 		/* Move on to the next buffer */
-		buffer=(buffer+1) % max_buffers;
+		DATA(state)->fill_buffer=(DATA(state)->fill_buffer+1) % 
+				DATA(state)->nbuffers;
 
 	} while(running);
 
-	/* If we reach here, it's all over so start tidying up */
-	wandio_destroy(DATA(state)->io);
-
-	pthread_cond_signal(&DATA(state)->data_ready);
-	pthread_mutex_unlock(&DATA(state)->mutex);
-
+	/* The parent reader is left for thread_close() to destroy, so that
+	 * its statistics can still be looked at after we hit EOF */
 	return NULL;
 }
 
-io_t *thread_open(io_t *parent)
+/* Create the reading thread, with every signal blocked so that they are
+ * all delivered to the main thread */
+static int start_producer(io_t *state)
 {
-	io_t *state;
 	sigset_t set;
 	int s;
 
+	sigfillset(&set);
+	s = pthread_sigmask(SIG_SETMASK, &set, NULL);
+        if (s != 0) {
+                return s;
+        }
+	s = pthread_create(&DATA(state)->producer,NULL,thread_producer,state);
+	sigemptyset(&set);
+	if (s != 0) {
+		pthread_sigmask(SIG_SETMASK, &set, NULL);
+		return s;
+	}
+	DATA(state)->producing = true;
+	return pthread_sigmask(SIG_SETMASK, &set, NULL);
+}
+
+io_t *thread_open(io_t *parent, const struct wandio_options *opts)
+{
+	io_t *state;
+
 	if (!parent) {
 		return NULL;
 	}
 	
-	sigfillset(&set);
-	state = malloc(sizeof(io_t));
+	state = calloc(1, sizeof(io_t));
 	state->data = calloc(1,sizeof(struct state_t));
 	state->source = &thread_source;
-
-	DATA(state)->buffer = (struct buffer_t *)malloc(sizeof(struct buffer_t) * max_buffers);
-	memset(DATA(state)->buffer, 0, sizeof(struct buffer_t) * max_buffers);
+	state->child = parent;
+
+	/* Only the ring itself is allocated up front, the slices are
+	 * allocated by the reading thread as it needs them */
+	DATA(state)->nbuffers = opts->ring_depth ? opts->ring_depth : BUFFERS;
+	DATA(state)->slice_size = opts->slice_size > 0 ? 
+			opts->slice_size : BUFFERSIZE;
+	DATA(state)->stats = opts->stats;
+	DATA(state)->buffer = (struct buffer_t **)calloc(DATA(state)->nbuffers,
+			sizeof(struct buffer_t *));
+	DATA(state)->spare = NULL;
+	DATA(state)->allocated = 0;
+	DATA(state)->reclaimed = 0;
+	DATA(state)->reclaim_buffer = 0;
+	DATA(state)->fill_buffer = 0;
 	DATA(state)->in_buffer = 0;
 	DATA(state)->offset = 0;
-	pthread_mutex_init(&DATA(state)->mutex,NULL);
-	pthread_cond_init(&DATA(state)->data_ready,NULL);
-	pthread_cond_init(&DATA(state)->space_avail,NULL);
+	DATA(state)->head = 0;
+	DATA(state)->tail = 0;
+	wandio_event_init(&DATA(state)->data_ready);
+	wandio_event_init(&DATA(state)->space_avail);
 
 	DATA(state)->io = parent;
 	DATA(state)->closing = false;
+	DATA(state)->position = wandio_tell(parent);
 
-	/* Create the reading thread */
-	s = pthread_sigmask(SIG_SETMASK, &set, NULL);
-        if (s != 0) {
-                return NULL;
-        }
-	pthread_create(&DATA(state)->producer,NULL,thread_producer,state);
-	sigemptyset(&set);
-	s = pthread_sigmask(SIG_SETMASK, &set, NULL);
-        if (s != 0) {
-                return NULL;
-        }
+	if (start_producer(state) != 0) {
+		thread_close(state);
+		return NULL;
+	}
 
 	return state;
 }
 
+/* Mark "len" bytes of the current slice as consumed, handing the slice back
+ * to the reading thread once it has been used up */
+static void consume(io_t *state, int64_t len)
+{
+	DATA(state)->offset+=len;
+	if (DATA(state)->position >= 0)
+		DATA(state)->position+=len;
+	
+	/* If we've read everything from the current slice, let the
+	 * read thread know that there is now more space available 
+	 * and start reading from the next slice */
+	if (DATA(state)->offset >= INBUFFER(state).len) {
+		DATA(state)->in_buffer = (DATA(state)->in_buffer+1) 
+				% DATA(state)->nbuffers;
+		DATA(state)->offset = 0;
+		__atomic_store_n(&DATA(state)->tail, 
+				DATA(state)->tail+1, __ATOMIC_SEQ_CST);
+		wandio_event_signal(&DATA(state)->space_avail);
+	}
+}
+
 static int64_t thread_read(io_t *state, void *buffer, int64_t len)
 {
 	int slice;
 	int copied=0;
-	int newbuffer;
 
 	while(len>0) {
-		pthread_mutex_lock(&DATA(state)->mutex);
-		
 		/* Wait for the reader thread to provide us with some data */
-		while (INBUFFER(state).state == EMPTY) {
-			++read_waits;
-			pthread_cond_wait(&DATA(state)->data_ready, &DATA(state)->mutex);
-
-		}
+		if (!wait_for_data(state))
+			return copied > 0 ? copied : -1;
 		
 		/* Check for errors and EOF */
 		if (INBUFFER(state).len <1) {
@@ -222,15 +405,12 @@ static int64_t thread_read(io_t *state, void *buffer, int64_t len)
 				copied = INBUFFER(state).len;
 			}
 
-			pthread_mutex_unlock(&DATA(state)->mutex);
 			return copied;
 		}
 
 		/* Copy the next available slice into the main buffer */
 		slice=min( INBUFFER(state).len-DATA(state)->offset,len);
 
-		pthread_mutex_unlock(&DATA(state)->mutex);
-				
 		memcpy(
 			buffer,
 			INBUFFER(state).buffer+DATA(state)->offset,
@@ -241,41 +421,167 @@ static int64_t thread_read(io_t *state, void *buffer, int64_t len)
 		len-=slice;
 		copied+=slice;
 
-		pthread_mutex_lock(&DATA(state)->mutex);
-		DATA(state)->offset+=slice;
-		newbuffer = DATA(state)->in_buffer;
-		
-		/* If we've read everything from the current slice, let the
-		 * read thread know that there is now more space available 
-		 * and start reading from the next slice */
-		if (DATA(state)->offset >= INBUFFER(state).len) {
-			INBUFFER(state).state = EMPTY;
-			pthread_cond_signal(&DATA(state)->space_avail);
-			newbuffer = (newbuffer+1) % max_buffers;
-			DATA(state)->offset = 0;
-		}
+		consume(state, slice);
+	}
+	return copied;
+}
+
+/* Hand out a pointer straight into the current slice rather than copying */
+static int64_t thread_borrow(io_t *state, const void **buffer, int64_t len)
+{
+	if (!wait_for_data(state))
+		return -1;
+
+	/* Check for errors and EOF */
+	if (INBUFFER(state).len <1) {
+		if (INBUFFER(state).len < 0)
+			errno=EIO; /* FIXME: Preserve the errno from the other thread */
+		return INBUFFER(state).len;
+	}
 
-		pthread_mutex_unlock(&DATA(state)->mutex);
+	*buffer = INBUFFER(state).buffer+DATA(state)->offset;
+	return min(INBUFFER(state).len-DATA(state)->offset,len);
+}
 
-		DATA(state)->in_buffer = newbuffer;
+static void thread_release(io_t *state, int64_t used)
+{
+	if (used > 0)
+		consume(state, used);
+}
+
+/* Tell the reading thread to stop and wait for it to exit */
+static void stop_producer(io_t *io)
+{
+	if (!DATA(io)->producing)
+		return;
+	__atomic_store_n(&DATA(io)->closing, true, __ATOMIC_SEQ_CST);
+	wandio_event_signal(&DATA(io)->space_avail);
+	pthread_join(DATA(io)->producer, NULL);
+	DATA(io)->producing = false;
+}
+
+static int64_t thread_tell(io_t *io)
+{
+	if (DATA(io)->position < 0)
+		errno = ESPIPE;
+	return DATA(io)->position;
+}
+
+/* Skip over whatever the reading thread has already read, up to offset.
+ * Returns true if that got us there */
+static bool skip_buffered(io_t *io, int64_t offset)
+{
+	while (DATA(io)->position < offset &&
+			__atomic_load_n(&DATA(io)->head, __ATOMIC_ACQUIRE) != 
+				DATA(io)->tail &&
+			INBUFFER(io).len > 0)
+		consume(io, min(INBUFFER(io).len - DATA(io)->offset,
+				offset - DATA(io)->position));
+	return DATA(io)->position == offset;
+}
+
+/* A forward seek that lands in data the reading thread has already read
+ * just skips over it. Anything else throws that data away, so the thread
+ * is stopped, the parent is moved and the thread started again with an
+ * empty ring */
+static int64_t thread_seek(io_t *io, int64_t offset, int whence)
+{
+	int64_t ret;
+	unsigned int i;
+	int err;
+
+	/* Don't throw away what we've read unless the parent can seek */
+	if (!DATA(io)->io->source->seek) {
+		errno = ENOSYS;
+		return -1;
 	}
-	return copied;
+	if (DATA(io)->position < 0) {
+		errno = ESPIPE;
+		return -1;
+	}
+	if (whence == SEEK_CUR) {
+		offset += DATA(io)->position;
+		whence = SEEK_SET;
+	}
+
+	if (whence == SEEK_SET && offset >= DATA(io)->position && 
+			skip_buffered(io, offset))
+		return offset;
+
+	stop_producer(io);
+
+	/* It may have got a little further before it stopped. If that's
+	 * enough, the parent is already in the right place */
+	if (whence == SEEK_SET && offset >= DATA(io)->position && 
+			skip_buffered(io, offset)) {
+		DATA(io)->closing = false;
+		err = start_producer(io);
+		if (err != 0) {
+			errno = err;
+			return -1;
+		}
+		return offset;
+	}
+
+	ret = wandio_seek(DATA(io)->io, offset, whence);
+	if (ret < 0) {
+		/* Put the parent back where we had got to */
+		err = errno;
+		wandio_seek(DATA(io)->io, DATA(io)->position, SEEK_SET);
+		errno = err;
+	}
+	else
+		DATA(io)->position = ret;
+
+	/* Every slice goes back on the spare list */
+	for (i = 0; i < DATA(io)->nbuffers; i++) {
+		if (!DATA(io)->buffer[i])
+			continue;
+		DATA(io)->buffer[i]->next = DATA(io)->spare;
+		DATA(io)->spare = DATA(io)->buffer[i];
+		DATA(io)->buffer[i] = NULL;
+	}
+	DATA(io)->reclaimed = 0;
+	DATA(io)->reclaim_buffer = 0;
+	DATA(io)->fill_buffer = 0;
+	DATA(io)->in_buffer = 0;
+	DATA(io)->offset = 0;
+	DATA(io)->head = 0;
+	DATA(io)->tail = 0;
+	DATA(io)->closing = false;
+
+	err = start_producer(io);
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+	return ret;
 }
 
 static void thread_close(io_t *io)
 {
-	pthread_mutex_lock(&DATA(io)->mutex);
-	DATA(io)->closing = true;
-	pthread_cond_signal(&DATA(io)->space_avail);
-	pthread_mutex_unlock(&DATA(io)->mutex);
+	struct buffer_t *slice;
+	unsigned int i;
 
 	/* Wait for the thread to exit */
-	pthread_join(DATA(io)->producer, NULL);
+	stop_producer(io);
+	wandio_destroy(DATA(io)->io);
+
+	if (DATA(io)->stats)
+		fprintf(stderr,"LIBTRACEIO STATS: %"PRIu64" blocks on read\n", 
+				io->stats.consumer_stalls);
 	
-	pthread_mutex_destroy(&DATA(io)->mutex);
-	pthread_cond_destroy(&DATA(io)->space_avail);
-	pthread_cond_destroy(&DATA(io)->data_ready);
+	wandio_event_destroy(&DATA(io)->data_ready);
+	wandio_event_destroy(&DATA(io)->space_avail);
 	
+	/* Every slice is either still in the ring or on the spare list */
+	for (i = 0; i < DATA(io)->nbuffers; i++)
+		free(DATA(io)->buffer[i]);
+	while (DATA(io)->spare) {
+		slice = DATA(io)->spare;
+		DATA(io)->spare = slice->next;
+		free(slice);
+	}
 	free(DATA(io)->buffer);
 	free(DATA(io));
 	free(io);
@@ -285,7 +591,9 @@ io_source_t thread_source = {
 	"thread",
 	thread_read,
 	NULL,	/* peek */
-	NULL,	/* tell */
-	NULL,	/* seek */
-	thread_close
+	thread_tell,
+	thread_seek,
+	thread_close,
+	thread_borrow,
+	thread_release
 };
@@ -35,7 +35,18 @@
 #include <string.h>
 #include <errno.h>
 
-/* Libwandio IO module implementing a zlib reader */
+/* Libwandio IO module implementing a zlib reader
+ *
+ * gzip has no way of starting to inflate from the middle of a file, so to
+ * support seeking we remember a "checkpoint" roughly every CHECKPOINT_SPAN
+ * bytes of output as we read, in the same way as zlib's zran example. A
+ * checkpoint is taken at the end of a deflate block and holds where in the
+ * compressed data the next block starts (down to the bit), how much output
+ * came before it and the 32KB of output the next block may refer back to.
+ * Seeking restarts a raw inflate from the nearest checkpoint before the
+ * target and then reads forward, so it never has to go back to the start of
+ * a file that has already been read through once.
+ */
 
 enum err_t {
 	ERR_OK	= 1,
@@ -43,6 +54,21 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
+/* How much output to leave between checkpoints */
+#define CHECKPOINT_SPAN (8*1024*1024)
+/* The largest deflate window */
+#define WINDOW_SIZE 32768
+/* The size of a gzip trailer */
+#define GZIP_TRAILER 8
+
+struct checkpoint_t {
+	int64_t in;		/* Offset of the next compressed byte */
+	int bits;		/* Bits of the byte before "in" still to use */
+	int64_t out;		/* Uncompressed offset at this point */
+	unsigned int window_len;
+	unsigned char *window;	/* The output leading up to this point */
+};
+
 struct zlib_t {
 	Bytef inbuff[1024*1024]; /* bytef is what zlib uses for buffer pointers */
 	z_stream strm;
@@ -50,6 +76,22 @@ struct zlib_t {
 	int outoffset;
 	enum err_t err;
         size_t sincelastend;
+
+	/* Uncompressed offset of the next byte we return */
+	int64_t position;
+	/* Compressed offset of the end of the data in inbuff, -1 if the
+	 * parent can't tell us where it is (so we can't seek) */
+	int64_t in_offset;
+	/* Compressed offset where the file starts */
+	int64_t in_start;
+	/* Inflating raw deflate data after seeking to a checkpoint, rather
+	 * than a whole gzip member */
+	bool raw;
+	/* Bytes of gzip trailer to skip when a raw inflate finishes */
+	int skip;
+	struct checkpoint_t *checkpoint;
+	int checkpoints;
+	int max_checkpoints;
 };
 
 
@@ -63,9 +105,10 @@ io_t *zlib_open(io_t *parent)
 	io_t *io;
 	if (!parent)
 		return NULL;
-	io = malloc(sizeof(io_t));
+	io = calloc(1, sizeof(io_t));
 	io->source = &zlib_source;
-	io->data = malloc(sizeof(struct zlib_t));
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct zlib_t));
 
 	DATA(io)->parent = parent;
 
@@ -79,14 +122,61 @@ io_t *zlib_open(io_t *parent)
 	DATA(io)->err = ERR_OK;
         DATA(io)->sincelastend = 1;
 
+	DATA(io)->position = 0;
+	DATA(io)->in_start = wandio_tell(parent);
+	DATA(io)->in_offset = DATA(io)->in_start;
+
 	inflateInit2(&DATA(io)->strm, 15 | 32);
 
 	return io;
 }
 
+/* Remembers where we are, if we're at the end of a deflate block and far
+ * enough past the last checkpoint */
+static void add_checkpoint(io_t *io, int64_t out)
+{
+	struct checkpoint_t *cp;
+
+	if (!(DATA(io)->strm.data_type & 128) || 
+			(DATA(io)->strm.data_type & 64))
+		return;
+	if (DATA(io)->checkpoints == DATA(io)->max_checkpoints) {
+		DATA(io)->max_checkpoints = DATA(io)->max_checkpoints ?
+				DATA(io)->max_checkpoints * 2 : 64;
+		DATA(io)->checkpoint = realloc(DATA(io)->checkpoint, 
+				DATA(io)->max_checkpoints * 
+				sizeof(struct checkpoint_t));
+	}
+	cp = &DATA(io)->checkpoint[DATA(io)->checkpoints];
+	cp->window = malloc(WINDOW_SIZE);
+	cp->window_len = WINDOW_SIZE;
+	if (inflateGetDictionary(&DATA(io)->strm, cp->window, 
+				&cp->window_len) != Z_OK) {
+		free(cp->window);
+		return;
+	}
+	cp->in = DATA(io)->in_offset - DATA(io)->strm.avail_in;
+	cp->bits = DATA(io)->strm.data_type & 7;
+	cp->out = out;
+	DATA(io)->checkpoints++;
+}
+
+/* Output offset at which the next checkpoint is due */
+static int64_t next_checkpoint(io_t *io)
+{
+	if (DATA(io)->in_offset < 0)
+		return INT64_MAX;
+	if (DATA(io)->checkpoints == 0)
+		return CHECKPOINT_SPAN;
+	return DATA(io)->checkpoint[DATA(io)->checkpoints-1].out + 
+			CHECKPOINT_SPAN;
+}
 
 static int64_t zlib_read(io_t *io, void *buffer, int64_t len)
 {
+	int64_t due = next_checkpoint(io);
+	int64_t out;
+
 	if (DATA(io)->err == ERR_EOF)
 		return 0; /* EOF */
 	if (DATA(io)->err == ERR_ERROR) {
@@ -122,14 +212,18 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len)
 					return 0;
 				}
 				/* Return how much data we've managed to read so far. */
-				return len-DATA(io)->strm.avail_out;
+				out = len-DATA(io)->strm.avail_out;
+				DATA(io)->position += out;
+				return out;
 			}
 			if (bytes_read < 0) { /* Error */
 				/* errno should be set */
 				DATA(io)->err = ERR_ERROR;
 				/* Return how much data we managed to read ok */
 				if (DATA(io)->strm.avail_out != (uint32_t)len) {
-					return len-DATA(io)->strm.avail_out;
+					out = len-DATA(io)->strm.avail_out;
+					DATA(io)->position += out;
+					return out;
 				}
 				/* Now return error */
 				return -1;
@@ -137,12 +231,34 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len)
 			DATA(io)->strm.next_in = DATA(io)->inbuff;
 			DATA(io)->strm.avail_in = bytes_read;
                         DATA(io)->sincelastend += bytes_read;
+			if (DATA(io)->in_offset >= 0)
+				DATA(io)->in_offset += bytes_read;
+		}
+		/* Skip the trailer of a member we started part way through */
+		if (DATA(io)->skip) {
+			int skip = min((uint32_t)DATA(io)->skip, 
+					DATA(io)->strm.avail_in);
+			DATA(io)->strm.next_in += skip;
+			DATA(io)->strm.avail_in -= skip;
+			DATA(io)->skip -= skip;
+			DATA(io)->sincelastend -= min(DATA(io)->sincelastend,
+					(size_t)skip);
+			continue;
 		}
-		/* Decompress some data into the output buffer */
-		int err=inflate(&DATA(io)->strm, 0);
+		/* Decompress some data into the output buffer. Once a
+		 * checkpoint is due, stop at the end of each block so that
+		 * we can take one */
+		out = DATA(io)->position + len - DATA(io)->strm.avail_out;
+		int err=inflate(&DATA(io)->strm, out >= due ? Z_BLOCK : 0);
 		switch(err) {
 			case Z_OK:
 				DATA(io)->err = ERR_OK;
+				out = DATA(io)->position + len - 
+						DATA(io)->strm.avail_out;
+				if (out >= due) {
+					add_checkpoint(io, out);
+					due = next_checkpoint(io);
+				}
 				break;
 			case Z_STREAM_END:
 				/* You would think that an "EOF" on the stream would mean we'd
@@ -154,6 +270,10 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len)
 				inflateInit2(&DATA(io)->strm, 15 | 32);
 				DATA(io)->err = ERR_OK;
                                 DATA(io)->sincelastend = 0;
+				if (DATA(io)->raw) {
+					DATA(io)->raw = false;
+					DATA(io)->skip = GZIP_TRAILER;
+				}
 				break;
 			default:
 				errno=EIO;
@@ -161,13 +281,115 @@ static int64_t zlib_read(io_t *io, void *buffer, int64_t len)
 		}
 	}
 	/* Return the number of bytes decompressed */
-	return len-DATA(io)->strm.avail_out;
+	out = len-DATA(io)->strm.avail_out;
+	DATA(io)->position += out;
+	return out;
+}
+
+static int64_t zlib_tell(io_t *io)
+{
+	return DATA(io)->position;
+}
+
+/* Starts inflating again from a checkpoint, or from the start of the file
+ * if cp is NULL */
+static int restart(io_t *io, struct checkpoint_t *cp)
+{
+	int64_t in = cp ? cp->in - (cp->bits ? 1 : 0) : DATA(io)->in_start;
+	unsigned char byte;
+
+	if (wandio_seek(DATA(io)->parent, in, SEEK_SET) != in)
+		return -1;
+
+	inflateEnd(&DATA(io)->strm);
+	DATA(io)->strm.avail_in = 0;
+	DATA(io)->in_offset = in;
+	DATA(io)->skip = 0;
+	DATA(io)->err = ERR_OK;
+        DATA(io)->sincelastend = 1;
+	if (!cp) {
+		DATA(io)->raw = false;
+		DATA(io)->position = 0;
+		inflateInit2(&DATA(io)->strm, 15 | 32);
+		return 0;
+	}
+
+	DATA(io)->raw = true;
+	DATA(io)->position = cp->out;
+	inflateInit2(&DATA(io)->strm, -15);
+	if (cp->bits) {
+		if (wandio_read(DATA(io)->parent, &byte, 1) != 1)
+			return -1;
+		DATA(io)->in_offset++;
+		inflatePrime(&DATA(io)->strm, cp->bits, byte >> (8 - cp->bits));
+	}
+	inflateSetDictionary(&DATA(io)->strm, cp->window, cp->window_len);
+	return 0;
+}
+
+static int64_t zlib_seek(io_t *io, int64_t offset, int whence)
+{
+	struct checkpoint_t *cp = NULL;
+	char discard[64*1024];
+	int64_t ret;
+	int i;
+
+	if (whence == SEEK_CUR)
+		offset += DATA(io)->position;
+	else if (whence != SEEK_SET) {
+		/* We don't know where the end is without reading to it */
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Find the last checkpoint at or before where we're going */
+	for (i = DATA(io)->checkpoints - 1; i >= 0; --i) {
+		if (DATA(io)->checkpoint[i].out <= offset) {
+			cp = &DATA(io)->checkpoint[i];
+			break;
+		}
+	}
+
+	/* Only go back if we must, or if it saves reading forward a lot */
+	if (offset < DATA(io)->position || 
+			(cp && cp->out > DATA(io)->position)) {
+		if (DATA(io)->in_offset < 0) {
+			errno = ESPIPE;
+			return -1;
+		}
+		if (restart(io, cp) < 0) {
+			DATA(io)->err = ERR_ERROR;
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	/* Read our way forward from there, taking checkpoints as we go */
+	while (DATA(io)->position < offset) {
+		ret = zlib_read(io, discard, 
+				min(offset - DATA(io)->position, 
+					(int64_t)sizeof(discard)));
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+	}
+	return DATA(io)->position;
 }
 
 static void zlib_close(io_t *io)
 {
+	int i;
+
 	inflateEnd(&DATA(io)->strm);
 	wandio_destroy(DATA(io)->parent);
+	for (i = 0; i < DATA(io)->checkpoints; ++i)
+		free(DATA(io)->checkpoint[i].window);
+	free(DATA(io)->checkpoint);
 	free(io->data);
 	free(io);
 }
@@ -176,8 +398,9 @@ io_source_t zlib_source = {
 	"zlib",
 	zlib_read,
 	NULL,	/* peek */
-	NULL,	/* tell */
-	NULL,	/* seek */
-	zlib_close
+	zlib_tell,
+	zlib_seek,
+	zlib_close,
+	NULL,	/* borrow */
+	NULL	/* release */
 };
-
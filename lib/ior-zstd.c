@@ -0,0 +1,424 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <zstd.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Libwandio IO module implementing a zstd reader
+ *
+ * If the file can be seeked and ends with a seek table (the zstd seekable
+ * format, which is what zstd_wopen() writes), we know where every frame
+ * starts both before and after compression. The frames can then be decoded
+ * independently: they are read in order and handed to a wandio_pool, and
+ * seeking just means starting again from the frame that holds the target.
+ *
+ * Anything else is decoded as a stream, which deals with one frame after
+ * another and skips skippable frames, so this reads anything the zstd tool
+ * writes. A stream can only seek forwards.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+#define SEEK_TABLE_FOOTER 9
+
+/* Small frames are decoded together until a job has at least this much */
+#define JOB_SIZE (1024*1024)
+/* Frames bigger than this (uncompressed) are not worth decoding in one go,
+ * such files are streamed instead */
+#define MAX_JOB_FRAME (32*1024*1024)
+
+struct zstdjob_t {
+	struct wandio_reader_job base;
+	ZSTD_DCtx *dctx;
+	uint8_t *inbuff;
+	size_t in_size;
+	size_t in_len;
+	size_t out_size;
+};
+
+struct zstd_t {
+	ZSTD_DCtx *dctx;
+	uint8_t inbuff[1024*1024];
+	ZSTD_inBuffer in;
+	io_t *parent;
+	enum err_t err;
+	/* Set between frames, where the file is allowed to end */
+	bool frame_done;
+
+	/* Only uses the pool when we have the seek table */
+	struct wandio_reader reader;
+
+	/* Where each frame starts, from the seek table */
+	struct wandio_seek_point *frames;
+	size_t nframes;
+	/* Where the file starts in the parent, and where the parent is now */
+	int64_t in_start;
+	int64_t in_pos;
+};
+
+
+extern io_source_t zstd_source;
+
+#define DATA(io) ((struct zstd_t *)((io)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+static uint32_t read_le32(const uint8_t *buf)
+{
+	return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | 
+			((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* Runs on a pool thread */
+static void zstd_decode_frames(void *data, io_t *io)
+{
+	struct zstdjob_t *job = (struct zstdjob_t *)data;
+	size_t ret;
+
+	(void)io;
+	if (!job->dctx) {
+		job->base.failed = true;
+		return;
+	}
+	ret = ZSTD_decompressDCtx(job->dctx, job->base.out, job->base.out_len, 
+			job->inbuff, job->in_len);
+	job->base.failed = (ZSTD_isError(ret) || ret != job->base.out_len);
+}
+
+/* Reads exactly len bytes from the parent, at offset "off" into the file */
+static int read_at(io_t *io, uint64_t off, uint8_t *buffer, size_t len)
+{
+	int64_t ret;
+
+	if (DATA(io)->in_pos != (int64_t)off) {
+		if (wandio_seek(DATA(io)->parent, DATA(io)->in_start + off, 
+				SEEK_SET) < 0)
+			return -1;
+		DATA(io)->in_pos = off;
+	}
+	while (len > 0) {
+		ret = wandio_read(DATA(io)->parent, buffer, len);
+		if (ret <= 0)
+			return -1;
+		DATA(io)->in_pos += ret;
+		buffer += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Reads the seek table from the end of the file, returns false if there
+ * isn't one we can use */
+static bool read_seek_table(io_t *io)
+{
+	uint8_t footer[SEEK_TABLE_FOOTER];
+	uint8_t *table;
+	int64_t end;
+	uint64_t table_size, comp_off = 0, unc_off = 0;
+	size_t entry, i;
+	uint32_t nframes, comp_size, unc_size;
+
+	if (DATA(io)->in_start < 0)
+		return false;
+	end = wandio_seek(DATA(io)->parent, 0, SEEK_END);
+	if (end < DATA(io)->in_start + SEEK_TABLE_FOOTER)
+		return false;
+	end -= DATA(io)->in_start;
+	DATA(io)->in_pos = -1;
+	if (read_at(io, end - SEEK_TABLE_FOOTER, footer, sizeof(footer)) < 0 ||
+			read_le32(footer + 5) != SEEKABLE_MAGIC)
+		return false;
+
+	/* The top bit of the descriptor says whether each entry has a
+	 * checksum, which we don't need as the frames have their own. The
+	 * reserved bits must be clear */
+	if (footer[4] & 0x7c)
+		return false;
+	entry = (footer[4] & 0x80) ? 12 : 8;
+	nframes = read_le32(footer);
+	table_size = (uint64_t)nframes * entry + SEEK_TABLE_FOOTER;
+	if (nframes == 0 || table_size + 8 > (uint64_t)end)
+		return false;
+
+	table = malloc(table_size - SEEK_TABLE_FOOTER + 8);
+	if (read_at(io, end - table_size - 8, table, 
+				table_size - SEEK_TABLE_FOOTER + 8) < 0 ||
+			read_le32(table) != SKIPPABLE_MAGIC ||
+			read_le32(table + 4) != table_size) {
+		free(table);
+		return false;
+	}
+
+	DATA(io)->frames = calloc(nframes + 1, 
+			sizeof(struct wandio_seek_point));
+	for (i = 0; i < nframes; ++i) {
+		DATA(io)->frames[i].comp_off = comp_off;
+		DATA(io)->frames[i].unc_off = unc_off;
+		comp_size = read_le32(table + 8 + i * entry);
+		unc_size = read_le32(table + 12 + i * entry);
+		comp_off += comp_size;
+		unc_off += unc_size;
+		if (unc_size > MAX_JOB_FRAME)
+			break;
+	}
+	DATA(io)->frames[nframes].comp_off = comp_off;
+	DATA(io)->frames[nframes].unc_off = unc_off;
+	free(table);
+
+	/* The frames have to account for everything before the table */
+	if (i < nframes || comp_off != end - table_size - 8) {
+		free(DATA(io)->frames);
+		DATA(io)->frames = NULL;
+		return false;
+	}
+	DATA(io)->nframes = nframes;
+	return true;
+}
+
+/* Reads runs of frames into free jobs and starts decoding them */
+static int zstd_fill(io_t *io)
+{
+	struct wandio_reader *r = &DATA(io)->reader;
+	const struct wandio_seek_point *frames = DATA(io)->frames;
+	struct zstdjob_t *job;
+	size_t first, in_len, out_len;
+
+	while (r->next_point < DATA(io)->nframes &&
+			(job = wandio_reader_free_job(r)) != NULL) {
+		first = r->next_point;
+		do {
+			r->next_point++;
+		} while (frames[r->next_point].unc_off - frames[first].unc_off
+				< JOB_SIZE && r->next_point < DATA(io)->nframes);
+		in_len = frames[r->next_point].comp_off - 
+				frames[first].comp_off;
+		out_len = frames[r->next_point].unc_off - 
+				frames[first].unc_off;
+
+		if (job->in_size < in_len) {
+			job->in_size = in_len;
+			job->inbuff = realloc(job->inbuff, job->in_size);
+		}
+		if (job->out_size < out_len) {
+			job->out_size = out_len;
+			job->base.out = realloc(job->base.out, job->out_size);
+		}
+		if (read_at(io, frames[first].comp_off, job->inbuff, in_len) < 0)
+			return -1;
+		job->in_len = in_len;
+		job->base.out_len = out_len;
+		wandio_reader_submit(r, job);
+	}
+	return 0;
+}
+
+static void zstd_free_job(void *data)
+{
+	struct zstdjob_t *job = (struct zstdjob_t *)data;
+
+	ZSTD_freeDCtx(job->dctx);
+	free(job->inbuff);
+	free(job->base.out);
+}
+
+static const struct wandio_reader_ops zstd_reader_ops = {
+	"zstd",
+	"zstd frame",
+	sizeof(struct zstdjob_t),
+	zstd_decode_frames,
+	zstd_fill,
+	NULL,	/* idle */
+	NULL,	/* restart */
+	zstd_free_job
+};
+
+/* Tries to set up frame-at-a-time decoding, returns false if we can't */
+static bool zstd_open_frames(io_t *io, const struct wandio_options *opts)
+{
+	struct wandio_reader *r = &DATA(io)->reader;
+	unsigned int i;
+
+	if (!read_seek_table(io))
+		return false;
+
+	if (!wandio_reader_init(r, &zstd_reader_ops, io, 
+			wandio_pool_threads(opts), DATA(io)->frames, 
+			DATA(io)->nframes)) {
+		free(DATA(io)->frames);
+		DATA(io)->frames = NULL;
+		return false;
+	}
+	for (i = 0; i < r->slots; ++i) {
+		struct zstdjob_t *job = wandio_reader_slot(r, i);
+		job->dctx = ZSTD_createDCtx();
+	}
+	/* Force the first read to seek to the first frame */
+	DATA(io)->in_pos = -1;
+	return true;
+}
+
+io_t *zstd_open(io_t *parent, const struct wandio_options *opts)
+{
+	io_t *io;
+	if (!parent)
+		return NULL;
+	io = calloc(1, sizeof(io_t));
+	io->source = &zstd_source;
+	io->child = parent;
+	io->data = calloc(1, sizeof(struct zstd_t));
+
+	DATA(io)->parent = parent;
+	DATA(io)->err = ERR_OK;
+	DATA(io)->in_start = wandio_tell(parent);
+
+	if (zstd_open_frames(io, opts))
+		return io;
+
+	/* If reading the seek table failed part way through, start again */
+	if (DATA(io)->in_start >= 0 && 
+			wandio_seek(parent, DATA(io)->in_start, SEEK_SET) < 0) {
+		free(io->data);
+		free(io);
+		return NULL;
+	}
+
+	DATA(io)->frame_done = true;
+	DATA(io)->in.src = DATA(io)->inbuff;
+	DATA(io)->in.size = 0;
+	DATA(io)->in.pos = 0;
+
+	DATA(io)->dctx = ZSTD_createDCtx();
+	if (!DATA(io)->dctx) {
+		free(io->data);
+		free(io);
+		return NULL;
+	}
+
+	return io;
+}
+
+static int64_t zstd_read(io_t *io, void *buffer, int64_t len)
+{
+	ZSTD_outBuffer out = { buffer, len, 0 };
+	int64_t bytes_read;
+	size_t ret;
+
+	if (DATA(io)->err == ERR_EOF)
+		return 0; /* EOF */
+	if (DATA(io)->err == ERR_ERROR) {
+		errno=EIO;
+		return -1; /* ERROR! */
+	}
+
+	if (DATA(io)->frames)
+		return wandio_reader_read(&DATA(io)->reader, buffer, len);
+
+	while (out.pos < out.size) {
+		if (DATA(io)->in.pos == DATA(io)->in.size) {
+			bytes_read = wandio_read(DATA(io)->parent,
+					DATA(io)->inbuff, 
+					sizeof(DATA(io)->inbuff));
+			if (bytes_read == 0) {
+				if (DATA(io)->frame_done) {
+					DATA(io)->err = ERR_EOF;
+					break;
+				}
+				fprintf(stderr, "Unexpected EOF while reading compressed file -- file is probably incomplete\n");
+				bytes_read = -1;
+				errno = EIO;
+			}
+			if (bytes_read < 0) {
+				/* errno should be set */
+				DATA(io)->err = ERR_ERROR;
+				/* Return how much data we managed to read ok */
+				if (out.pos > 0)
+					break;
+				return -1;
+			}
+			DATA(io)->in.size = bytes_read;
+			DATA(io)->in.pos = 0;
+		}
+
+		ret = ZSTD_decompressStream(DATA(io)->dctx, &out, 
+				&DATA(io)->in);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "Error decompressing zstd data: %s\n",
+					ZSTD_getErrorName(ret));
+			DATA(io)->err = ERR_ERROR;
+			if (out.pos > 0)
+				break;
+			errno = EIO;
+			return -1;
+		}
+		DATA(io)->frame_done = (ret == 0);
+	}
+	/* Return the number of bytes decompressed */
+	DATA(io)->reader.position += out.pos;
+	return out.pos;
+}
+
+static int64_t zstd_tell(io_t *io)
+{
+	return DATA(io)->reader.position;
+}
+
+static int64_t zstd_seek(io_t *io, int64_t offset, int whence)
+{
+	return wandio_reader_seek(&DATA(io)->reader, io, offset, whence);
+}
+
+static void zstd_close(io_t *io)
+{
+	wandio_reader_destroy(&DATA(io)->reader);
+	free(DATA(io)->frames);
+	ZSTD_freeDCtx(DATA(io)->dctx);
+	wandio_destroy(DATA(io)->parent);
+	free(io->data);
+	free(io);
+}
+
+io_source_t zstd_source = {
+	"zstd",
+	zstd_read,
+	NULL,	/* peek */
+	zstd_tell,
+	zstd_seek,
+	zstd_close,
+	NULL,	/* borrow */
+	NULL	/* release */
+};
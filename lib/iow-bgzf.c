@@ -0,0 +1,312 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include <zlib.h>
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* Libwandio IO module implementing a blocked gzip (BGZF) writer
+ *
+ * The output is a series of complete gzip members, each holding at most
+ * BGZF_BLOCK_SIZE bytes of data and at most 64KB once compressed. Every
+ * member carries a "BC" extra field giving its compressed size, which lets a
+ * reader find the block boundaries without inflating anything, so the
+ * blocks can be decompressed in parallel or jumped to directly. This is the
+ * same format that samtools/htslib use, and any gzip reader can read it as
+ * an ordinary multi-member gzip file.
+ *
+ * The blocks are independent so they are compressed on a wandio_pool. If
+ * asked to, the writer also keeps a list of where each block starts, and
+ * writes it out on close in the htslib ".gzi" index format.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+/* The most input that will always fit in a 64KB block, even stored */
+#define BGZF_BLOCK_SIZE 0xff00
+#define BGZF_MAX_BLOCK (64*1024)
+#define BGZF_HEADER_SIZE 18
+#define BGZF_TRAILER_SIZE 8
+
+/* An empty block marks the end of a BGZF file */
+static const uint8_t bgzf_eof[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00,
+	0x42, 0x43, 0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+
+struct bgzfjob_t {
+	struct wandio_writer_job base;
+	z_stream strm;
+	Bytef inbuff[BGZF_BLOCK_SIZE];
+	/* The whole finished block, header and trailer included */
+	Bytef outbuff[BGZF_MAX_BLOCK];
+	unsigned int out_len;
+};
+
+/* One entry in the index */
+struct bgzf_mark_t {
+	uint64_t compressed;
+	uint64_t uncompressed;
+};
+
+struct bgzfw_t {
+	iow_t *child;
+	enum err_t err;
+	struct wandio_writer writer;
+
+	/* Where the next block to be written starts */
+	uint64_t compressed;
+	uint64_t uncompressed;
+	/* Where to write the index, or NULL if we aren't keeping one */
+	iow_t *index;
+	struct bgzf_mark_t *marks;
+	uint64_t nmarks;
+	uint64_t max_marks;
+};
+
+extern iow_source_t bgzf_wsource; 
+
+#define DATA(iow) ((struct bgzfw_t *)((iow)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+static void put_le16(Bytef *buf, uint16_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = value >> 8;
+}
+
+static void put_le32(Bytef *buf, uint32_t value)
+{
+	put_le16(buf, value & 0xffff);
+	put_le16(buf + 2, value >> 16);
+}
+
+static void put_le64(Bytef *buf, uint64_t value)
+{
+	put_le32(buf, value & 0xffffffff);
+	put_le32(buf + 4, value >> 32);
+}
+
+/* Runs on a pool thread */
+static void bgzf_compress_block(void *data, iow_t *iow)
+{
+	struct bgzfjob_t *job = (struct bgzfjob_t *)data;
+	Bytef *out = job->outbuff;
+	unsigned int in_len = job->base.in_len;
+	unsigned int room = BGZF_MAX_BLOCK - BGZF_HEADER_SIZE - 
+			BGZF_TRAILER_SIZE;
+	unsigned int cdata_len;
+
+	(void)iow;
+
+	deflateReset(&job->strm);
+	job->strm.next_in = job->inbuff;
+	job->strm.avail_in = in_len;
+	job->strm.next_out = out + BGZF_HEADER_SIZE;
+	job->strm.avail_out = room;
+	switch (deflate(&job->strm, Z_FINISH)) {
+		case Z_STREAM_END:
+			cdata_len = room - job->strm.avail_out;
+			break;
+		case Z_OK:
+		case Z_BUF_ERROR:
+			/* It didn't fit, so store the data as it is */
+			out[BGZF_HEADER_SIZE] = 0x01; /* Final stored block */
+			put_le16(out + BGZF_HEADER_SIZE + 1, in_len);
+			put_le16(out + BGZF_HEADER_SIZE + 3, ~in_len);
+			memcpy(out + BGZF_HEADER_SIZE + 5, job->inbuff, 
+					in_len);
+			cdata_len = in_len + 5;
+			break;
+		default:
+			job->base.failed = true;
+			return;
+	}
+
+	job->out_len = BGZF_HEADER_SIZE + cdata_len + BGZF_TRAILER_SIZE;
+	memcpy(out, bgzf_eof, BGZF_HEADER_SIZE);
+	put_le16(out + 16, job->out_len - 1);	/* BSIZE */
+	put_le32(out + BGZF_HEADER_SIZE + cdata_len, 
+			crc32(crc32(0L, Z_NULL, 0), job->inbuff, in_len));
+	put_le32(out + BGZF_HEADER_SIZE + cdata_len + 4, in_len);
+}
+
+static void bgzf_mark(iow_t *iow)
+{
+	if (DATA(iow)->nmarks == DATA(iow)->max_marks) {
+		DATA(iow)->max_marks = DATA(iow)->max_marks ? 
+				DATA(iow)->max_marks * 2 : 1024;
+		DATA(iow)->marks = realloc(DATA(iow)->marks, 
+				DATA(iow)->max_marks * sizeof(struct bgzf_mark_t));
+	}
+	DATA(iow)->marks[DATA(iow)->nmarks].compressed = DATA(iow)->compressed;
+	DATA(iow)->marks[DATA(iow)->nmarks].uncompressed = 
+			DATA(iow)->uncompressed;
+	DATA(iow)->nmarks++;
+}
+
+/* Writes out a finished block, noting where the next one starts */
+static bool bgzf_emit_block(void *data, iow_t *iow)
+{
+	struct bgzfjob_t *job = (struct bgzfjob_t *)data;
+
+	if (wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) 
+			!= (int64_t)job->out_len)
+		return false;
+	DATA(iow)->compressed += job->out_len;
+	DATA(iow)->uncompressed += job->base.in_len;
+	/* The index leaves out the first block, which is always at 0 */
+	if (DATA(iow)->index)
+		bgzf_mark(iow);
+	return true;
+}
+
+static const struct wandio_writer_ops bgzf_writer_ops = {
+	"bgzf",
+	sizeof(struct bgzfjob_t),
+	bgzf_compress_block,
+	NULL,	/* prepare */
+	bgzf_emit_block
+};
+
+iow_t *bgzf_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts, iow_t *index)
+{
+	iow_t *iow;
+	unsigned int threads;
+	unsigned int i;
+	if (!child)
+		return NULL;
+	iow = calloc(1, sizeof(iow_t));
+	iow->source = &bgzf_wsource;
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct bgzfw_t));
+
+	DATA(iow)->child = child;
+	DATA(iow)->err = ERR_OK;
+	DATA(iow)->index = index;
+
+	/* Without any threads the pool just compresses each block as it is
+	 * submitted */
+	threads = wandio_pool_threads(opts);
+	if (!wandio_writer_init(&DATA(iow)->writer, &bgzf_writer_ops, iow,
+			threads, 0, BGZF_BLOCK_SIZE)) {
+		DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
+	for (i = 0; i < DATA(iow)->writer.slots; ++i) {
+		struct bgzfjob_t *job = wandio_writer_slot(&DATA(iow)->writer, 
+				i);
+		job->base.in = job->inbuff;
+		if (deflateInit2(&job->strm, compress_level, 
+				Z_DEFLATED, 
+				-15,	/* Raw deflate, 15 bits of window */
+				9, Z_DEFAULT_STRATEGY) != Z_OK)
+			DATA(iow)->err = ERR_ERROR;
+	}
+
+	return iow;
+}
+
+static int64_t bgzf_wwrite(iow_t *iow, const char *buffer, int64_t len)
+{
+	if (DATA(iow)->err == ERR_EOF) {
+		return 0; /* EOF */
+	}
+	if (DATA(iow)->err == ERR_ERROR) {
+		return -1; /* ERROR! */
+	}
+	return wandio_writer_write(&DATA(iow)->writer, buffer, len);
+}
+
+static void bgzf_write_index(iow_t *iow)
+{
+	Bytef entry[16];
+	uint64_t i;
+
+	/* The last mark is the end of the file rather than a block */
+	if (DATA(iow)->nmarks)
+		DATA(iow)->nmarks--;
+	put_le64(entry, DATA(iow)->nmarks);
+	wandio_wwrite(DATA(iow)->index, entry, 8);
+	for (i = 0; i < DATA(iow)->nmarks; ++i) {
+		put_le64(entry, DATA(iow)->marks[i].compressed);
+		put_le64(entry + 8, DATA(iow)->marks[i].uncompressed);
+		wandio_wwrite(DATA(iow)->index, entry, sizeof(entry));
+	}
+}
+
+static void bgzf_wclose(iow_t *iow)
+{
+	unsigned int i;
+
+	if (DATA(iow)->err == ERR_OK && 
+			!wandio_writer_finish(&DATA(iow)->writer, 
+				WANDIO_TAIL_IF_DATA))
+		DATA(iow)->err = ERR_ERROR;
+
+	if (DATA(iow)->err == ERR_OK)
+		wandio_wwrite(DATA(iow)->child, bgzf_eof, sizeof(bgzf_eof));
+	else
+		fprintf(stderr, "Error while compressing bgzf output\n");
+
+	if (DATA(iow)->index) {
+		if (DATA(iow)->err == ERR_OK)
+			bgzf_write_index(iow);
+		wandio_wdestroy(DATA(iow)->index);
+	}
+
+	for (i = 0; DATA(iow)->writer.jobs && i < DATA(iow)->writer.slots; 
+			++i) {
+		struct bgzfjob_t *job = wandio_writer_slot(&DATA(iow)->writer, 
+				i);
+		deflateEnd(&job->strm);
+	}
+	wandio_writer_destroy(&DATA(iow)->writer);
+	free(DATA(iow)->marks);
+	wandio_wdestroy(DATA(iow)->child);
+	free(iow->data);
+	free(iow);
+}
+
+iow_source_t bgzf_wsource = {
+	"bgzfw",
+	bgzf_wwrite,
+	bgzf_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
+};
@@ -25,6 +25,7 @@
  */
 
 #include "config.h"
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -34,10 +35,6 @@
 #include <assert.h>
 #include <blosc.h>
 
-#define NUM_THREADS 4			//XXX - possibility to set number of threads?
-#define BUF_OUT_SIZE 1024*1024*5
-#define FREE_SPACE_LIMIT 1024*1024 	//if we have less free space in buffer than 100Kb - dump it
-
 //#define DEBUG
 
 #ifdef DEBUG
@@ -47,19 +44,89 @@
 #endif
 
 
+/* Libwandio IO module implementing a blosc writer
+ *
+ * The data is cut into chunks which go round a ring of jobs: a background
+ * thread from a wandio_pool compresses each chunk (using blosc's own threads
+ * as well), while the caller carries on filling the next chunk and writes
+ * out the ones that are done. Every job has room for a whole chunk plus
+ * BLOSC_MAX_OVERHEAD, so a chunk can never fail to fit.
+ */
+
+/* The file layout is:
+ *
+ *   magic		8 bytes, blosc_magic below
+ *   records		for each chunk, the uncompressed and compressed length
+ *			(little-endian u32s) followed by the blosc chunk
+ *   end record		a record with both lengths zero
+ *   index		for each chunk, the offset of its record in the file
+ *			and of its data once uncompressed (little-endian u64s)
+ *   footer		the offset of the index, the number of chunks and the
+ *			total uncompressed length (little-endian u64s),
+ *			then the magic again
+ *
+ * so that a reader can always find the next chunk, and one that can seek
+ * can jump to any chunk using the index.
+ */
+static const uint8_t blosc_magic[8] =
+		{ 0x89, 'B', 'L', 'O', 'S', 'C', 0x0d, 0x0a };
+
+#define RECORD_HEADER 8
+#define INDEX_ENTRY 16
+
+//amount of data in each chunk
+#define CHUNK_SIZE (2*1024*1024)
+//number of chunks that can be in the ring at once
+#define RING_SLOTS 4
+
+//number of chunks tried with every shuffle mode before settling on one
+#define SAMPLE_CHUNKS 4
+#define SHUFFLE_MODES 3
+
 enum err_t {
 	ERR_OK	= 1,
 	ERR_EOF = 0,
 	ERR_ERROR = -1
 };
 
+struct bloscjob_t {
+	struct wandio_writer_job base;
+	char inbuff[CHUNK_SIZE];
+	//record header followed by the compressed chunk
+	char outbuff[RECORD_HEADER + CHUNK_SIZE + BLOSC_MAX_OVERHEAD];
+	int out_len;
+	//shuffle mode to use, which may be auto while we are still sampling
+	int shuffle;
+	//compressed size with each shuffle mode, when sampling
+	uint64_t sample_size[SHUFFLE_MODES];
+	char *sample_buff;
+};
+
 struct bloscw_t {
-	char outbuff[BUF_OUT_SIZE];
-	int avail_out;			//space remained
-	char *next_out;			//ptr to next avail free space
 	iow_t *child;
 	enum err_t err;
 	int compression;
+	//per-handle settings, so that several handles can use blosc at once
+	const char *compressor;
+	int num_threads;
+	size_t typesize;
+	int shuffle;
+	size_t blocksize;
+
+	struct wandio_writer writer;
+
+	//compressed size with each shuffle mode while sampling
+	uint64_t sample_size[SHUFFLE_MODES];
+	int sampled;
+
+	/* Bytes written to the child so far */
+	uint64_t flushed;
+	uint64_t unc_total;
+	/* The chunk index, as it will be written out */
+	uint8_t *index;
+	size_t index_len;
+	size_t index_size;
+	uint64_t nchunks;
 };
 
 char *compressors[] = {"blosclz", "lz4", "lz4hc", "snappy", "zlib", "zstd"};
@@ -69,44 +136,215 @@ extern iow_source_t blosc_wsource;
 #define DATA(iow) ((struct bloscw_t *)((iow)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-iow_t *blosc_wopen(iow_t *child, int compress_type, int compress_level)
+static void write_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+static void write_le64(uint8_t *buf, uint64_t value)
+{
+	write_le32(buf, value & 0xffffffff);
+	write_le32(buf + 4, value >> 32);
+}
+
+/* Adds a chunk about to be written to the child to the index */
+static void add_index_entry(iow_t *iow)
+{
+	if (DATA(iow)->index_size < DATA(iow)->index_len + INDEX_ENTRY) {
+		DATA(iow)->index_size = DATA(iow)->index_size ?
+				DATA(iow)->index_size * 2 : 4096;
+		DATA(iow)->index = realloc(DATA(iow)->index,
+				DATA(iow)->index_size);
+	}
+	write_le64(DATA(iow)->index + DATA(iow)->index_len,
+			DATA(iow)->flushed);
+	write_le64(DATA(iow)->index + DATA(iow)->index_len + 8,
+			DATA(iow)->unc_total);
+	DATA(iow)->index_len += INDEX_ENTRY;
+	DATA(iow)->nchunks++;
+}
+
+static int compress_chunk_with(const struct bloscw_t *bw, int shuffle,
+		const char *src, int isize, char *dest, int destsize)
+{
+	return blosc_compress_ctx(bw->compression, shuffle, bw->typesize,
+			isize, src, dest, destsize, bw->compressor,
+			bw->blocksize, bw->num_threads);
+}
+
+//runs on a pool thread. in auto mode the chunk is compressed with every
+//shuffle mode and the smallest result kept, the sizes are totted up once
+//the job comes back to the main thread
+static void blosc_compress_job(void *data, iow_t *iow)
+{
+	struct bloscjob_t *job = (struct bloscjob_t *)data;
+	const struct bloscw_t *bw = DATA(iow);
+	char *dest = job->outbuff + RECORD_HEADER;
+	int destsize = sizeof(job->outbuff) - RECORD_HEADER;
+	int in_len = job->base.in_len;
+	int mode, csize;
+
+	job->out_len = 0;
+	if (job->shuffle != WANDIO_BLOSC_AUTOSHUFFLE)
+		job->out_len = compress_chunk_with(bw, job->shuffle,
+				job->inbuff, in_len, dest, destsize);
+	else
+	{
+		if (!job->sample_buff)
+			job->sample_buff = malloc(destsize);
+		for (mode = 0; mode < SHUFFLE_MODES; mode++)
+		{
+			csize = compress_chunk_with(bw, mode, job->inbuff,
+					in_len, job->sample_buff,
+					destsize);
+			job->sample_size[mode] = csize > 0 ? (uint64_t)csize :
+					(uint64_t)in_len + 
+					BLOSC_MAX_OVERHEAD;
+			if (csize <= 0 || (job->out_len > 0 &&
+					csize >= job->out_len))
+				continue;
+			memcpy(dest, job->sample_buff, csize);
+			job->out_len = csize;
+		}
+	}
+
+	job->base.failed = (job->out_len <= 0);
+	if (job->base.failed)
+	{
+		fprintf(stderr, "[wandio] <error> failed to compress chunk of %d bytes\n",
+			in_len);
+		return;
+	}
+	write_le32((uint8_t *)job->outbuff, in_len);
+	write_le32((uint8_t *)job->outbuff + 4, job->out_len);
+	job->out_len += RECORD_HEADER;
+}
+
+//decides on a shuffle mode once enough chunks have been sampled
+static void add_samples(iow_t *iow, struct bloscjob_t *job)
+{
+	int mode;
+
+	if (DATA(iow)->shuffle != WANDIO_BLOSC_AUTOSHUFFLE)
+		return;
+	for (mode = 0; mode < SHUFFLE_MODES; mode++)
+		DATA(iow)->sample_size[mode] += job->sample_size[mode];
+	if (++DATA(iow)->sampled < SAMPLE_CHUNKS)
+		return;
+
+	DATA(iow)->shuffle = WANDIO_BLOSC_NOSHUFFLE;
+	for (mode = 1; mode < SHUFFLE_MODES; mode++)
+		if (DATA(iow)->sample_size[mode] <
+				DATA(iow)->sample_size[DATA(iow)->shuffle])
+			DATA(iow)->shuffle = mode;
+	debug("[wandio] Using shuffle mode %d\n", DATA(iow)->shuffle);
+}
+
+//the shuffle mode is picked here rather than on the pool thread, since
+//it can change as the earlier chunks come back
+static void blosc_prepare_job(void *data, const void *prev, iow_t *iow)
+{
+	struct bloscjob_t *job = (struct bloscjob_t *)data;
+
+	(void)prev;
+	job->shuffle = DATA(iow)->shuffle;
+}
+
+//writes out a compressed chunk and adds it to the index
+static bool blosc_emit_job(void *data, iow_t *iow)
+{
+	struct bloscjob_t *job = (struct bloscjob_t *)data;
+
+	if (job->shuffle == WANDIO_BLOSC_AUTOSHUFFLE)
+		add_samples(iow, job);
+	add_index_entry(iow);
+	debug("[wandio] %s() input data size: %zu , compressed data size: %d \n",
+		 __func__, job->base.in_len, job->out_len);
+	if (wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) !=
+			job->out_len)
+		return false;
+	DATA(iow)->flushed += job->out_len;
+	DATA(iow)->unc_total += job->base.in_len;
+	return true;
+}
+
+static const struct wandio_writer_ops blosc_writer_ops = {
+	"blosc",
+	sizeof(struct bloscjob_t),
+	blosc_compress_job,
+	blosc_prepare_job,
+	blosc_emit_job
+};
+
+iow_t *blosc_wopen(iow_t *child, int compress_type, int compress_level,
+		const struct wandio_options *opts)
 {
 	iow_t *iow;
-	int rv = 0;
-	int num_threads = NUM_THREADS;
+	int num_threads = wandio_pool_threads(opts);
+	unsigned int threads;
+	unsigned int i;
 
 	if (!child)
 		return NULL;
 	if (compress_type < 6)
 	{
-                printf("[wandio] Wrong compressor type: %d\n", compress_type);
+                fprintf(stderr, "[wandio] Wrong compressor type: %d\n", compress_type);
                 return NULL;
 	}
 
-	iow = malloc(sizeof(iow_t));
+	iow = calloc(1, sizeof(iow_t));
 	iow->source = &blosc_wsource;
-	iow->data = malloc(sizeof(struct bloscw_t));
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct bloscw_t));
 
-        blosc_init();
-
-        blosc_set_nthreads(num_threads);
-        printf("[wandio] Using %d threads \n", num_threads);
+	//blosc's own threads compress each chunk, but it always needs one
+	if (num_threads < 1)
+		num_threads = 1;
+	DATA(iow)->num_threads = num_threads;
+	debug("[wandio] Using %d threads \n", num_threads);
 	//6 is magic constant
-        rv = blosc_set_compressor(compressors[compress_type - 6]);
-        if (rv < 0)
-        {
-                printf("[wandio] Error setting compressor %s\n", compressors[compress_type - 6]);
-                return NULL;
-        }
-        printf("[wandio] Using %s compressor\n", compressors[compress_type - 6]);
+	DATA(iow)->compressor = compressors[compress_type - 6];
+	if (blosc_compname_to_compcode(DATA(iow)->compressor) < 0)
+	{
+		fprintf(stderr, "[wandio] Error setting compressor %s\n", DATA(iow)->compressor);
+		free(iow->data);
+		free(iow);
+		return NULL;
+	}
+	debug("[wandio] Using %s compressor\n", DATA(iow)->compressor);
+
+	//blosc treats anything it can't shuffle by as plain bytes anyway
+	DATA(iow)->typesize = opts->blosc_typesize ? opts->blosc_typesize : 1;
+	DATA(iow)->shuffle = opts->blosc_shuffle;
+	DATA(iow)->blocksize = opts->blosc_blocksize;
 
 	DATA(iow)->child = child;
 	DATA(iow)->err = ERR_OK;
 	//store compression
 	DATA(iow)->compression = compress_level;
-	//init next_out ptr
-	DATA(iow)->next_out = DATA(iow)->outbuff;
-	DATA(iow)->avail_out = sizeof(DATA(iow)->outbuff);
+
+	//one thread is enough to keep compression going while we write, as
+	//blosc spreads each chunk over its own threads
+	threads = wandio_pool_threads(opts) ? 1 : 0;
+	if (!wandio_writer_init(&DATA(iow)->writer, &blosc_writer_ops, iow,
+			threads, threads ? RING_SLOTS : 1, CHUNK_SIZE))
+	{
+		DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
+	for (i = 0; i < DATA(iow)->writer.slots; i++)
+	{
+		struct bloscjob_t *job = wandio_writer_slot(&DATA(iow)->writer, i);
+		job->base.in = (uint8_t *)job->inbuff;
+	}
+
+	if (wandio_wwrite(child, blosc_magic, sizeof(blosc_magic)) !=
+			sizeof(blosc_magic))
+		DATA(iow)->err = ERR_ERROR;
+	DATA(iow)->flushed = sizeof(blosc_magic);
 
 	return iow;
 }
@@ -120,76 +358,53 @@ static int64_t blosc_wwrite(iow_t *iow, const char *buffer, int64_t len)
 
 	debug("[wandio] %s() ENTER. buf: %p , len: %ld \n", __func__, buffer, len);
 
-	//init buffer vars
-	const char *dta = buffer;
-	size_t remained = len;
-	int csize;
-	int isize = (int)len;
-	int osize = BUF_OUT_SIZE;
-
-	//somehow occasionally we have blosc_wwrite() call with 0 len
-	if (!len)
-	{
-		return 0;
-	}
-	
-	while (DATA(iow)->err == ERR_OK && remained > 0) 
-	{	//when buffer is almost full we write it to file and set next_out, avail_out again
-		while (DATA(iow)->avail_out <= FREE_SPACE_LIMIT)
-		{
-			int bytes_written = wandio_wwrite(DATA(iow)->child, (char *)DATA(iow)->outbuff, 
-							  sizeof(DATA(iow)->outbuff) - DATA(iow)->avail_out);
-			debug("[wandio] %s() writing buffer on disk\n", __func__);
-			if (bytes_written <= 0) 
-			{
-				DATA(iow)->err = ERR_ERROR;
-				if (remained != (size_t)len)
-					return len - remained;//return length we processed
-				return -1;
-			}
-			DATA(iow)->next_out = DATA(iow)->outbuff;
-			DATA(iow)->avail_out = sizeof(DATA(iow)->outbuff);
-		}
-		//repu1sion: do the blosc compression on buffer
-		csize = blosc_compress(DATA(iow)->compression,0,sizeof(char), isize, dta, DATA(iow)->next_out, osize);
-		//repu1sion: manage all avail_in, avail_out, next_out vars.
-		if (csize > DATA(iow)->avail_out)
-		{
-			//XXX - create mechanism to prevent overflow? write buffer with wandio_write() here?
-			printf("[wandio] <error> overflow! compressed data size: %d , space in buffer: %u \n",
-				csize, DATA(iow)->avail_out);
-			DATA(iow)->err = ERR_ERROR;
-			return -1;
-		}
-		remained -= isize;			//repu1sion: it should be 0, anyway
-		DATA(iow)->avail_out -= csize;		//repu1sion: decrease available space in output buffer
-		DATA(iow)->next_out += csize;		//repu1sion: move pointer forward
-		debug("[wandio] %s() input data size: %d , compressed data size: %d , space in buffer: %u \n",
-			 __func__, isize, csize, DATA(iow)->avail_out);
-	}
 	/* Return the number of bytes compressed */
-	return len - remained;	//repulsion: len - 0 = len, so we mostly return len here
+	return wandio_writer_write(&DATA(iow)->writer, buffer, len);
 }
 
-//we just save to disc our outbuff here. we don't have here a buffer with input data
-//here so what we can do is just save what we collected in outbuff already
+//compresses whatever is left, then writes the end record, the index and
+//the footer that points at it
 static void blosc_wclose(iow_t *iow)
 {
+	uint8_t trailer[RECORD_HEADER + 24 + sizeof(blosc_magic)];
+	unsigned int i;
+
 	debug("[wandio] %s() \n", __func__);
 
-	wandio_wwrite(DATA(iow)->child, DATA(iow)->outbuff, sizeof(DATA(iow)->outbuff) - DATA(iow)->avail_out);
-	debug("[wandio] %s() writing buffer with size: %lu \n", __func__, 
-		sizeof(DATA(iow)->outbuff) - DATA(iow)->avail_out);
+	if (DATA(iow)->err == ERR_OK &&
+			!wandio_writer_finish(&DATA(iow)->writer, 
+				WANDIO_TAIL_IF_DATA))
+		DATA(iow)->err = ERR_ERROR;
+
+	if (DATA(iow)->err == ERR_OK)
+	{
+		memset(trailer, 0, RECORD_HEADER);
+		write_le64(trailer + RECORD_HEADER, DATA(iow)->flushed + RECORD_HEADER);
+		write_le64(trailer + RECORD_HEADER + 8, DATA(iow)->nchunks);
+		write_le64(trailer + RECORD_HEADER + 16, DATA(iow)->unc_total);
+		memcpy(trailer + RECORD_HEADER + 24, blosc_magic, sizeof(blosc_magic));
+		wandio_wwrite(DATA(iow)->child, trailer, RECORD_HEADER);
+		wandio_wwrite(DATA(iow)->child, DATA(iow)->index, DATA(iow)->index_len);
+		wandio_wwrite(DATA(iow)->child, trailer + RECORD_HEADER,
+			      sizeof(trailer) - RECORD_HEADER);
+	}
 
+	for (i = 0; DATA(iow)->writer.jobs && i < DATA(iow)->writer.slots; i++)
+	{
+		struct bloscjob_t *job = wandio_writer_slot(&DATA(iow)->writer, i);
+		free(job->sample_buff);
+	}
+	wandio_writer_destroy(&DATA(iow)->writer);
+	free(DATA(iow)->index);
 	wandio_wdestroy(DATA(iow)->child);
 	free(iow->data);
 	free(iow);
-
-	blosc_destroy();
 }
 
 iow_source_t blosc_wsource = {
 	"bloscw",
 	blosc_wwrite,
-	blosc_wclose
+	blosc_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
@@ -25,6 +25,7 @@
  */
 
 #include "config.h"
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <bzlib.h>
 #include <sys/types.h>
@@ -33,7 +34,14 @@
 #include <stdlib.h>
 #include <string.h>
 
-/* Libwandio IO module implement a bzip writer */
+/* Libwandio IO module implement a bzip writer
+ *
+ * Without any threads this runs a single bzip2 stream in the calling
+ * thread. Otherwise the data is cut into blocks of the bzip2 block size
+ * which are compressed in parallel, pbzip2-style, each as a complete bzip2
+ * stream of its own. The streams are written out in order and bunzip2
+ * (like bz_open) simply decompresses them one after the other.
+ */
 
 enum err_t {
 	ERR_OK	= 1,
@@ -41,12 +49,23 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
+struct bzjob_t {
+	struct wandio_writer_job base;
+	char *outbuff;
+	unsigned int out_len;
+};
+
 struct bzw_t {
 	bz_stream strm;
 	char outbuff[1024*1024];
 	int inoffset;
 	iow_t *child;
 	enum err_t err;
+
+	/* Everything below is only used with threads */
+	bool parallel;
+	struct wandio_writer writer;
+	int level;
 };
 
 
@@ -55,16 +74,83 @@ extern iow_source_t bz_wsource;
 #define DATA(iow) ((struct bzw_t *)((iow)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-iow_t *bz_wopen(iow_t *child, int compress_level)
+/* Worst case size of a compressed block, from the bzip2 manual */
+#define BZ_BOUND(len) ((len) + (len) / 100 + 600)
+
+/* Runs on a pool thread */
+static void bz_compress_block(void *data, iow_t *iow)
+{
+	struct bzjob_t *job = (struct bzjob_t *)data;
+
+	job->out_len = BZ_BOUND(job->base.in_len);
+	job->base.failed = (BZ2_bzBuffToBuffCompress(job->outbuff, 
+			&job->out_len, (char *)job->base.in, job->base.in_len, 
+			DATA(iow)->level,
+			0,		/* Verbosity */
+			30)		/* Work factor */
+			!= BZ_OK);
+}
+
+static bool bz_emit_block(void *data, iow_t *iow)
+{
+	struct bzjob_t *job = (struct bzjob_t *)data;
+
+	return wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) 
+			== (int64_t)job->out_len;
+}
+
+static const struct wandio_writer_ops bz_writer_ops = {
+	"bzip",
+	sizeof(struct bzjob_t),
+	bz_compress_block,
+	NULL,	/* prepare */
+	bz_emit_block
+};
+
+static void bz_parallel_init(iow_t *iow, int compress_level, 
+		unsigned int threads)
+{
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	/* One bzip2 block per job. bzip2 itself fills a block with a 
+	 * little less than this, so the odd job ends up as two blocks, which
+	 * is harmless */
+	unsigned int block_size = compress_level * 100000;
+	unsigned int i;
+
+	DATA(iow)->parallel = true;
+	DATA(iow)->level = compress_level;
+	if (!wandio_writer_init(writer, &bz_writer_ops, iow, threads, 0, 
+			block_size)) {
+		DATA(iow)->err = ERR_ERROR;
+		return;
+	}
+	for (i = 0; i < writer->slots; ++i) {
+		struct bzjob_t *job = wandio_writer_slot(writer, i);
+		job->base.in = malloc(block_size);
+		job->outbuff = malloc(BZ_BOUND(block_size));
+	}
+}
+
+iow_t *bz_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts)
 {
 	iow_t *iow;
+	unsigned int threads;
 	if (!child)
 		return NULL;
-	iow = malloc(sizeof(iow_t));
+	iow = calloc(1, sizeof(iow_t));
 	iow->source = &bz_wsource;
-	iow->data = malloc(sizeof(struct bzw_t));
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct bzw_t));
 
 	DATA(iow)->child = child;
+	DATA(iow)->err = ERR_OK;
+
+	threads = wandio_pool_threads(opts);
+	if (threads) {
+		bz_parallel_init(iow, compress_level, threads);
+		return iow;
+	}
 
 	DATA(iow)->strm.next_in = NULL;
 	DATA(iow)->strm.avail_in = 0;
@@ -73,7 +159,6 @@ iow_t *bz_wopen(iow_t *child, int compress_level)
 	DATA(iow)->strm.bzalloc = NULL;
 	DATA(iow)->strm.bzfree = NULL;
 	DATA(iow)->strm.opaque = NULL;
-	DATA(iow)->err = ERR_OK;
 
 	BZ2_bzCompressInit(&DATA(iow)->strm, 
 			compress_level,	/* Block size */
@@ -83,7 +168,6 @@ iow_t *bz_wopen(iow_t *child, int compress_level)
 	return iow;
 }
 
-
 static int64_t bz_wwrite(iow_t *iow, const char *buffer, int64_t len)
 {
 	if (DATA(iow)->err == ERR_EOF) {
@@ -93,6 +177,9 @@ static int64_t bz_wwrite(iow_t *iow, const char *buffer, int64_t len)
 		return -1; /* ERROR! */
 	}
 
+	if (DATA(iow)->parallel)
+		return wandio_writer_write(&DATA(iow)->writer, buffer, len);
+
 	DATA(iow)->strm.next_in = (char*)buffer;
 	DATA(iow)->strm.avail_in = len;
 
@@ -129,8 +216,38 @@ static int64_t bz_wwrite(iow_t *iow, const char *buffer, int64_t len)
 	return len-DATA(iow)->strm.avail_in;
 }
 
+static void bz_wclose_parallel(iow_t *iow)
+{
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	unsigned int i;
+
+	/* Whatever is left goes out as a final, shorter, stream. An empty 
+	 * file still gets one so that it is recognisable as bzip2 */
+	if (DATA(iow)->err == ERR_OK && 
+			!wandio_writer_finish(writer, WANDIO_TAIL_AT_LEAST_ONE))
+		DATA(iow)->err = ERR_ERROR;
+
+	if (DATA(iow)->err != ERR_OK)
+		fprintf(stderr, "Error while compressing bzip2 output\n");
+
+	for (i = 0; writer->jobs && i < writer->slots; ++i) {
+		struct bzjob_t *job = wandio_writer_slot(writer, i);
+		free(job->base.in);
+		free(job->outbuff);
+	}
+	wandio_writer_destroy(writer);
+	wandio_wdestroy(DATA(iow)->child);
+	free(iow->data);
+	free(iow);
+}
+
 static void bz_wclose(iow_t *iow)
 {
+	if (DATA(iow)->parallel) {
+		bz_wclose_parallel(iow);
+		return;
+	}
+
 	while (BZ2_bzCompress(&DATA(iow)->strm, BZ_FINISH) == BZ_OK) {
 		/* Need to flush the output buffer */
 		wandio_wwrite(DATA(iow)->child, 
@@ -151,6 +268,8 @@ static void bz_wclose(iow_t *iow)
 iow_source_t bz_wsource = {
 	"bzw",
 	bz_wwrite,
-	bz_wclose
+	bz_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
 
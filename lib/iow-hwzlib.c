@@ -27,7 +27,6 @@
 /* Libwandio IO module implementing a zlib writer */
 
 #include "config.h"
-#include <zlib.h>
 #include "wandio.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,7 +34,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#if HAVE_AHAGZ
 #include "ahagz_api.h"
+#else
+#include "ahagz_soft.h"
+#endif
+
+/* The input is cut into blocks which go round a ring of num_blocks streams
+ * on the card: each full block is submitted as soon as it is ready, and the
+ * oldest one is only waited for when its stream is needed again. So the
+ * card keeps working between calls, and while we write out what it has
+ * already finished. Every block comes out as a gzip member of its own.
+ */
 
 enum err_t {
 	ERR_OK	= 1,
@@ -43,21 +53,6 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
-struct zlibw_t {
-	z_stream strm;
-	Bytef outbuff[1024*1024];
-	iow_t *child;
-	enum err_t err;
-	int inoffset;
-	//repu1sion: extending struct
-	int num_blocks;
-};
-
-extern iow_source_t hwzlib_wsource; 
-
-#define DATA(iow) ((struct zlibw_t *)((iow)->data))
-#define min(a,b) ((a)<(b) ? (a) : (b))
-
 //repu1sion-----
 #define INPUT_BUFFER_SIZE (128*1024) //131072
 #define OUTPUT_BUFFER_SIZE (INPUT_BUFFER_SIZE + (5 * ((INPUT_BUFFER_SIZE + 4095)/4096)) + 30) //131262
@@ -71,7 +66,23 @@ typedef struct {
   char out_buff[OUTPUT_BUFFER_SIZE];
 } block_info_t;
 
-block_info_t *blocks = NULL;
+struct zlibw_t {
+	iow_t *child;
+	enum err_t err;
+	//repu1sion: extending struct
+	int num_blocks;
+	block_info_t *blocks;
+	int head;		//block being filled
+	int tail;		//oldest block with the card
+	int submitted;		//number of blocks with the card
+	int in_len;		//data in the block being filled
+	int64_t members;	//gzip members submitted so far
+};
+
+extern iow_source_t hwzlib_wsource; 
+
+#define DATA(iow) ((struct zlibw_t *)((iow)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
 
 static void pulseaha_cleanup(block_info_t *blocks, int num_blocks)
 {
@@ -90,14 +101,12 @@ static void pulseaha_cleanup(block_info_t *blocks, int num_blocks)
 static int pulseaha_get_comp_channels(void)
 {
 	aha_stream_t as;
-	uint32_t ncomp;
+	uint32_t ncomp = 0;
 
 	if(ahagz_api_channels_available(&as, &ncomp, NULL))
 	{
 		fprintf(stderr, "Error calling ahagz_api_channels_available().  Is the driver loaded?\n");
 	}
-	else
-		printf("[wandioaha] available channels: %u\n", ncomp);
 
 	if(ncomp < 1)
 	{
@@ -110,16 +119,13 @@ static int pulseaha_get_comp_channels(void)
 iow_t *hwzlib_wopen(iow_t *child, int compress_level)
 {
 	iow_t *iow;
-	if (!child)
-		return NULL;
-	iow = malloc(sizeof(iow_t));
-	iow->source = &hwzlib_wsource;
-	iow->data = malloc(sizeof(struct zlibw_t));
-
-	//repu1sion -----
+	block_info_t *blocks;
 	int i;
 	int num_chan = 0;
 
+	if (!child)
+		return NULL;
+
 	(void)compress_level; //we don't use it in aha yet
 	
 	// Check for number of compression channels
@@ -129,18 +135,17 @@ iow_t *hwzlib_wopen(iow_t *child, int compress_level)
 		fprintf(stderr, "No available channels!\n");
 		return NULL;
 	}
-	DATA(iow)->num_blocks = 4 * num_chan; //we split to blocks, so if 12 channels, then 48 blocks.
 
-	// Initialize channels and buffers
-	blocks = malloc(DATA(iow)->num_blocks * sizeof(*blocks));
+	// Initialize channels and buffers. we split to blocks, so if 12
+	// channels, then 48 blocks.
+	blocks = calloc(4 * num_chan, sizeof(*blocks));
 	if(!blocks)
 	{
 		fprintf(stderr, "Error allocating memory.\n");
-		pulseaha_cleanup(blocks, 0);
 		return NULL;
 	}
 
-	for(i = 0; i < DATA(iow)->num_blocks; i++)
+	for(i = 0; i < 4 * num_chan; i++)
 	{
 		if(ahagz_api_open(&blocks[i].stream, 0, 0))//need to call ahagz_api_open() for every stream 48 times!!!
 		{
@@ -150,221 +155,175 @@ iow_t *hwzlib_wopen(iow_t *child, int compress_level)
 		}
 	}
 
-	//---------------
+	iow = calloc(1, sizeof(iow_t));
+	iow->source = &hwzlib_wsource;
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct zlibw_t));
 
 	DATA(iow)->child = child;
 	DATA(iow)->err = ERR_OK;
+	DATA(iow)->num_blocks = 4 * num_chan;
+	DATA(iow)->blocks = blocks;
 
 	return iow;
 }
 
-//this func usually gets called when we have a 1 Mb in buffer
-static int64_t hwzlib_wwrite(iow_t *iow, const char *buffer, int64_t len)
+//hands the block being filled to the card, which starts on it straight away
+static int submit_block(iow_t *iow)
 {
-	if (DATA(iow)->err == ERR_EOF)
-		return 0; /* EOF */
-	if (DATA(iow)->err == ERR_ERROR)
-		return -1; /* ERROR! */
+	block_info_t *block = &DATA(iow)->blocks[DATA(iow)->head];
 
-	int head = 0;		//counter for input data blocks
-	int tail = 0;		//counter for output data blocks
-	int submitted = 0;	//increase when add block to input, decrease when add to output
+	if(ahagz_api_addoutput(&block->stream, block->out_buff + OBUFF_OFFSET,
+		OUTPUT_BUFFER_SIZE - OBUFF_OFFSET))
+	{
+		fprintf(stderr, "Error adding output buffer.\n");
+		return -1;
+	}
+	//The AHA device begins processing data after an input buffer is added.
+	if(ahagz_api_addinput(&block->stream, block->in_buff, DATA(iow)->in_len, 1, 1, 0, NULL, 0))
+	{
+		fprintf(stderr, "Error adding input buffer.\n");
+		return -1;
+	}
+
+	DATA(iow)->head++;
+	if(DATA(iow)->head == DATA(iow)->num_blocks) 
+		DATA(iow)->head = 0;
+	DATA(iow)->submitted++;
+	DATA(iow)->members++;
+	DATA(iow)->in_len = 0;
+	return 0;
+}
+
+//waits for the oldest block on the card, writes it out and frees its stream
+static int complete_block(iow_t *iow)
+{
+	block_info_t *block = &DATA(iow)->blocks[DATA(iow)->tail];
 	uint32_t in_cnt;
 	uint32_t out_cnt;
 	int64_t rv;
-	char *buf_p = (char *)buffer;
-	size_t remained = len;
-	size_t copylen;
 
-	//printf("[wandioaha] %s() ENTER. buf: %p , len: %ld \n", __func__, buffer, len);
+	do 
+	{	//we do not really check in_cnt and out_cnt
+		rv = ahagz_api_waitstat(&block->stream, &in_cnt, &out_cnt, TIMEOUT);
+	} while (rv < 0x8000 || rv == RET_BUFF_RECLAIM);
 
-	while (remained)
+	if (rv != 0x8000)
 	{
-		if (remained > INPUT_BUFFER_SIZE)
-			copylen = INPUT_BUFFER_SIZE;
-		else
-			copylen = remained;
-		memcpy(blocks[head].in_buff, buf_p, copylen);
-
-		buf_p += copylen;
-		remained -= copylen;
-
-		if(ahagz_api_addoutput(&blocks[head].stream, blocks[head].out_buff + OBUFF_OFFSET,
-			OUTPUT_BUFFER_SIZE - OBUFF_OFFSET))
-		{
-			fprintf(stderr, "Error adding output buffer.\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;
-		}
-		//The AHA device begins processing data after an input buffer is added.
-		if(ahagz_api_addinput(&blocks[head].stream, blocks[head].in_buff, copylen, 1, 1, 0, NULL, 0))
-		{
-			fprintf(stderr, "Error adding input buffer.\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;
-		}
+		fprintf(stderr, "Error encountered calling ahagz_api_waitstat().\n");
+		return -1;	
+	}
 
-		head++;
-		//if we yet have data then we put it in #0 buffer again in hope its already processed
-		//probably in some obstacles overflow is possible. need to check on real examples
-		if(head == DATA(iow)->num_blocks) 
-			head = 0;
+	//returns output size of compressed data
+	rv = ahagz_api_output_size(&block->stream);
+	if(rv < 0)
+	{
+		fprintf(stderr, "Error encountered calling ahagz_api_output_size().\n");
+		return -1;	
+	}
 
-		submitted++;
+	// Adjust size for expanded header
+	int block_len = rv + OBUFF_OFFSET;
+
+	// Build new header (XXX - check this later, why do we need to add header manually?)
+	block->out_buff[0] = 0x1f;
+	block->out_buff[1] = 0x8b;
+	block->out_buff[2] = 0x08;
+	block->out_buff[3] = 0x04;
+	block->out_buff[4] = 0x00;
+	block->out_buff[5] = 0x00;
+	block->out_buff[6] = 0x00;
+	block->out_buff[7] = 0x00;
+	block->out_buff[8] = 0x00;
+	block->out_buff[9] = 0x03;
+	block->out_buff[10] = 0x08; // Extra len
+	block->out_buff[11] = 0x00;
+	block->out_buff[12] = 'E'; // SI1
+	block->out_buff[13] = 'F'; // SI2
+	block->out_buff[14] = 0x04; // LEN
+	block->out_buff[15] = 0x00;
+	block->out_buff[16] = block_len & 0xff;         // Store compressed block length
+	block->out_buff[17] = (block_len >> 8) & 0xff;
+	block->out_buff[18] = (block_len >> 16) & 0xff;
+	block->out_buff[19] = (block_len >> 24) & 0xff;
+
+	int bytes_written = wandio_wwrite(DATA(iow)->child, block->out_buff, block_len);
+	if(bytes_written != block_len)
+	{
+		fprintf(stderr, "Error encountered calling write().\n");
+		return -1;
 	}
 
-	while (submitted)
+	if(ahagz_api_reinitialize(&block->stream, 0, 0))
 	{
-		do 
-		{	//we do not really check in_cnt and out_cnt
-			rv = ahagz_api_waitstat(&blocks[tail].stream, &in_cnt, &out_cnt, TIMEOUT);
-		} while (rv < 0x8000 || rv == RET_BUFF_RECLAIM);
+		fprintf(stderr, "Error calling ahagz_api_reinitialize().\n");
+		return -1;
+	}
 
-		if (rv != 0x8000)
-		{
-			fprintf(stderr, "Error encountered calling ahagz_api_waitstat().\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;	
-		}
+	DATA(iow)->tail++;
+	if(DATA(iow)->tail == DATA(iow)->num_blocks) 
+		DATA(iow)->tail = 0;
+	DATA(iow)->submitted--;
+	return 0;
+}
 
-		//returns output size of compressed data
-		rv = ahagz_api_output_size(&blocks[tail].stream);
-		if(rv < 0)
-		{
-			fprintf(stderr, "Error encountered calling ahagz_api_output_size().\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;	
-		}
+//this func usually gets called when we have a 1 Mb in buffer
+static int64_t hwzlib_wwrite(iow_t *iow, const char *buffer, int64_t len)
+{
+	int64_t done = 0;
+	size_t copylen;
 
-		// Adjust size for expanded header
-		int block_len = rv + OBUFF_OFFSET;
-
-		// Build new header (XXX - check this later, why do we need to add header manually?)
-		blocks[tail].out_buff[0] = 0x1f;
-		blocks[tail].out_buff[1] = 0x8b;
-		blocks[tail].out_buff[2] = 0x08;
-		blocks[tail].out_buff[3] = 0x04;
-		blocks[tail].out_buff[4] = 0x00;
-		blocks[tail].out_buff[5] = 0x00;
-		blocks[tail].out_buff[6] = 0x00;
-		blocks[tail].out_buff[7] = 0x00;
-		blocks[tail].out_buff[8] = 0x00;
-		blocks[tail].out_buff[9] = 0x03;
-		blocks[tail].out_buff[10] = 0x08; // Extra len
-		blocks[tail].out_buff[11] = 0x00;
-		blocks[tail].out_buff[12] = 'E'; // SI1
-		blocks[tail].out_buff[13] = 'F'; // SI2
-		blocks[tail].out_buff[14] = 0x04; // LEN
-		blocks[tail].out_buff[15] = 0x00;
-		blocks[tail].out_buff[16] = block_len & 0xff;         // Store compressed block length
-		blocks[tail].out_buff[17] = (block_len >> 8) & 0xff;
-		blocks[tail].out_buff[18] = (block_len >> 16) & 0xff;
-		blocks[tail].out_buff[19] = (block_len >> 24) & 0xff;
-
-		int bytes_written = wandio_wwrite(DATA(iow)->child, blocks[tail].out_buff, block_len);
-		if (bytes_written <= 0)
+	if (DATA(iow)->err == ERR_EOF)
+		return 0; /* EOF */
+	if (DATA(iow)->err == ERR_ERROR)
+		return -1; /* ERROR! */
+
+	//printf("[wandioaha] %s() ENTER. buf: %p , len: %ld \n", __func__, buffer, len);
+
+	while (done < len)
+	{
+		//every stream is busy, so the block we want to fill is still
+		//with the card: wait for it
+		if (DATA(iow)->submitted == DATA(iow)->num_blocks &&
+				complete_block(iow) < 0)
 		{
 			DATA(iow)->err = ERR_ERROR;
-			//XXX - rework this
-			//if (DATA(iow)->strm.avail_in != (uint32_t)len)
-			//	return len-DATA(iow)->strm.avail_in;
-			return -1;
+			break;
 		}
 
-		if(bytes_written != block_len)
-		{
-			fprintf(stderr, "Error encountered calling write().\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;
-		}
+		copylen = min(len - done, INPUT_BUFFER_SIZE - DATA(iow)->in_len);
+		memcpy(DATA(iow)->blocks[DATA(iow)->head].in_buff + DATA(iow)->in_len,
+			buffer + done, copylen);
+		DATA(iow)->in_len += copylen;
+		done += copylen;
 
-		if(ahagz_api_reinitialize(&blocks[tail].stream, 0, 0))
+		if (DATA(iow)->in_len == INPUT_BUFFER_SIZE && submit_block(iow) < 0)
 		{
-			fprintf(stderr, "Error calling ahagz_api_reinitialize().\n");
-			pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
-			return -1;
+			DATA(iow)->err = ERR_ERROR;
+			break;
 		}
-
-		tail++;
-		if(tail == DATA(iow)->num_blocks) 
-			tail = 0;
-		submitted--;
 	}
 
-
-
-#if 0
-	DATA(iow)->strm.next_in = (Bytef*)buffer; /* This casts away const, but it's really const 
-						   * anyway 
-						   */
-	DATA(iow)->strm.avail_in = len;
-
-	while (DATA(iow)->err == ERR_OK && DATA(iow)->strm.avail_in > 0) {
-		while (DATA(iow)->strm.avail_out <= 0) {
-			int bytes_written = wandio_wwrite(DATA(iow)->child, 
-				(char *)DATA(iow)->outbuff,
-				sizeof(DATA(iow)->outbuff));
-			if (bytes_written <= 0) { /* Error */
-				DATA(iow)->err = ERR_ERROR;
-				/* Return how much data we managed to write ok */
-				if (DATA(iow)->strm.avail_in != (uint32_t)len) {
-					return len-DATA(iow)->strm.avail_in;
-				}
-				/* Now return error */
-				return -1;
-			}
-			DATA(iow)->strm.next_out = DATA(iow)->outbuff;
-			DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
-		}
-		/* Decompress some data into the output buffer */
-		int err=deflate(&DATA(iow)->strm, 0);
-		switch(err) {
-			case Z_OK:
-				DATA(iow)->err = ERR_OK;
-				break;
-			default:
-				DATA(iow)->err = ERR_ERROR;
-		}
-	}
-	/* Return the number of bytes decompressed */
-	return len-DATA(iow)->strm.avail_in;
-#endif
-	return len - remained;
+	if (done == 0 && DATA(iow)->err == ERR_ERROR)
+		return -1;
+	return done;
 }
 
-
-//XXX - do we need a wandio_write() here or not?
+//sends off whatever is left and writes out every block still on the card
 static void hwzlib_wclose(iow_t *iow)
 {
-	
-#if 0
-	int res;
-
-	while (1) {
-		res = deflate(&DATA(iow)->strm, Z_FINISH);
-
-		if (res == Z_STREAM_END)
-			break;
-		if (res == Z_STREAM_ERROR) {
-			fprintf(stderr, "Z_STREAM_ERROR while closing output\n");
-			break;
-		}
-	
-		wandio_wwrite(DATA(iow)->child, 
-				(char*)DATA(iow)->outbuff,
-				sizeof(DATA(iow)->outbuff)-DATA(iow)->strm.avail_out);
-		DATA(iow)->strm.next_out = DATA(iow)->outbuff;
-		DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
+	//an empty file still gets one (empty) gzip member, like zlib_wclose
+	if (DATA(iow)->err == ERR_OK &&
+			(DATA(iow)->in_len > 0 || DATA(iow)->members == 0) &&
+			submit_block(iow) < 0)
+		DATA(iow)->err = ERR_ERROR;
+	while (DATA(iow)->err == ERR_OK && DATA(iow)->submitted > 0)
+	{
+		if (complete_block(iow) < 0)
+			DATA(iow)->err = ERR_ERROR;
 	}
 
-	deflateEnd(&DATA(iow)->strm);
-
-	wandio_wwrite(DATA(iow)->child, 
-			(char *)DATA(iow)->outbuff,
-			sizeof(DATA(iow)->outbuff)-DATA(iow)->strm.avail_out);
-#endif
-
-	pulseaha_cleanup(blocks, DATA(iow)->num_blocks);
+	pulseaha_cleanup(DATA(iow)->blocks, DATA(iow)->num_blocks);
 
 	wandio_wdestroy(DATA(iow)->child);
 	free(iow->data);
@@ -374,5 +333,7 @@ static void hwzlib_wclose(iow_t *iow)
 iow_source_t hwzlib_wsource = {
 	"hwzlibw",		//repu1sion: doesn't seem like used somewhere
 	hwzlib_wwrite,
-	hwzlib_wclose
+	hwzlib_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
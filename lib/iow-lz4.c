@@ -0,0 +1,183 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <lz4frame.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Libwandio IO module implementing an lz4 writer
+ *
+ * The data is cut into chunks of one lz4 block each, and every chunk is
+ * written out as a frame of its own. Since the frames don't depend on each
+ * other they can be compressed in parallel on a wandio_pool, and the lz4
+ * tool reads the result just like a file with one frame.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+/* Amount of data in each frame, the largest lz4 block size */
+#define JOB_SIZE (4*1024*1024)
+
+struct lz4job_t {
+	struct wandio_writer_job base;
+	uint8_t inbuff[JOB_SIZE];
+	uint8_t *outbuff;
+	size_t out_size;
+	size_t out_len;
+};
+
+struct lz4w_t {
+	iow_t *child;
+	enum err_t err;
+	LZ4F_preferences_t prefs;
+	struct wandio_writer writer;
+};
+
+
+extern iow_source_t lz4_wsource;
+
+#define DATA(iow) ((struct lz4w_t *)((iow)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+/* Runs on a pool thread */
+static void lz4_compress_frame(void *data, iow_t *iow)
+{
+	struct lz4job_t *job = (struct lz4job_t *)data;
+	LZ4F_preferences_t prefs = DATA(iow)->prefs;
+	size_t ret;
+
+	prefs.frameInfo.contentSize = job->base.in_len;
+	ret = LZ4F_compressFrame(job->outbuff, job->out_size, job->inbuff,
+			job->base.in_len, &prefs);
+	job->base.failed = LZ4F_isError(ret);
+	job->out_len = job->base.failed ? 0 : ret;
+}
+
+static bool lz4_emit_frame(void *data, iow_t *iow)
+{
+	struct lz4job_t *job = (struct lz4job_t *)data;
+
+	return wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) 
+			== (int64_t)job->out_len;
+}
+
+static const struct wandio_writer_ops lz4_writer_ops = {
+	"lz4",
+	sizeof(struct lz4job_t),
+	lz4_compress_frame,
+	NULL,	/* prepare */
+	lz4_emit_frame
+};
+
+iow_t *lz4_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts)
+{
+	iow_t *iow;
+	unsigned int threads;
+	unsigned int i;
+	LZ4F_preferences_t *prefs;
+	if (!child)
+		return NULL;
+	iow = calloc(1, sizeof(iow_t));
+	iow->source = &lz4_wsource;
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct lz4w_t));
+
+	DATA(iow)->child = child;
+	DATA(iow)->err = ERR_OK;
+
+	/* Levels below 3 use the fast compressor, the rest lz4hc */
+	prefs = &DATA(iow)->prefs;
+	prefs->frameInfo.blockSizeID = LZ4F_max4MB;
+	prefs->frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs->frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	prefs->compressionLevel = compress_level;
+
+	threads = wandio_pool_threads(opts);
+	if (!wandio_writer_init(&DATA(iow)->writer, &lz4_writer_ops, iow,
+			threads, 0, JOB_SIZE)) {
+		DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
+	for (i = 0; i < DATA(iow)->writer.slots; ++i) {
+		struct lz4job_t *job = wandio_writer_slot(&DATA(iow)->writer, i);
+		job->base.in = job->inbuff;
+		job->out_size = LZ4F_compressFrameBound(JOB_SIZE, prefs);
+		job->outbuff = malloc(job->out_size);
+	}
+
+	return iow;
+}
+
+static int64_t lz4_wwrite(iow_t *iow, const char *buffer, int64_t len)
+{
+	if (DATA(iow)->err == ERR_EOF) {
+		return 0; /* EOF */
+	}
+	if (DATA(iow)->err == ERR_ERROR) {
+		return -1; /* ERROR! */
+	}
+	return wandio_writer_write(&DATA(iow)->writer, buffer, len);
+}
+
+static void lz4_wclose(iow_t *iow)
+{
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	unsigned int i;
+
+	if (DATA(iow)->err == ERR_OK && 
+			!wandio_writer_finish(writer, WANDIO_TAIL_AT_LEAST_ONE))
+		DATA(iow)->err = ERR_ERROR;
+
+	if (DATA(iow)->err != ERR_OK)
+		fprintf(stderr, "Error while compressing lz4 output\n");
+
+	for (i = 0; writer->jobs && i < writer->slots; ++i) {
+		struct lz4job_t *job = wandio_writer_slot(writer, i);
+		free(job->outbuff);
+	}
+	wandio_writer_destroy(writer);
+	wandio_wdestroy(DATA(iow)->child);
+	free(iow->data);
+	free(iow);
+}
+
+iow_source_t lz4_wsource = {
+	"lz4w",
+	lz4_wwrite,
+	lz4_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
+};
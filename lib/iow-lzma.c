@@ -27,6 +27,7 @@
 
 #include "config.h"
 #include <lzma.h>
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,7 +36,20 @@
 #include <string.h>
 #include <assert.h>
 
-/* Libwandio IO module implementing an lzma writer */
+/* Libwandio IO module implementing an lzma writer
+ *
+ * If the handle is allowed threads and liblzma is new enough, the data is
+ * compressed using liblzma's own multithreaded encoder. That splits the
+ * input into independent xz blocks (three times the dictionary size each,
+ * liblzma's default) that are compressed in parallel, and records each
+ * block's size in the block headers and index, so the output is still a
+ * standard .xz file that can also be decoded a block at a time.
+ */
+
+/* lzma_stream_encoder_mt() only became a stable interface in 5.2.0 */
+#if LZMA_VERSION >= 50020002
+#define HAVE_LZMA_MT 1
+#endif
 
 enum err_t {
 	ERR_OK	= 1,
@@ -57,13 +71,37 @@ extern iow_source_t lzma_wsource;
 #define DATA(iow) ((struct lzmaw_t *)((iow)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-iow_t *lzma_wopen(iow_t *child, int compress_level)
+/* Sets up the encoder, using threads if we can */
+static lzma_ret lzma_encoder_init(lzma_stream *strm, int compress_level, 
+		const struct wandio_options *opts)
+{
+#ifdef HAVE_LZMA_MT
+	lzma_mt mt;
+
+	memset(&mt, 0, sizeof(mt));
+	mt.threads = wandio_pool_threads(opts);
+	if (mt.threads > 0) {
+		mt.preset = compress_level;
+		mt.check = LZMA_CHECK_CRC64;
+		mt.block_size = 0;	/* Let liblzma pick */
+		mt.timeout = 0;
+		return lzma_stream_encoder_mt(strm, &mt);
+	}
+#else
+	(void)opts;
+#endif
+	return lzma_easy_encoder(strm, compress_level, LZMA_CHECK_CRC64);
+}
+
+iow_t *lzma_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts)
 {
 	iow_t *iow;
 	if (!child)
 		return NULL;
-	iow = malloc(sizeof(iow_t));
+	iow = calloc(1, sizeof(iow_t));
 	iow->source = &lzma_wsource;
+	iow->child = child;
 	iow->data = malloc(sizeof(struct lzmaw_t));
 
 	DATA(iow)->child = child;
@@ -73,9 +111,9 @@ iow_t *lzma_wopen(iow_t *child, int compress_level)
 	DATA(iow)->strm.avail_out = sizeof(DATA(iow)->outbuff);
 	DATA(iow)->err = ERR_OK;
 
-        if (lzma_easy_encoder(&DATA(iow)->strm,
+        if (lzma_encoder_init(&DATA(iow)->strm,
                     compress_level,
-                    LZMA_CHECK_CRC64) != LZMA_OK) {
+                    opts) != LZMA_OK) {
             free(iow->data);
             free(iow);
             return NULL;
@@ -161,6 +199,8 @@ static void lzma_wclose(iow_t *iow)
 iow_source_t lzma_wsource = {
 	"xz",
 	lzma_wwrite,
-	lzma_wclose
+	lzma_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
 
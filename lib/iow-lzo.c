@@ -31,6 +31,9 @@
  * Data is written out in blocks, and the blocks are all compressed in seperate
  * independant threads (if possible), thus letting you use multicore cpu's to
  * get compression for the absolute least amount of walltime while capturing.
+ * The blocks are queued on a wandio_pool with more blocks in flight than
+ * there are threads, so whichever thread is free picks up the next block and
+ * one slow block only holds up the writer once every slot is full.
  */
 
 #include "config.h"
@@ -47,12 +50,7 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <arpa/inet.h>
-#include <pthread.h>
-#include <unistd.h> /* for sysconf */
 #include <stdbool.h>
-#ifdef HAVE_SYS_PRCTL_H
-#include <sys/prctl.h>
-#endif
 
 
 enum { 
@@ -110,24 +108,16 @@ struct buffer_t {
 	char buffer[MAX_BUFFER_SIZE];
 };
 
-struct lzothread_t {
-	pthread_t thread;
-	pthread_cond_t in_ready;
-	pthread_cond_t out_ready;
-	pthread_mutex_t mutex;
-	bool closing;
-	enum { EMPTY, WAITING, FULL } state;
-	int num;
-	struct buffer_t inbuf;
+struct lzojob_t {
+	struct wandio_writer_job base;
+	char inbuff[MAX_BLOCK_SIZE];
 	struct buffer_t outbuf;
 };
 
 struct lzow_t {
 	iow_t *child;
 	enum err_t err;
-	int threads;
-	int next_thread;
-	struct lzothread_t *thread;
+	struct wandio_writer writer;
 };
 
 extern iow_source_t lzo_wsource; 
@@ -225,68 +215,43 @@ static int lzo_wwrite_block(const char *buffer, int64_t len, struct buffer_t *ou
 	return len;
 }
 
-/* There is one of these threads per core in a machine.  This compresses 
- * a block of data and returns it, the main thread tehn is responsible to
- * write these back out in the right order.
- */
-static void *lzo_compress_thread(void *data)
+/* Runs on a pool thread, or inline if there aren't any */
+static void lzo_compress_job(void *data, iow_t *iow)
 {
-	struct lzothread_t *me = (struct lzothread_t *)data;
-	int err;
-
-#ifdef PR_SET_NAME
-	char namebuf[17];
-	if (prctl(PR_GET_NAME, namebuf, 0,0,0) == 0) {
-		char label[16];
-		namebuf[16] = '\0'; /* Make sure it's NUL terminated */
-		sprintf(label,"[lzo%d]",me->num);
-		/* If the filename is too long, overwrite the last few bytes */
-		if (strlen(namebuf)>=16-strlen(label)) {
-			strcpy(namebuf+15-strlen(label),label);
-		}
-		else {
-			strncat(namebuf," ",16);
-			strncat(namebuf,label,16);
-		}
-		prctl(PR_SET_NAME, namebuf, 0,0,0);
-	}
-#endif
+	struct lzojob_t *job = (struct lzojob_t *)data;
 
-	pthread_mutex_lock(&me->mutex);
-	while (!me->closing) {
-		while (me->state != WAITING) {
-			if (me->closing)
-				break;
-			pthread_cond_wait(&me->in_ready, &me->mutex);
-		}
-		if (me->closing)
-			break;
+	(void)iow;
+	job->base.failed = lzo_wwrite_block(job->inbuff, job->base.in_len,
+			&job->outbuf) < 0;
+}
 
-		err=lzo_wwrite_block(
-			me->inbuf.buffer, 
-			me->inbuf.offset,
-			&me->outbuf);
-
-                if (err < 0)
-                        break; 
-		/* Make sure someone else hasn't clobbered us!*/
-		assert(me->state == WAITING);
-		me->state = FULL;
-		pthread_cond_signal(&me->out_ready);
-	}
-	pthread_mutex_unlock(&me->mutex);
+static bool lzo_emit_job(void *data, iow_t *iow)
+{
+	struct lzojob_t *job = (struct lzojob_t *)data;
 
-	return NULL;
+	assert(job->outbuf.offset < sizeof(job->outbuf.buffer));
+	return wandio_wwrite(DATA(iow)->child, job->outbuf.buffer, 
+			job->outbuf.offset) == (int64_t)job->outbuf.offset;
 }
 
-iow_t *lzo_wopen(iow_t *child, int compress_level)
+static const struct wandio_writer_ops lzo_writer_ops = {
+	"lzo",
+	sizeof(struct lzojob_t),
+	lzo_compress_job,
+	NULL,	/* prepare */
+	lzo_emit_job
+};
+
+iow_t *lzo_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts)
 {
 	const int opt_filter = 0;
 	int flags;
 	iow_t *iow;
 	struct buffer_t buffer;
 	buffer.offset=0;
-	int i;
+	unsigned int threads;
+	unsigned int i;
 
 	if (!child)
 		return NULL;
@@ -303,8 +268,9 @@ iow_t *lzo_wopen(iow_t *child, int compress_level)
         if (compress_level < 0)
                 return NULL;
 
-	iow = malloc(sizeof(iow_t));
+	iow = calloc(1, sizeof(iow_t));
 	iow->source = &lzo_wsource;
+	iow->child = child;
 	iow->data = malloc(sizeof(struct lzow_t));
 
 	DATA(iow)->child = child;
@@ -355,183 +321,37 @@ iow_t *lzo_wopen(iow_t *child, int compress_level)
 		buffer.buffer,
 		buffer.offset);
 
-	/* Set up the thread pool -- one thread per core */
-	DATA(iow)->threads = min((uint32_t)sysconf(_SC_NPROCESSORS_ONLN),
-			use_threads);
-	DATA(iow)->thread = malloc(
-			sizeof(struct lzothread_t) * DATA(iow)->threads);
-	DATA(iow)->next_thread = 0;
-	for(i=0; i<DATA(iow)->threads; ++i) {
-		pthread_cond_init(&DATA(iow)->thread[i].in_ready, NULL);
-		pthread_cond_init(&DATA(iow)->thread[i].out_ready, NULL);
-		pthread_mutex_init(&DATA(iow)->thread[i].mutex, NULL);
-		DATA(iow)->thread[i].closing = false;
-		DATA(iow)->thread[i].num = i;
-		DATA(iow)->thread[i].state = EMPTY;
-		DATA(iow)->thread[i].inbuf.offset = 0;
-
-		pthread_create(&DATA(iow)->thread[i].thread, 
-				NULL,
-				lzo_compress_thread,
-				(void*)&DATA(iow)->thread[i]);
+	threads = wandio_pool_threads(opts);
+	if (!wandio_writer_init(&DATA(iow)->writer, &lzo_writer_ops, iow, 
+			threads, 0, MAX_BLOCK_SIZE)) {
+		DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
+	for (i = 0; i < DATA(iow)->writer.slots; ++i) {
+		struct lzojob_t *job = wandio_writer_slot(&DATA(iow)->writer, i);
+		job->base.in = (uint8_t *)job->inbuff;
 	}
 
 	return iow;
 }
 
-static struct lzothread_t *get_next_thread(iow_t *iow)
-{
-	return &DATA(iow)->thread[DATA(iow)->next_thread];
-}
-
 static int64_t lzo_wwrite(iow_t *iow, const char *buffer, int64_t len)
 {
-	int64_t ret = 0;
-	while (len>0) {
-		int64_t size = len;
-		int64_t err;
-		struct buffer_t outbuf;
-
-		if (!DATA(iow)->threads) {
-			size = min(len, MAX_BLOCK_SIZE);
-			err=lzo_wwrite_block(buffer, size, &outbuf);
-			/* Flush the data out */
-			wandio_wwrite(DATA(iow)->child,
-					outbuf.buffer,
-					outbuf.offset);
-
-			if (err < 0) {/* Error */
-				if (ret == 0)
-					return err;
-				/* If we've written some data, return that fact now, let them call back
-				 * and try and write more data, fail again then. 
-				 */
-				return ret;
-			}
-			else {
-				assert(err == size);
-				buffer += size;
-				len -= size;
-			}
-		}
-		else {
-			int64_t space;
-
-			pthread_mutex_lock(&get_next_thread(iow)->mutex);
-			/* If this thread is still compressing, wait for it to finish */
-			while (get_next_thread(iow)->state == WAITING) {
-				pthread_cond_wait(
-					&get_next_thread(iow)->out_ready, 
-					&get_next_thread(iow)->mutex);
-			}
-
-			/* Flush any data out thats there */
-			if (get_next_thread(iow)->state == FULL) {
-				assert(get_next_thread(iow)->outbuf.offset 
-						< sizeof(get_next_thread(iow)->outbuf.buffer));
-				
-				wandio_wwrite(DATA(iow)->child,
-						get_next_thread(iow)->outbuf.buffer,
-						get_next_thread(iow)->outbuf.offset);
-				get_next_thread(iow)->state = EMPTY;
-				get_next_thread(iow)->inbuf.offset = 0;
-			}
-
-			assert(get_next_thread(iow)->state == EMPTY);
-
-			/* Figure out how much space we can copy into this buffer */
-			assert(MAX_BLOCK_SIZE <= sizeof(get_next_thread(iow)->inbuf.buffer));
-			space = MAX_BLOCK_SIZE-get_next_thread(iow)->inbuf.offset;
-			size = min(space, size);
-			assert(size>0);
-			assert(size <= MAX_BLOCK_SIZE);
-			assert(get_next_thread(iow)->inbuf.offset + size <= MAX_BLOCK_SIZE);
-
-			/* Move our data in */
-			memcpy(&get_next_thread(iow)->inbuf.buffer[get_next_thread(iow)->inbuf.offset], 
-				buffer, 
-				size);
-			get_next_thread(iow)->inbuf.offset += size;
-
-			/* If the buffer is now full Trigger the thread to start compressing this block,
-			 * and move onto the next block.
-			 */
-			if (get_next_thread(iow)->inbuf.offset >= sizeof(get_next_thread(iow)->inbuf.buffer)
-			  ||get_next_thread(iow)->inbuf.offset >= MAX_BLOCK_SIZE) {
-				assert(get_next_thread(iow)->state == EMPTY);
-				get_next_thread(iow)->state = WAITING;
-				pthread_cond_signal(&get_next_thread(iow)->in_ready);
-
-				pthread_mutex_unlock(&get_next_thread(iow)->mutex);
-
-				DATA(iow)->next_thread = 
-						(DATA(iow)->next_thread+1) % DATA(iow)->threads;
-			}
-			else 
-				pthread_mutex_unlock(&get_next_thread(iow)->mutex);
-
-			/* Update the lengths */
-			buffer += size;
-			len -= size;
-		}
-	}
-	return len;
-}
-
-static void shutdown_thread(iow_t *iow, struct lzothread_t *thread)
-{
-	pthread_mutex_lock(&thread->mutex);
-
-	/* If this buffer is empty it shouldn't have any data in it, we should have taken
-         * care of that before.
-	 */
-	/* thread->state == EMPTY implies thread->inbuf.offset == 0 */
-	assert(!(thread->state == EMPTY) || thread->inbuf.offset == 0);
-
-	while (thread->state == WAITING) {
-		pthread_cond_wait(
-			&thread->out_ready,
-			&thread->mutex);
-	}
-	if (thread->state == FULL) {
-		wandio_wwrite(DATA(iow)->child,
-				thread->outbuf.buffer,
-				thread->outbuf.offset);
-		thread->state = EMPTY;
-		thread->inbuf.offset = 0;
-	}
-	/* Now the thread should be empty, so ask it to shut down */
-	assert(thread->state == EMPTY && thread->inbuf.offset == 0);
-	thread->closing = true;
-	pthread_cond_signal(&thread->in_ready);
-	pthread_mutex_unlock(&thread->mutex);
-	/* And wait for it to die */
-	pthread_join(thread->thread,NULL);
+	if (DATA(iow)->err == ERR_ERROR)
+		return -1;
+	return wandio_writer_write(&DATA(iow)->writer, buffer, len);
 }
 
 static void lzo_wclose(iow_t *iow)
 {
 	const uint32_t zero = 0;
-	int i;
-
-	/* Flush the last buffer */
-	pthread_mutex_lock(&get_next_thread(iow)->mutex);
-	if (get_next_thread(iow)->state == EMPTY && get_next_thread(iow)->inbuf.offset != 0) {
-		get_next_thread(iow)->state = WAITING;
-		pthread_cond_signal(&get_next_thread(iow)->in_ready);
-	}
-	pthread_mutex_unlock(&get_next_thread(iow)->mutex);
 
-	DATA(iow)->next_thread = 
-			(DATA(iow)->next_thread+1) % DATA(iow)->threads;
-
-	/* Right, now we have to shutdown all our threads -- in order */
-	for(i=DATA(iow)->next_thread; i<DATA(iow)->threads; ++i) {
-		shutdown_thread(iow,&DATA(iow)->thread[i]);
-	}
-	for(i=0; i<DATA(iow)->next_thread; ++i) {
-		shutdown_thread(iow,&DATA(iow)->thread[i]);
-	}
+	/* Flush the last block */
+	if (DATA(iow)->err == ERR_OK &&
+			!wandio_writer_finish(&DATA(iow)->writer, 
+				WANDIO_TAIL_IF_DATA))
+		DATA(iow)->err = ERR_ERROR;
+	wandio_writer_destroy(&DATA(iow)->writer);
 
 	/* Write out an end of file marker */
 	wandio_wwrite(DATA(iow)->child,
@@ -540,7 +360,6 @@ static void lzo_wclose(iow_t *iow)
 
 	/* And clean everything up */
 	wandio_wdestroy(DATA(iow)->child);
-	free(DATA(iow)->thread);
 	free(iow->data);
 	free(iow);
 }
@@ -548,6 +367,8 @@ static void lzo_wclose(iow_t *iow)
 iow_source_t lzo_wsource = {
 	"lzo",
 	lzo_wwrite,
-	lzo_wclose
+	lzo_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
 
@@ -53,7 +53,7 @@ extern iow_source_t stdio_wsource;
 
 #define DATA(iow) ((struct stdiow_t *)((iow)->data))
 
-static int safe_open(const char *filename, int flags)
+static int safe_open(const char *filename, int flags, bool direct_io)
 {
 	int fd = -1;
 	uid_t userid = 0;
@@ -67,7 +67,7 @@ static int safe_open(const char *filename, int flags)
 		|O_WRONLY
 		|O_CREAT
 		|O_TRUNC
-		|(force_directio_write?O_DIRECT:0),
+		|(direct_io?O_DIRECT:0),
 		0666);
 #endif
 /* If that failed (or we don't support O_DIRECT) try opening without */
@@ -105,16 +105,17 @@ static int safe_open(const char *filename, int flags)
 	return fd;
 }
 
-iow_t *stdio_wopen(const char *filename,int flags)
+iow_t *stdio_wopen(const char *filename,int flags,
+		const struct wandio_options *opts)
 {
-	iow_t *iow = malloc(sizeof(iow_t));
+	iow_t *iow = calloc(1, sizeof(iow_t));
 	iow->source = &stdio_wsource;
 	iow->data = malloc(sizeof(struct stdiow_t));
 
 	if (strcmp(filename,"-") == 0) 
 		DATA(iow)->fd = 1; /* STDOUT */
 	else {
-		DATA(iow)->fd = safe_open(filename, flags);
+		DATA(iow)->fd = safe_open(filename, flags, opts->direct_io);
 	}
 
 	if (DATA(iow)->fd == -1) {
@@ -227,5 +228,7 @@ static void stdio_wclose(iow_t *iow)
 iow_source_t stdio_wsource = {
 	"stdiow",
 	stdio_wwrite,
-	stdio_wclose
+	stdio_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
@@ -34,6 +34,9 @@
 #include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
 #ifdef HAVE_SYS_PRCTL_H
 #include <sys/prctl.h>
 #endif
@@ -42,11 +45,15 @@
  *
  * This module enables another IO writer, called the "child", to perform its
  * writing using a separate thread. The main thread writes data into a series
- * of 1MB buffers. Meanwhile, the writing thread writes out of these buffers
- * using the callback for the child reader. pthread conditions are used to
- * communicate between the two threads, e.g. when there are buffers available
- * for the main thread to copy data into or when there is data available for
- * the write thread to write.
+ * of buffers (1MB by default). Meanwhile, the writing thread writes out of
+ * these buffers using the callback for the child reader.
+ *
+ * The buffers form a single-producer/single-consumer ring. The main thread
+ * owns the slice it is currently filling outright, so appending to it needs
+ * no synchronisation at all; only when a slice fills up is it published to
+ * the writing thread by advancing "head". The writing thread advances "tail"
+ * as it empties slices. Either side only sleeps (on a wandio_event) when the
+ * ring is really full or really empty.
  */
 
 /* 1MB Buffer */
@@ -57,40 +64,110 @@ extern iow_source_t thread_wsource;
 
 /* This structure defines a single buffer or "slice" */
 struct buffer_t {
-	char buffer[BUFFERSIZE];	/* The buffer itself */
-	int len;			/* The size of the buffer */
-	enum { EMPTY = 0, FULL = 1 } state;	/* Is the buffer in use? */
+	char *buffer;			/* The buffer itself */
+	int len;			/* The size of the buffer, 0 == EOF */
 };
 
 struct state_t {
 	/* The collection of buffers (or slices) */
-	struct buffer_t buffer[BUFFERS];
-	/* The write offset into the current buffer */
-	int64_t offset;
+	struct buffer_t *buffer;
+	/* The number of slices in the ring */
+	unsigned int nbuffers;
+	/* The size of each slice */
+	int64_t slice_size;
+	/* Print the number of times we had to wait when closing */
+	bool stats;
 	/* The writing thread */
 	pthread_t consumer;
 	/* The child writer */
 	iow_t *iow;
-	/* Indicates that there is data in one of the buffers */
-	pthread_cond_t data_ready;
-	/* Indicates that there is a free buffer to write into */
-	pthread_cond_t space_avail;
-	/* The mutex for the write buffers */
-	pthread_mutex_t mutex;
+
+	/* Number of slices published by the main thread */
+	uint32_t head __attribute__((aligned(CACHE_LINE_SIZE)));
 	/* The index of the buffer to write into next */
 	int out_buffer;
-	/* Indicates whether the main thread is concluding */
-	bool closing;
+	/* The write offset into the current buffer */
+	int64_t offset;
+	/* Signalled when the main thread publishes a slice */
+	struct wandio_event data_ready;
+
+	/* Number of slices written out by the writing thread */
+	uint32_t tail __attribute__((aligned(CACHE_LINE_SIZE)));
+	/* Signalled when the writing thread frees up a slice */
+	struct wandio_event space_avail;
 };
 
 #define DATA(x) ((struct state_t *)((x)->data))
 #define OUTBUFFER(x) (DATA(x)->buffer[DATA(x)->out_buffer])
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
+/* Wait until the slice the main thread is about to fill has been emptied */
+static void wait_for_space(iow_t *state)
+{
+	uint32_t head = DATA(state)->head;
+	uint32_t token;
+	uint64_t start;
+
+	if (head - __atomic_load_n(&DATA(state)->tail, __ATOMIC_ACQUIRE) 
+			< DATA(state)->nbuffers)
+		return;
+
+	start = wandio_clock_ns();
+	do {
+		token = wandio_event_prepare(&DATA(state)->space_avail);
+		if (head - __atomic_load_n(&DATA(state)->tail, 
+					__ATOMIC_SEQ_CST) < DATA(state)->nbuffers) {
+			wandio_event_cancel(&DATA(state)->space_avail);
+			break;
+		}
+		wandio_event_wait(&DATA(state)->space_avail, token);
+	} while (head - __atomic_load_n(&DATA(state)->tail, __ATOMIC_ACQUIRE) 
+			>= DATA(state)->nbuffers);
+	wandio_stat_stall(&state->stats.producer_stalls,
+			&state->stats.producer_stall_ns, start);
+}
+
+/* Wait until the main thread has published something for us to write */
+static void wait_for_data(iow_t *state, uint32_t tail)
+{
+	uint32_t token;
+	uint64_t start = 0;
+
+	while (__atomic_load_n(&DATA(state)->head, __ATOMIC_ACQUIRE) == tail) {
+		if (!start)
+			start = wandio_clock_ns();
+		token = wandio_event_prepare(&DATA(state)->data_ready);
+		if (__atomic_load_n(&DATA(state)->head, __ATOMIC_SEQ_CST) 
+				!= tail) {
+			wandio_event_cancel(&DATA(state)->data_ready);
+			break;
+		}
+		wandio_event_wait(&DATA(state)->data_ready, token);
+	}
+	if (start)
+		wandio_stat_stall(&state->stats.consumer_stalls,
+				&state->stats.consumer_stall_ns, start);
+}
+
+/* Hand the current slice over to the writing thread and move on to the next
+ * one. A slice of length 0 tells the writing thread to finish up */
+static void publish_slice(iow_t *state)
+{
+	OUTBUFFER(state).len = DATA(state)->offset;
+	__atomic_store_n(&DATA(state)->head, DATA(state)->head+1, 
+			__ATOMIC_SEQ_CST);
+	wandio_event_signal(&DATA(state)->data_ready);
+
+	DATA(state)->offset = 0;
+	DATA(state)->out_buffer = (DATA(state)->out_buffer+1) 
+			% DATA(state)->nbuffers;
+}
+
 /* The writing thread */
 static void *thread_consumer(void *userdata)
 {
 	int buffer=0;
+	uint32_t tail=0;
 	bool running = true;
 	iow_t *state = (iow_t *) userdata;
 
@@ -109,68 +186,69 @@ static void *thread_consumer(void *userdata)
 	}
 #endif
 
-	pthread_mutex_lock(&DATA(state)->mutex);
 	do {
 		/* Wait for data that we can write */
-		while (DATA(state)->buffer[buffer].state == EMPTY) {
-			/* Unless, of course, the program is over! */
-			if (DATA(state)->closing)
-				break;
-			pthread_cond_wait(&DATA(state)->data_ready,
-					&DATA(state)->mutex);
-		}
+		wait_for_data(state, tail);
+
+		/* If we've not reached the end of the file keep going */
+		running = ( DATA(state)->buffer[buffer].len > 0 );
 		
 		/* Empty the buffer using the child writer */
-		pthread_mutex_unlock(&DATA(state)->mutex);
-		wandio_wwrite(
+		if (running) {
+			wandio_wwrite(
 				DATA(state)->iow,
 				DATA(state)->buffer[buffer].buffer,
 				DATA(state)->buffer[buffer].len);
-		pthread_mutex_lock(&DATA(state)->mutex);
-
-		/* If we've not reached the end of the file keep going */
-		running = ( DATA(state)->buffer[buffer].len > 0 );
-		DATA(state)->buffer[buffer].len = 0;
-		DATA(state)->buffer[buffer].state = EMPTY;
-
-		/* Signal that we've freed up another buffer for the main
-		 * thread to copy data into */
-		pthread_cond_signal(&DATA(state)->space_avail);
+		}
 
+		/* Let the main thread know that we've freed up another
+		 * buffer for it to copy data into */
+		__atomic_store_n(&DATA(state)->tail, ++tail, __ATOMIC_SEQ_CST);
+		wandio_event_signal(&DATA(state)->space_avail);
 
 		/* Move on to the next buffer */
-		buffer=(buffer+1) % BUFFERS;
+		buffer=(buffer+1) % DATA(state)->nbuffers;
 
 	} while(running);
 
 	/* If we reach here, it's all over so start tidying up */
 	wandio_wdestroy(DATA(state)->iow);
 
-	pthread_mutex_unlock(&DATA(state)->mutex);
 	return NULL;
 }
 
-iow_t *thread_wopen(iow_t *child)
+iow_t *thread_wopen(iow_t *child, const struct wandio_options *opts)
 {
 	iow_t *state;
+	unsigned int i;
 
 	if (!child) {
 		return NULL;
 	}
 	
 
-	state = malloc(sizeof(iow_t));
+	state = calloc(1, sizeof(iow_t));
 	state->data = calloc(1,sizeof(struct state_t));
 	state->source = &thread_wsource;
+	state->child = child;
+
+	DATA(state)->nbuffers = opts->ring_depth ? opts->ring_depth : BUFFERS;
+	DATA(state)->slice_size = opts->slice_size > 0 ? 
+			opts->slice_size : BUFFERSIZE;
+	DATA(state)->stats = opts->stats;
+	DATA(state)->buffer = calloc(DATA(state)->nbuffers, 
+			sizeof(struct buffer_t));
+	for (i = 0; i < DATA(state)->nbuffers; i++)
+		DATA(state)->buffer[i].buffer = malloc(DATA(state)->slice_size);
 
 	DATA(state)->out_buffer = 0;
 	DATA(state)->offset = 0;
-	pthread_mutex_init(&DATA(state)->mutex,NULL);
-	pthread_cond_init(&DATA(state)->data_ready,NULL);
-	pthread_cond_init(&DATA(state)->space_avail,NULL);
+	DATA(state)->head = 0;
+	DATA(state)->tail = 0;
+	wandio_event_init(&DATA(state)->data_ready);
+	wandio_event_init(&DATA(state)->space_avail);
 
 	DATA(state)->iow = child;
-	DATA(state)->closing = false;
 
 	/* Start the writer thread */
 	pthread_create(&DATA(state)->consumer,NULL,thread_consumer,state);
@@ -182,68 +260,96 @@ static int64_t thread_wwrite(iow_t *state, const char *buffer, int64_t len)
 {
 	int slice;
 	int copied=0;
-	int newbuffer;
 
-	pthread_mutex_lock(&DATA(state)->mutex);
 	while(len>0) {
 
-		/* Wait for there to be space available for us to write into */
-		while (OUTBUFFER(state).state == FULL) {
-			write_waits++;
-			pthread_cond_wait(&DATA(state)->space_avail,
-					&DATA(state)->mutex);
-		}
+		/* Starting on a new slice? Make sure the writing thread has
+		 * finished with it first. Appending to a slice we already
+		 * own doesn't need to talk to the other thread at all. */
+		if (DATA(state)->offset == 0)
+			wait_for_space(state);
 
 		/* Copy out of our main buffer into the next available slice */
 		slice=min( 
-			(int64_t)sizeof(OUTBUFFER(state).buffer)-DATA(state)->offset,
+			DATA(state)->slice_size-DATA(state)->offset,
 			len);
 				
-		pthread_mutex_unlock(&DATA(state)->mutex);
 		memcpy(
 			OUTBUFFER(state).buffer+DATA(state)->offset,
 			buffer,
 			slice
 			);
-		pthread_mutex_lock(&DATA(state)->mutex);
 
 		DATA(state)->offset += slice;
-		OUTBUFFER(state).len += slice;
 
 		buffer += slice;
 		len -= slice;
 		copied += slice;
-		newbuffer = DATA(state)->out_buffer;
 
 		/* If we've filled a buffer, move on to the next one and 
-		 * signal to the write thread that there is something for it
+		 * let the write thread know that there is something for it
 		 * to do */
-		if (DATA(state)->offset >= (int64_t)sizeof(OUTBUFFER(state).buffer)) {
-			OUTBUFFER(state).state = FULL;
-			pthread_cond_signal(&DATA(state)->data_ready);
-			DATA(state)->offset = 0;
-			newbuffer = (newbuffer+1) % BUFFERS;
-		}
-
-		DATA(state)->out_buffer = newbuffer;
+		if (DATA(state)->offset >= DATA(state)->slice_size)
+			publish_slice(state);
 	}
 
-	pthread_mutex_unlock(&DATA(state)->mutex);
 	return copied;
 }
 
+/* Let the caller build their data directly in the current slice. If it
+ * won't fit in what is left of the slice, publish it early and start on
+ * the next one */
+static void *thread_wacquire(iow_t *state, int64_t min_len)
+{
+	if (min_len > DATA(state)->slice_size) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (DATA(state)->offset > 0 && 
+			DATA(state)->slice_size - DATA(state)->offset < min_len)
+		publish_slice(state);
+
+	if (DATA(state)->offset == 0)
+		wait_for_space(state);
+
+	return OUTBUFFER(state).buffer+DATA(state)->offset;
+}
+
+static int64_t thread_wcommit(iow_t *state, int64_t used)
+{
+	assert(DATA(state)->offset + used <= DATA(state)->slice_size);
+
+	DATA(state)->offset += used;
+	if (DATA(state)->offset >= DATA(state)->slice_size)
+		publish_slice(state);
+
+	return used;
+}
+
 static void thread_wclose(iow_t *iow)
 {
-	pthread_mutex_lock(&DATA(iow)->mutex);
-	DATA(iow)->closing = true;
-	pthread_cond_signal(&DATA(iow)->data_ready);
-	pthread_mutex_unlock(&DATA(iow)->mutex);
+	unsigned int i;
+
+	/* Flush whatever is left in the current slice */
+	if (DATA(iow)->offset > 0)
+		publish_slice(iow);
+
+	/* And then an empty slice to tell the writing thread we're done */
+	wait_for_space(iow);
+	publish_slice(iow);
 	pthread_join(DATA(iow)->consumer,NULL);
+
+	if (DATA(iow)->stats)
+		fprintf(stderr,"LIBTRACEIO STATS: %"PRIu64" blocks on write\n", 
+				iow->stats.producer_stalls);
 	
-	pthread_mutex_destroy(&DATA(iow)->mutex);
-	pthread_cond_destroy(&DATA(iow)->data_ready);
-	pthread_cond_destroy(&DATA(iow)->space_avail);
+	wandio_event_destroy(&DATA(iow)->data_ready);
+	wandio_event_destroy(&DATA(iow)->space_avail);
 	
+	for (i = 0; i < DATA(iow)->nbuffers; i++)
+		free(DATA(iow)->buffer[i].buffer);
+	free(DATA(iow)->buffer);
 	free(iow->data);
 	free(iow);
 }
@@ -251,5 +357,7 @@ static void thread_wclose(iow_t *iow)
 iow_source_t thread_wsource = {
 	"threadw",
 	thread_wwrite,
-	thread_wclose
+	thread_wclose,
+	thread_wacquire,
+	thread_wcommit
 };
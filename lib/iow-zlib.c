@@ -27,6 +27,7 @@
 
 #include "config.h"
 #include <zlib.h>
+#include "wandio_internal.h"
 #include "wandio.h"
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -35,7 +36,16 @@
 #include <string.h>
 #include <assert.h>
 
-/* Libwandio IO module implementing a zlib writer */
+/* Libwandio IO module implementing a zlib writer
+ *
+ * Without any threads this runs a single deflate stream in the calling
+ * thread. Otherwise the data is cut into blocks that are deflated in
+ * parallel, pigz-style: each block is compressed as raw deflate data primed
+ * with the last 32KB of the block before it and ends with a sync flush, so
+ * the blocks simply join together into one deflate stream. The main thread
+ * writes the gzip header, the blocks in order and a trailer with the CRCs of
+ * the blocks combined, so the output is an ordinary gzip file.
+ */
 
 enum err_t {
 	ERR_OK	= 1,
@@ -43,12 +53,41 @@ enum err_t {
 	ERR_ERROR = -1
 };
 
+/* Amount of data deflated by each job */
+#define BLOCK_SIZE (128*1024)
+/* Largest deflate window, i.e. how far back a block can refer */
+#define DICT_SIZE (32*1024)
+
+struct zlibjob_t {
+	struct wandio_writer_job base;
+	/* Each job keeps its own stream, reset for every block */
+	z_stream strm;
+	/* The last DICT_SIZE bytes of the previous block */
+	Bytef dict[DICT_SIZE];
+	unsigned int dict_len;
+	Bytef inbuff[BLOCK_SIZE];
+	/* Compressed data, grown if a block doesn't fit */
+	Bytef *outbuff;
+	unsigned int out_size;
+	unsigned int out_len;
+	uLong crc;
+	/* The last block finishes the deflate stream */
+	bool last;
+};
+
 struct zlibw_t {
 	z_stream strm;
 	Bytef outbuff[1024*1024];
 	iow_t *child;
 	enum err_t err;
 	int inoffset;
+
+	/* Everything below is only used with threads */
+	bool parallel;
+	struct wandio_writer writer;
+	/* CRC and length of all the data, for the gzip trailer */
+	uLong crc;
+	uint64_t total;
 };
 
 
@@ -57,16 +96,144 @@ extern iow_source_t zlib_wsource;
 #define DATA(iow) ((struct zlibw_t *)((iow)->data))
 #define min(a,b) ((a)<(b) ? (a) : (b))
 
-iow_t *zlib_wopen(iow_t *child, int compress_level)
+/* Runs on a pool thread */
+static void zlib_deflate_block(void *data, iow_t *iow)
+{
+	struct zlibjob_t *job = (struct zlibjob_t *)data;
+	int flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+	int err;
+
+	(void)iow;
+	job->crc = crc32(crc32(0L, Z_NULL, 0), job->inbuff, job->base.in_len);
+	job->out_len = 0;
+
+	deflateReset(&job->strm);
+	if (job->dict_len)
+		deflateSetDictionary(&job->strm, job->dict, job->dict_len);
+
+	job->strm.next_in = job->inbuff;
+	job->strm.avail_in = job->base.in_len;
+	for (;;) {
+		if (job->out_len == job->out_size) {
+			job->out_size *= 2;
+			job->outbuff = realloc(job->outbuff, job->out_size);
+		}
+		job->strm.next_out = job->outbuff + job->out_len;
+		job->strm.avail_out = job->out_size - job->out_len;
+		err = deflate(&job->strm, flush);
+		job->out_len = job->out_size - job->strm.avail_out;
+		if (err == Z_STREAM_END)
+			break;
+		if (err != Z_OK && err != Z_BUF_ERROR) {
+			job->base.failed = true;
+			break;
+		}
+		/* Any space left over means the flush is complete */
+		if (!job->last && job->strm.avail_out != 0)
+			break;
+	}
+}
+
+static void write_le32(Bytef *buf, uint32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/* The previous block hasn't been reused yet, its slot only comes up again
+ * after this one */
+static void zlib_prime_block(void *data, const void *prev_data, iow_t *iow)
+{
+	struct zlibjob_t *job = (struct zlibjob_t *)data;
+	const struct zlibjob_t *prev = (const struct zlibjob_t *)prev_data;
+
+	(void)iow;
+	job->dict_len = 0;
+	if (prev) {
+		job->dict_len = min(prev->base.in_len, DICT_SIZE);
+		memcpy(job->dict, prev->inbuff + prev->base.in_len - 
+				job->dict_len, job->dict_len);
+	}
+}
+
+/* Writes out a finished block, adding it to the CRC for the trailer */
+static bool zlib_emit_block(void *data, iow_t *iow)
+{
+	struct zlibjob_t *job = (struct zlibjob_t *)data;
+
+	DATA(iow)->crc = crc32_combine(DATA(iow)->crc, job->crc, 
+			job->base.in_len);
+	DATA(iow)->total += job->base.in_len;
+	return wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) 
+			== (int64_t)job->out_len;
+}
+
+static const struct wandio_writer_ops zlib_writer_ops = {
+	"zlib",
+	sizeof(struct zlibjob_t),
+	zlib_deflate_block,
+	zlib_prime_block,
+	zlib_emit_block
+};
+
+static int zlib_parallel_init(iow_t *iow, int compress_level, 
+		unsigned int threads)
+{
+	/* The same header that deflate() itself would write */
+	Bytef header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 0x03 };
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	unsigned int i;
+
+	if (compress_level == 9)
+		header[8] = 2;
+	else if (compress_level == 1)
+		header[8] = 4;
+
+	DATA(iow)->parallel = true;
+	if (!wandio_writer_init(writer, &zlib_writer_ops, iow, threads, 0, 
+			BLOCK_SIZE))
+		return -1;
+	for (i = 0; i < writer->slots; ++i) {
+		struct zlibjob_t *job = wandio_writer_slot(writer, i);
+		job->base.in = job->inbuff;
+		if (deflateInit2(&job->strm, compress_level, Z_DEFLATED, 
+				-15,	/* Raw deflate, 15 bits of window */
+				9, Z_DEFAULT_STRATEGY) != Z_OK) 
+			return -1;
+		job->out_size = deflateBound(&job->strm, BLOCK_SIZE) + 16;
+		job->outbuff = malloc(job->out_size);
+	}
+	DATA(iow)->crc = crc32(0L, Z_NULL, 0);
+
+	if (wandio_wwrite(DATA(iow)->child, header, sizeof(header)) 
+			!= sizeof(header))
+		DATA(iow)->err = ERR_ERROR;
+	return 0;
+}
+
+iow_t *zlib_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts)
 {
 	iow_t *iow;
+	unsigned int threads;
 	if (!child)
 		return NULL;
-	iow = malloc(sizeof(iow_t));
+	iow = calloc(1, sizeof(iow_t));
 	iow->source = &zlib_wsource;
-	iow->data = malloc(sizeof(struct zlibw_t));
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct zlibw_t));
 
 	DATA(iow)->child = child;
+	DATA(iow)->err = ERR_OK;
+
+	threads = wandio_pool_threads(opts);
+	if (threads) {
+		if (zlib_parallel_init(iow, compress_level, threads) < 0)
+			DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
 
 	DATA(iow)->strm.next_in = NULL;
 	DATA(iow)->strm.avail_in = 0;
@@ -75,7 +242,6 @@ iow_t *zlib_wopen(iow_t *child, int compress_level)
 	DATA(iow)->strm.zalloc = Z_NULL;
 	DATA(iow)->strm.zfree = Z_NULL;
 	DATA(iow)->strm.opaque = NULL;
-	DATA(iow)->err = ERR_OK;
 
 	deflateInit2(&DATA(iow)->strm, 
 			compress_level,	/* Level */
@@ -88,7 +254,6 @@ iow_t *zlib_wopen(iow_t *child, int compress_level)
 	return iow;
 }
 
-
 static int64_t zlib_wwrite(iow_t *iow, const char *buffer, int64_t len)
 {
 	if (DATA(iow)->err == ERR_EOF) {
@@ -98,6 +263,9 @@ static int64_t zlib_wwrite(iow_t *iow, const char *buffer, int64_t len)
 		return -1; /* ERROR! */
 	}
 
+	if (DATA(iow)->parallel)
+		return wandio_writer_write(&DATA(iow)->writer, buffer, len);
+
 	DATA(iow)->strm.next_in = (Bytef*)buffer; /* This casts away const, but it's really const 
 						   * anyway 
 						   */
@@ -134,9 +302,48 @@ static int64_t zlib_wwrite(iow_t *iow, const char *buffer, int64_t len)
 	return len-DATA(iow)->strm.avail_in;
 }
 
+static void zlib_wclose_parallel(iow_t *iow)
+{
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	struct zlibjob_t *job;
+	Bytef trailer[8];
+	unsigned int i;
+
+	/* Whatever is left (even nothing) goes out as the final block */
+	if (DATA(iow)->err == ERR_OK) {
+		job = wandio_writer_job(writer);
+		job->last = true;
+		if (!wandio_writer_finish(writer, WANDIO_TAIL_ALWAYS))
+			DATA(iow)->err = ERR_ERROR;
+	}
+
+	if (DATA(iow)->err == ERR_OK) {
+		write_le32(trailer, DATA(iow)->crc);
+		write_le32(trailer + 4, DATA(iow)->total & 0xffffffff);
+		wandio_wwrite(DATA(iow)->child, trailer, sizeof(trailer));
+	}
+	else
+		fprintf(stderr, "Error while compressing zlib output\n");
+
+	for (i = 0; writer->jobs && i < writer->slots; ++i) {
+		job = wandio_writer_slot(writer, i);
+		deflateEnd(&job->strm);
+		free(job->outbuff);
+	}
+	wandio_writer_destroy(writer);
+	wandio_wdestroy(DATA(iow)->child);
+	free(iow->data);
+	free(iow);
+}
+
 static void zlib_wclose(iow_t *iow)
 {
 	int res;
+
+	if (DATA(iow)->parallel) {
+		zlib_wclose_parallel(iow);
+		return;
+	}
 	
 	while (1) {
 		res = deflate(&DATA(iow)->strm, Z_FINISH);
@@ -167,6 +374,8 @@ static void zlib_wclose(iow_t *iow)
 iow_source_t zlib_wsource = {
 	"zlibw",
 	zlib_wwrite,
-	zlib_wclose
+	zlib_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
 };
 
@@ -0,0 +1,244 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <zstd.h>
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Libwandio IO module implementing a zstd writer
+ *
+ * This writes files in the zstd seekable format: the data is cut into
+ * frames that are compressed independently (in parallel on a wandio_pool
+ * if threads are allowed), followed by a seek table giving the compressed
+ * and uncompressed size of every frame. The seek table lives in a skippable
+ * frame, so to anything that doesn't know about it this is just an ordinary
+ * .zst file, while zstd_open() can use it to seek.
+ */
+
+enum err_t {
+	ERR_OK	= 1,
+	ERR_EOF = 0,
+	ERR_ERROR = -1
+};
+
+/* Amount of data in each frame */
+#define FRAME_SIZE (1024*1024)
+
+#define SKIPPABLE_MAGIC 0x184D2A5E
+#define SEEKABLE_MAGIC 0x8F92EAB1
+
+struct zstdjob_t {
+	struct wandio_writer_job base;
+	ZSTD_CCtx *cctx;
+	uint8_t inbuff[FRAME_SIZE];
+	uint8_t *outbuff;
+	size_t out_size;
+	size_t out_len;
+};
+
+struct zstdw_t {
+	iow_t *child;
+	enum err_t err;
+
+	struct wandio_writer writer;
+
+	/* The seek table, as it will be written out */
+	uint8_t *table;
+	size_t table_len;
+	size_t table_size;
+	uint32_t frames;
+};
+
+
+extern iow_source_t zstd_wsource;
+
+#define DATA(iow) ((struct zstdw_t *)((iow)->data))
+#define min(a,b) ((a)<(b) ? (a) : (b))
+
+static void write_le32(uint8_t *buf, uint32_t value)
+{
+	buf[0] = value & 0xff;
+	buf[1] = (value >> 8) & 0xff;
+	buf[2] = (value >> 16) & 0xff;
+	buf[3] = (value >> 24) & 0xff;
+}
+
+/* Runs on a pool thread */
+static void zstd_compress_frame(void *data, iow_t *iow)
+{
+	struct zstdjob_t *job = (struct zstdjob_t *)data;
+	size_t ret;
+
+	(void)iow;
+	ret = ZSTD_compress2(job->cctx, job->outbuff, job->out_size,
+			job->inbuff, job->base.in_len);
+	job->base.failed = ZSTD_isError(ret);
+	job->out_len = job->base.failed ? 0 : ret;
+}
+
+/* Writes out a finished frame and adds it to the seek table */
+static bool zstd_emit_frame(void *data, iow_t *iow)
+{
+	struct zstdjob_t *job = (struct zstdjob_t *)data;
+
+	if (wandio_wwrite(DATA(iow)->child, job->outbuff, job->out_len) 
+			!= (int64_t)job->out_len)
+		return false;
+
+	if (DATA(iow)->table_size < DATA(iow)->table_len + 8) {
+		DATA(iow)->table_size = DATA(iow)->table_size ? 
+				DATA(iow)->table_size * 2 : 4096;
+		DATA(iow)->table = realloc(DATA(iow)->table, 
+				DATA(iow)->table_size);
+	}
+	write_le32(DATA(iow)->table + DATA(iow)->table_len, job->out_len);
+	write_le32(DATA(iow)->table + DATA(iow)->table_len + 4, 
+			job->base.in_len);
+	DATA(iow)->table_len += 8;
+	DATA(iow)->frames++;
+	return true;
+}
+
+static const struct wandio_writer_ops zstd_writer_ops = {
+	"zstd",
+	sizeof(struct zstdjob_t),
+	zstd_compress_frame,
+	NULL,	/* prepare */
+	zstd_emit_frame
+};
+
+iow_t *zstd_wopen(iow_t *child, int compress_level, 
+		const struct wandio_options *opts)
+{
+	iow_t *iow;
+	unsigned int threads;
+	unsigned int i;
+	if (!child)
+		return NULL;
+	iow = calloc(1, sizeof(iow_t));
+	iow->source = &zstd_wsource;
+	iow->child = child;
+	iow->data = calloc(1, sizeof(struct zstdw_t));
+
+	DATA(iow)->child = child;
+	DATA(iow)->err = ERR_OK;
+
+	threads = wandio_pool_threads(opts);
+	if (!wandio_writer_init(&DATA(iow)->writer, &zstd_writer_ops, iow,
+			threads, 0, FRAME_SIZE)) {
+		DATA(iow)->err = ERR_ERROR;
+		return iow;
+	}
+	for (i = 0; i < DATA(iow)->writer.slots; ++i) {
+		struct zstdjob_t *job = wandio_writer_slot(&DATA(iow)->writer, 
+				i);
+		job->base.in = job->inbuff;
+		job->cctx = ZSTD_createCCtx();
+		if (!job->cctx) {
+			DATA(iow)->err = ERR_ERROR;
+			continue;
+		}
+		ZSTD_CCtx_setParameter(job->cctx, ZSTD_c_compressionLevel, 
+				compress_level);
+		ZSTD_CCtx_setParameter(job->cctx, ZSTD_c_checksumFlag, 1);
+		job->out_size = ZSTD_compressBound(FRAME_SIZE);
+		job->outbuff = malloc(job->out_size);
+	}
+
+	return iow;
+}
+
+static int64_t zstd_wwrite(iow_t *iow, const char *buffer, int64_t len)
+{
+	if (DATA(iow)->err == ERR_EOF) {
+		return 0; /* EOF */
+	}
+	if (DATA(iow)->err == ERR_ERROR) {
+		return -1; /* ERROR! */
+	}
+	return wandio_writer_write(&DATA(iow)->writer, buffer, len);
+}
+
+/* Writes the seek table, in a skippable frame so other readers ignore it */
+static void zstd_write_seek_table(iow_t *iow)
+{
+	uint8_t header[8];
+	uint8_t footer[9];
+
+	write_le32(header, SKIPPABLE_MAGIC);
+	write_le32(header + 4, DATA(iow)->table_len + sizeof(footer));
+	write_le32(footer, DATA(iow)->frames);
+	footer[4] = 0;	/* Descriptor: no per-frame checksums */
+	write_le32(footer + 5, SEEKABLE_MAGIC);
+
+	if (wandio_wwrite(DATA(iow)->child, header, sizeof(header)) 
+			!= sizeof(header) ||
+			wandio_wwrite(DATA(iow)->child, DATA(iow)->table, 
+				DATA(iow)->table_len) 
+				!= (int64_t)DATA(iow)->table_len ||
+			wandio_wwrite(DATA(iow)->child, footer, sizeof(footer))
+				!= sizeof(footer))
+		DATA(iow)->err = ERR_ERROR;
+}
+
+static void zstd_wclose(iow_t *iow)
+{
+	struct wandio_writer *writer = &DATA(iow)->writer;
+	unsigned int i;
+
+	if (DATA(iow)->err == ERR_OK && 
+			!wandio_writer_finish(writer, WANDIO_TAIL_AT_LEAST_ONE))
+		DATA(iow)->err = ERR_ERROR;
+
+	if (DATA(iow)->err == ERR_OK)
+		zstd_write_seek_table(iow);
+	if (DATA(iow)->err != ERR_OK)
+		fprintf(stderr, "Error while compressing zstd output\n");
+
+	for (i = 0; writer->jobs && i < writer->slots; ++i) {
+		struct zstdjob_t *job = wandio_writer_slot(writer, i);
+		ZSTD_freeCCtx(job->cctx);
+		free(job->outbuff);
+	}
+	wandio_writer_destroy(writer);
+	free(DATA(iow)->table);
+	wandio_wdestroy(DATA(iow)->child);
+	free(iow->data);
+	free(iow);
+}
+
+iow_source_t zstd_wsource = {
+	"zstdw",
+	zstd_wwrite,
+	zstd_wclose,
+	NULL,	/* acquire */
+	NULL	/* commit */
+};
@@ -34,6 +34,7 @@
 #include <inttypes.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
 /* This file contains the implementation of the libwandio IO API, which format
  * modules should use to open, read from, write to, seek and close trace files.
@@ -45,27 +46,36 @@ struct wandio_compression_type compression_type[]  = {
 	{ "lzo",	"lzo",  WANDIO_COMPRESS_LZO	},
 	{ "lzma",	"xz",	WANDIO_COMPRESS_LZMA	},
 	{ "hwgzip",	"gz", 	WANDIO_COMPRESS_HWZLIB 	},
+	{ "bgzf",	"gz",	WANDIO_COMPRESS_BGZF	},
+	{ "zstd",	"zst",	WANDIO_COMPRESS_ZSTD	},
+	{ "lz4",	"lz4",	WANDIO_COMPRESS_LZ4	},
 	{ "NONE",	"",	WANDIO_COMPRESS_NONE	}
 };
 
-int keep_stats = 0;
-int force_directio_write = 0;
-int force_directio_read = 0;
-int use_autodetect = 1;
-unsigned int use_threads = -1;
-unsigned int max_buffers = 50;
+/* Defaults for the per-handle options, which can be overridden using the
+ * LIBTRACEIO environment variable */
+static int keep_stats = 0;
+static int force_directio = 0;
+static int use_autodetect = 1;
+static unsigned int use_threads = -1;
+static unsigned int max_buffers = 0;
+static unsigned int blosc_typesize = 0;
+static int blosc_shuffle = WANDIO_BLOSC_NOSHUFFLE;
+static size_t blosc_blocksize = 0;
 
-uint64_t read_waits = 0;
-uint64_t write_waits = 0;
+static pthread_once_t parse_env_once = PTHREAD_ONCE_INIT;
 
 /** Parse an option.
  * stats -- Show summary stats
- * directwrite -- bypass the diskcache on write
- * directread -- bypass the diskcache on read
+ * directio -- bypass the diskcache
  * noautodetect -- disable autodetection of file compression, assume all files
  *		   are uncompressed
  * nothreads -- Don't use threads
  * threads=n -- Use a maximum of 'n' threads for thread farms
+ * buffers=n -- Allow the threaded reader or writer at most 'n' slices
+ * typesize=n -- Tell the blosc writer the data is made of 'n' byte records
+ * shuffle=x -- Shuffle blosc chunks: none, byte, bit or auto
+ * blocksize=n -- Split blosc chunks into 'n' byte blocks
  */
 static void do_option(const char *option)
 {
@@ -74,10 +84,8 @@ static void do_option(const char *option)
 	else if (strcmp(option,"stats") == 0)
 		keep_stats = 1;
 	/*
-	else if (strcmp(option,"directwrite") == 0)
-		force_directio_write = 1;
-	else if (strcmp(option,"directread") == 0)
-		force_directio_read  = 1;
+	else if (strcmp(option,"directio") == 0)
+		force_directio = 1;
 	*/
 	else if (strcmp(option,"nothreads") == 0)
 		use_threads = 0;
@@ -87,6 +95,18 @@ static void do_option(const char *option)
 		use_threads = atoi(option+8);
 	else if (strncmp(option,"buffers=",8) == 0)
 		max_buffers = atoi(option+8);
+	else if (strncmp(option,"typesize=",9) == 0)
+		blosc_typesize = atoi(option+9);
+	else if (strcmp(option,"shuffle=none") == 0)
+		blosc_shuffle = WANDIO_BLOSC_NOSHUFFLE;
+	else if (strcmp(option,"shuffle=byte") == 0)
+		blosc_shuffle = WANDIO_BLOSC_SHUFFLE;
+	else if (strcmp(option,"shuffle=bit") == 0)
+		blosc_shuffle = WANDIO_BLOSC_BITSHUFFLE;
+	else if (strcmp(option,"shuffle=auto") == 0)
+		blosc_shuffle = WANDIO_BLOSC_AUTOSHUFFLE;
+	else if (strncmp(option,"blocksize=",10) == 0)
+		blosc_blocksize = atoi(option+10);
 	else {
 		fprintf(stderr,"Unknown libwandioio debug option '%s'\n", option);
 	}
@@ -116,6 +136,23 @@ static void parse_env(void)
 }
 
 
+DLLEXPORT void wandio_options_init(struct wandio_options *opts)
+{
+	/* The environment only needs to be looked at once */
+	pthread_once(&parse_env_once, parse_env);
+
+	opts->slice_size = 0;
+	opts->ring_depth = max_buffers;
+	opts->threads = use_threads;
+	opts->autodetect = use_autodetect;
+	opts->direct_io = force_directio;
+	opts->stats = keep_stats;
+	opts->block_index = false;
+	opts->blosc_typesize = blosc_typesize;
+	opts->blosc_shuffle = blosc_shuffle;
+	opts->blosc_blocksize = blosc_blocksize;
+}
+
 #define READ_TRACE 0
 #define WRITE_TRACE 0
 #define PIPELINE_TRACE 0
@@ -126,7 +163,31 @@ static void parse_env(void)
 #define DEBUG_PIPELINE(x) 
 #endif
 
-static io_t *create_io_reader(const char *filename, int autodetect)
+#if HAVE_LIBZ
+/* Opens the index written alongside a blocked gzip file, if there is one */
+static io_t *open_block_index(const char *filename, 
+		const struct wandio_options *opts)
+{
+	struct wandio_options index_opts = *opts;
+	char *index_name;
+	io_t *index;
+
+	if (strcmp(filename, "-") == 0)
+		return NULL;
+
+	/* The index is tiny, don't bother bypassing the cache for it */
+	index_opts.direct_io = false;
+	index_name = malloc(strlen(filename) + sizeof(".gzi"));
+	strcpy(index_name, filename);
+	strcat(index_name, ".gzi");
+	index = stdio_open(index_name, &index_opts);
+	free(index_name);
+	return index;
+}
+#endif
+
+static io_t *create_io_reader(const char *filename, 
+		const struct wandio_options *opts)
 {
         io_t *io;
 	/* Use a peeking reader to look at the start of the trace file and
@@ -145,7 +206,7 @@ static io_t *create_io_reader(const char *filename, int autodetect)
 	}
         if (stdfile) {
                 DEBUG_PIPELINE("stdio");
-                io = stdio_open(filename);
+                io = stdio_open(filename, opts);
         }
         else {
 #if HAVE_HTTP
@@ -168,12 +229,21 @@ static io_t *create_io_reader(const char *filename, int autodetect)
 	 * instead we just assume uncompressed.
 	 */
 
-	if (autodetect) {
+	if (opts->autodetect) {
 		if (len>=3 && buffer[0] == 0x1f && buffer[1] == 0x8b &&
 				buffer[2] == 0x08) { 
 #if HAVE_LIBZ
-			DEBUG_PIPELINE("zlib");
-			io = zlib_open(io);
+			/* Blocked gzip can be inflated in parallel */
+			if (wandio_gzip_block_size(buffer, len) > 0) {
+				DEBUG_PIPELINE("bgzf");
+				io = bgzf_open(io, opts, stdfile ? 
+					open_block_index(filename, opts) : 
+					NULL);
+			}
+			else {
+				DEBUG_PIPELINE("zlib");
+				io = zlib_open(io);
+			}
 #else
 			fprintf(stderr, "File %s is gzip compressed but libwandio has not been built with zlib support!\n", filename);
 			return NULL;
@@ -194,7 +264,7 @@ static io_t *create_io_reader(const char *filename, int autodetect)
 		if (len>=3 && buffer[0] == 'B' && buffer[1] == 'Z' && buffer[2] == 'h') { 
 #if HAVE_LIBBZ2
 			DEBUG_PIPELINE("bzip");
-			io = bz_open(io);
+			io = bz_open(io, opts);
 #else
 			fprintf(stderr, "File %s is bzip compressed but libwandio has not been built with bzip2 support!\n", filename);
 			return NULL;
@@ -206,17 +276,55 @@ static io_t *create_io_reader(const char *filename, int autodetect)
                                 buffer[4] == 'Z') {
 #if HAVE_LIBLZMA
                         DEBUG_PIPELINE("lzma");
-                        io = lzma_open(io);
+                        io = lzma_open(io, opts);
 #else
                         fprintf(stderr, "File %s is lzma compressed but libwandio has not been built with lzma support!\n", filename);
                         return NULL;
 #endif
                 }
-		if (len >= 3 && buffer[0] == 0x02 && buffer[1] == 0x01
-				/*&& buffer[2] == 0x08*/) {
+		if (len >= 4 && buffer[0] == 0x28 && buffer[1] == 0xb5 &&
+				buffer[2] == 0x2f && buffer[3] == 0xfd) {
+#if HAVE_LIBZSTD
+			DEBUG_PIPELINE("zstd");
+			io = zstd_open(io, opts);
+#else
+			fprintf(stderr, "File %s is zstd compressed but libwandio has not been built with zstd support!\n", filename);
+			return NULL;
+#endif
+		}
+		if (len >= 4 && buffer[0] == 0x04 && buffer[1] == 0x22 &&
+				buffer[2] == 0x4d && buffer[3] == 0x18) {
+#if HAVE_LIBLZ4
+			DEBUG_PIPELINE("lz4");
+			io = lz4_open(io, opts);
+#else
+			fprintf(stderr, "File %s is lz4 compressed but libwandio has not been built with lz4 support!\n", filename);
+			return NULL;
+#endif
+		}
+		if (len >= 9 && buffer[0] == 0x89 && buffer[1] == 'L' &&
+				buffer[2] == 'Z' && buffer[3] == 'O' &&
+				buffer[4] == 0x00 && buffer[5] == 0x0d &&
+				buffer[6] == 0x0a && buffer[7] == 0x1a &&
+				buffer[8] == 0x0a) {
+#if HAVE_LIBLZO2
+			DEBUG_PIPELINE("lzo");
+			io = lzo_open(io, opts);
+#else
+			fprintf(stderr, "File %s is lzo compressed but libwandio has not been built with lzo support!\n", filename);
+			return NULL;
+#endif
+		}
+		/* Framed blosc, or an older file of bare blosc chunks */
+		if ((len >= 8 && buffer[0] == 0x89 && buffer[1] == 'B' &&
+				buffer[2] == 'L' && buffer[3] == 'O' &&
+				buffer[4] == 'S' && buffer[5] == 'C' &&
+				buffer[6] == 0x0d && buffer[7] == 0x0a) ||
+				(len >= 3 && buffer[0] == 0x02 && buffer[1] == 0x01
+				/*&& buffer[2] == 0x08*/)) {
 #if HAVE_LIBZ
 			DEBUG_PIPELINE("blosc");
-			io = blosc_open(io);
+			io = blosc_open(io, opts);
 #else
 			fprintf(stderr, "File %s is blosc compressed but libwandio has not been built with blosc support!\n", filename);
 			return NULL;
@@ -227,9 +335,9 @@ static io_t *create_io_reader(const char *filename, int autodetect)
 	/* Now open a threaded, peekable reader using the appropriate module
 	 * to read the data */
 
-	if (use_threads) {
+	if (opts->threads) {
 		DEBUG_PIPELINE("thread");
-		io = thread_open(io);
+		io = thread_open(io, opts);
 	}
 	
 	DEBUG_PIPELINE("peek");
@@ -250,21 +358,34 @@ DLLEXPORT struct wandio_compression_type *wandio_lookup_compression_type(
         return NULL;
 }
 
+DLLEXPORT io_t *wandio_create_ex(const char *filename, 
+		const struct wandio_options *opts) {
+	struct wandio_options defaults;
+
+	if (!opts) {
+		wandio_options_init(&defaults);
+		opts = &defaults;
+	}
+	return create_io_reader(filename, opts);
+}
+
 DLLEXPORT io_t *wandio_create(const char *filename) {
-	parse_env();
-	return create_io_reader(filename, use_autodetect);
+	return wandio_create_ex(filename, NULL);
 }
 
 DLLEXPORT io_t *wandio_create_uncompressed(const char *filename) {
-	parse_env();
-	return create_io_reader(filename, 0);
+	struct wandio_options opts;
+
+	wandio_options_init(&opts);
+	opts.autodetect = false;
+	return create_io_reader(filename, &opts);
 }
 
 
 DLLEXPORT int64_t wandio_tell(io_t *io)
 {
 	if (!io->source->tell) {
-		errno = -ENOSYS;
+		errno = ENOSYS;
 		return -1;
 	}
 	return io->source->tell(io);
@@ -273,16 +394,28 @@ DLLEXPORT int64_t wandio_tell(io_t *io)
 DLLEXPORT int64_t wandio_seek(io_t *io, int64_t offset, int whence)
 {
 	if (!io->source->seek) {
-		errno = -ENOSYS;
+		errno = ENOSYS;
 		return -1;
 	}
 	return io->source->seek(io,offset,whence);
 }
 
+/* Every call into a layer goes through one of the functions below, which
+ * keep the counters that wandio_get_stats() and wandio_wget_stats() report */
+static void count_call(struct wandio_layer_stats *stats, uint64_t start)
+{
+	wandio_stat_add(&stats->calls, 1);
+	wandio_stat_add(&stats->time_ns, wandio_clock_ns() - start);
+}
+
 DLLEXPORT int64_t wandio_read(io_t *io, void *buffer, int64_t len)
 { 
 	int64_t ret;
+	uint64_t start = wandio_clock_ns();
 	ret=io->source->read(io,buffer,len); 
+	count_call(&io->stats, start);
+	if (ret > 0)
+		wandio_stat_add(&io->stats.bytes_out, ret);
 #if READ_TRACE
 	fprintf(stderr,"%p: read(%s): %d bytes = %d\n",io,io->source->name, (int)len,(int)ret);
 #endif
@@ -292,37 +425,142 @@ DLLEXPORT int64_t wandio_read(io_t *io, void *buffer, int64_t len)
 DLLEXPORT int64_t wandio_peek(io_t *io, void *buffer, int64_t len)
 {
 	int64_t ret;
+	uint64_t start;
 	assert(io->source->peek); /* If this fails, it means you're calling
 				   * peek on something that doesn't support
 				   * peeking.   Push a peek_open() on the io
 				   * first.
 				   */
+	start = wandio_clock_ns();
 	ret=io->source->peek(io, buffer, len);
+	count_call(&io->stats, start);
 #if READ_TRACE
 	fprintf(stderr,"%p: peek(%s): %d bytes = %d\n",io,io->source->name, (int)len, (int)ret);
 #endif
 	return ret;
 }
 
+DLLEXPORT int64_t wandio_read_borrow(io_t *io, const void **buffer, 
+		int64_t len)
+{
+	int64_t ret;
+	uint64_t start;
+	if (!io->source->borrow) {
+		errno = ENOSYS;
+		return -1;
+	}
+	start = wandio_clock_ns();
+	ret=io->source->borrow(io, buffer, len);
+	count_call(&io->stats, start);
+#if READ_TRACE
+	fprintf(stderr,"%p: borrow(%s): %d bytes = %d\n",io,io->source->name, (int)len, (int)ret);
+#endif
+	return ret;
+}
+
+DLLEXPORT void wandio_read_release(io_t *io, int64_t used)
+{
+	assert(io->source->release);
+	io->source->release(io, used);
+	if (used > 0)
+		wandio_stat_add(&io->stats.bytes_out, used);
+}
+
+/* Copy a layer's counters one at a time, they may still be changing */
+static void load_stats(struct wandio_layer_stats *dst, 
+		struct wandio_layer_stats *src, const char *name)
+{
+	dst->name = name;
+	dst->bytes_in = __atomic_load_n(&src->bytes_in, __ATOMIC_RELAXED);
+	dst->bytes_out = __atomic_load_n(&src->bytes_out, __ATOMIC_RELAXED);
+	dst->calls = __atomic_load_n(&src->calls, __ATOMIC_RELAXED);
+	dst->time_ns = __atomic_load_n(&src->time_ns, __ATOMIC_RELAXED);
+	dst->producer_stalls = __atomic_load_n(&src->producer_stalls, 
+			__ATOMIC_RELAXED);
+	dst->producer_stall_ns = __atomic_load_n(&src->producer_stall_ns, 
+			__ATOMIC_RELAXED);
+	dst->consumer_stalls = __atomic_load_n(&src->consumer_stalls, 
+			__ATOMIC_RELAXED);
+	dst->consumer_stall_ns = __atomic_load_n(&src->consumer_stall_ns, 
+			__ATOMIC_RELAXED);
+}
+
+DLLEXPORT int wandio_get_stats(io_t *io, struct wandio_layer_stats *stats, 
+		int max)
+{
+	int layers = 0;
+
+	for (; io; io = io->child, ++layers) {
+		if (layers >= max)
+			continue;
+		load_stats(&stats[layers], &io->stats, io->source->name);
+		/* A reader only counts what it hands out, what it took in
+		 * is whatever the layer below handed out to it */
+		if (io->child)
+			stats[layers].bytes_in = __atomic_load_n(
+					&io->child->stats.bytes_out,
+					__ATOMIC_RELAXED);
+		else
+			stats[layers].bytes_in = stats[layers].bytes_out;
+	}
+	return layers;
+}
+
 DLLEXPORT void wandio_destroy(io_t *io)
 { 
 	if (!io)
 		return;
 	
-	if (keep_stats) 
-		fprintf(stderr,"LIBTRACEIO STATS: %"PRIu64" blocks on read\n", read_waits);
 	io->source->close(io); 
 }
 
 DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type, int compression_level, int flags)
+{
+	return wandio_wcreate_ex(filename, compress_type, compression_level, 
+			flags, NULL);
+}
+
+#if HAVE_LIBZ
+/* Opens the file that a blocked gzip index is written to, if one is wanted */
+static iow_t *create_block_index(const char *filename, int flags,
+		const struct wandio_options *opts)
+{
+	struct wandio_options index_opts = *opts;
+	char *index_name;
+	iow_t *index;
+
+	if (!opts->block_index || strcmp(filename, "-") == 0)
+		return NULL;
+
+	/* The index is tiny, don't bother bypassing the cache for it */
+	index_opts.direct_io = false;
+	index_name = malloc(strlen(filename) + sizeof(".gzi"));
+	strcpy(index_name, filename);
+	strcat(index_name, ".gzi");
+	index = stdio_wopen(index_name, flags, &index_opts);
+	if (!index)
+		fprintf(stderr, "Unable to create index %s\n", index_name);
+	free(index_name);
+	return index;
+}
+#endif
+
+DLLEXPORT iow_t *wandio_wcreate_ex(const char *filename, int compress_type, 
+		int compression_level, int flags, 
+		const struct wandio_options *opts)
 {
 	iow_t *iow;
-	parse_env();
+	struct wandio_options defaults;
+
+	if (!opts) {
+		wandio_options_init(&defaults);
+		opts = &defaults;
+	}
 
 	assert ( compression_level >= 0 && compression_level <= 9 );
 	assert (compress_type != WANDIO_COMPRESS_MASK);
 
-	iow=stdio_wopen(filename, flags);
+	iow=stdio_wopen(filename, flags, opts);
 	if (!iow)
 		return NULL;
 
@@ -331,7 +569,12 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type, int com
 #if HAVE_LIBZ
 	if (compression_level != 0 && 
 	    compress_type == WANDIO_COMPRESS_ZLIB) {
-		iow = zlib_wopen(iow,compression_level);
+		iow = zlib_wopen(iow,compression_level,opts);
+	}
+	else if (compression_level != 0 && 
+	    compress_type == WANDIO_COMPRESS_BGZF) {
+		iow = bgzf_wopen(iow,compression_level,opts,
+				create_block_index(filename, flags, opts));
 	}
 	else if (compression_level != 0 && 
 	    compress_type == WANDIO_COMPRESS_HWZLIB) {
@@ -341,47 +584,111 @@ DLLEXPORT iow_t *wandio_wcreate(const char *filename, int compress_type, int com
 #if HAVE_LIBLZO2
 	else if (compression_level != 0 && 
 	    compress_type == WANDIO_COMPRESS_LZO) {
-		iow = lzo_wopen(iow,compression_level);
+		iow = lzo_wopen(iow,compression_level,opts);
 	}
 #endif
 #if HAVE_LIBBZ2
 	else if (compression_level != 0 && 
 	    compress_type == WANDIO_COMPRESS_BZ2) {
-		iow = bz_wopen(iow,compression_level);
+		iow = bz_wopen(iow,compression_level,opts);
 	}
 #endif
 #if HAVE_LIBLZMA
         else if (compression_level != 0 && 
             compress_type == WANDIO_COMPRESS_LZMA) {
-                iow = lzma_wopen(iow,compression_level);
+                iow = lzma_wopen(iow,compression_level,opts);
         }
+#endif
+#if HAVE_LIBZSTD
+	else if (compression_level != 0 && 
+	    compress_type == WANDIO_COMPRESS_ZSTD) {
+		iow = zstd_wopen(iow,compression_level,opts);
+	}
+#endif
+#if HAVE_LIBLZ4
+	else if (compression_level != 0 && 
+	    compress_type == WANDIO_COMPRESS_LZ4) {
+		iow = lz4_wopen(iow,compression_level,opts);
+	}
 #endif
 	//blosc
         else if (compression_level != 0 && 
             compress_type >= WANDIO_COMPRESS_BLOSC_BLOSCLZ && 
 	    compress_type <= WANDIO_COMPRESS_BLOSC_ZSTD) {
-                iow = blosc_wopen(iow,compress_type,compression_level);
+                iow = blosc_wopen(iow,compress_type,compression_level,opts);
         }
 
 	/* Open a threaded writer */
-	if (use_threads)
-		return thread_wopen(iow);
+	if (opts->threads)
+		return thread_wopen(iow, opts);
 	else
 		return iow;
 }
 
 DLLEXPORT int64_t wandio_wwrite(iow_t *iow, const void *buffer, int64_t len)
 {
+	int64_t ret;
+	uint64_t start;
 #if WRITE_TRACE
 	fprintf(stderr,"wwrite(%s): %d bytes\n",iow->source->name, (int)len);
 #endif
-	return iow->source->write(iow,buffer,len);	
+	start = wandio_clock_ns();
+	ret = iow->source->write(iow,buffer,len);	
+	count_call(&iow->stats, start);
+	if (ret > 0)
+		wandio_stat_add(&iow->stats.bytes_in, ret);
+	return ret;
+}
+
+DLLEXPORT void *wandio_wwrite_acquire(iow_t *iow, int64_t min_len)
+{
+	void *ret;
+	uint64_t start;
+	if (!iow->source->acquire) {
+		errno = ENOSYS;
+		return NULL;
+	}
+	start = wandio_clock_ns();
+	ret = iow->source->acquire(iow, min_len);
+	count_call(&iow->stats, start);
+	return ret;
+}
+
+DLLEXPORT int64_t wandio_wwrite_commit(iow_t *iow, int64_t used)
+{
+	int64_t ret;
+#if WRITE_TRACE
+	fprintf(stderr,"wwrite_commit(%s): %d bytes\n",iow->source->name, (int)used);
+#endif
+	assert(iow->source->commit);
+	ret = iow->source->commit(iow, used);
+	if (ret > 0)
+		wandio_stat_add(&iow->stats.bytes_in, ret);
+	return ret;
+}
+
+DLLEXPORT int wandio_wget_stats(iow_t *iow, struct wandio_layer_stats *stats, 
+		int max)
+{
+	int layers = 0;
+
+	for (; iow; iow = iow->child, ++layers) {
+		if (layers >= max)
+			continue;
+		load_stats(&stats[layers], &iow->stats, iow->source->name);
+		/* Likewise a writer only counts what it is given */
+		if (iow->child)
+			stats[layers].bytes_out = __atomic_load_n(
+					&iow->child->stats.bytes_in,
+					__ATOMIC_RELAXED);
+		else
+			stats[layers].bytes_out = stats[layers].bytes_in;
+	}
+	return layers;
 }
 
 DLLEXPORT void wandio_wdestroy(iow_t *iow)
 {
 	iow->source->close(iow);
-	if (keep_stats) 
-		fprintf(stderr,"LIBTRACEIO STATS: %"PRIu64" blocks on write\n", write_waits);
 }
 
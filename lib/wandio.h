@@ -71,6 +71,94 @@ struct wandio_compression_type {
 /** The list of supported compression methods */
 extern struct wandio_compression_type compression_type[];
 
+/** How the blosc writer rearranges the bytes of each chunk before
+ * compressing it */
+enum wandio_blosc_shuffle {
+	/** Pick whichever of the others compresses the first few chunks
+	 *  best */
+	WANDIO_BLOSC_AUTOSHUFFLE	= -1,
+	/** Compress the data as it is */
+	WANDIO_BLOSC_NOSHUFFLE		= 0,
+	/** Group the bytes of each record together by position */
+	WANDIO_BLOSC_SHUFFLE		= 1,
+	/** Group the bits of each record together by position */
+	WANDIO_BLOSC_BITSHUFFLE		= 2
+};
+
+/** Structure describing how an individual libwandio reader or writer should
+ * be set up.
+ *
+ * Always fill this in with wandio_options_init() first, which picks up the
+ * defaults (including anything set using the LIBTRACEIO environment
+ * variable), and then change the options you care about.
+ */
+struct wandio_options {
+	/** Size of each buffer (or "slice") handed between the main thread
+	 *  and the reading or writing thread, in bytes. 0 means use the
+	 *  default of 1MB */
+	int64_t slice_size;
+	/** Maximum number of slices that the reading or writing thread may
+	 *  have in flight. 0 means use the default for the module */
+	unsigned int ring_depth;
+	/** Maximum number of threads to use, 0 means do all the work in the
+	 *  calling thread */
+	unsigned int threads;
+	/** Detect the compression method when reading, rather than assuming
+	 *  the file is uncompressed */
+	bool autodetect;
+	/** Bypass the disk cache (O_DIRECT) */
+	bool direct_io;
+	/** Print summary statistics to stderr when the handle is destroyed */
+	bool stats;
+	/** When writing blocked gzip (bgzf), also write an index of where
+	 *  each block starts to a file with ".gzi" appended to its name.
+	 *  Readers pick the index up automatically and use it to seek */
+	bool block_index;
+	/** When writing blosc, the size in bytes of the fixed-size records
+	 *  that make up the data. 0 means treat it as plain bytes */
+	unsigned int blosc_typesize;
+	/** When writing blosc, how to shuffle the records before compressing
+	 *  them, one of enum wandio_blosc_shuffle */
+	int blosc_shuffle;
+	/** When writing blosc, the size of the blocks each chunk is split
+	 *  into, in bytes. 0 means let blosc choose */
+	size_t blosc_blocksize;
+};
+
+/** Structure holding the statistics gathered for one layer (module) of a
+ * libwandio IO reader or writer.
+ *
+ * For a reader, bytes_in is the data the layer took from the layer below it
+ * and bytes_out is the data it handed up to its caller. For a writer, bytes_in
+ * is the data it was given and bytes_out is the data it passed down to the
+ * layer below it. The bottom layer reports the data read from or written to
+ * the file as both.
+ */
+struct wandio_layer_stats {
+	/** Name of the IO module implementing the layer */
+	const char *name;
+	/** Number of bytes consumed by the layer */
+	uint64_t bytes_in;
+	/** Number of bytes produced by the layer */
+	uint64_t bytes_out;
+	/** Number of read, peek or write calls made on the layer */
+	uint64_t calls;
+	/** Time spent inside those calls, in nanoseconds. This includes any
+	 *  time spent in the layers below that were called from the same
+	 *  thread */
+	uint64_t time_ns;
+	/** Number of times the thread filling the layer's buffers had to wait
+	 *  for the other side to make space */
+	uint64_t producer_stalls;
+	/** Time spent in those waits, in nanoseconds */
+	uint64_t producer_stall_ns;
+	/** Number of times the thread emptying the layer's buffers had to
+	 *  wait for the other side to provide data */
+	uint64_t consumer_stalls;
+	/** Time spent in those waits, in nanoseconds */
+	uint64_t consumer_stall_ns;
+};
+
 /** Structure defining a libwandio IO reader module */
 typedef struct {
 	/** Module name */
@@ -121,6 +209,27 @@ typedef struct {
 	 * @param io		The IO reader to close
 	 */
 	void (*close)(io_t *io);
+
+	/** Returns a pointer to the next chunk of data held inside the IO
+	 *  source without copying it. May be NULL if the module cannot do
+	 *  this.
+	 *
+	 * @param io		The IO reader
+	 * @param buffer	Set to point at the data
+	 * @param len		The maximum amount of data wanted
+	 * @return The amount of data available at *buffer, 0 if end of file
+	 * is reached, -1 if an error occurs
+	 */
+	int64_t (*borrow)(io_t *io, const void **buffer, int64_t len);
+
+	/** Hands back the data obtained by the last call to borrow,
+	 *  advancing the read pointer by the amount that was used.
+	 *
+	 * @param io		The IO reader
+	 * @param used		The amount of the borrowed data that was
+	 * 			consumed
+	 */
+	void (*release)(io_t *io, int64_t used);
 } io_source_t;
 
 /** Structure defining a libwandio IO writer module */
@@ -142,6 +251,26 @@ typedef struct {
 	 * @param iow		The IO writer to close
 	 */
 	void (*close)(iow_t *iow);
+
+	/** Returns a pointer to space inside the IO writer that the caller
+	 *  can write data into directly. May be NULL if the module cannot do
+	 *  this.
+	 *
+	 * @param iow		The IO writer
+	 * @param min_len	The minimum amount of contiguous space needed
+	 * @return A pointer to at least min_len bytes of space, or NULL if an
+	 * error occurs
+	 */
+	void *(*acquire)(iow_t *iow, int64_t min_len);
+
+	/** Tells the IO writer how much of the space obtained by the last
+	 *  call to acquire was filled with data to be written.
+	 *
+	 * @param iow		The IO writer
+	 * @param used		The amount of data placed in the space
+	 * @return The amount of data written, or -1 if an error occurs
+	 */
+	int64_t (*commit)(iow_t *iow, int64_t used);
 } iow_source_t;
 
 /** A libwandio IO reader */
@@ -150,6 +279,12 @@ struct io_t {
 	io_source_t *source;
 	/** Generic pointer to data required by the IO module */
 	void *data;
+	/** The reader this one takes its data from, NULL for the bottom
+	 *  layer */
+	io_t *child;
+	/** Running counters for wandio_get_stats(), only updated using
+	 *  atomic operations */
+	struct wandio_layer_stats stats;
 };
 
 /** A libwandio IO writer */
@@ -158,6 +293,12 @@ struct iow_t {
 	iow_source_t *source;
 	/** Generic pointer to data required by the IO module */
 	void *data;
+	/** The writer this one passes its data on to, NULL for the bottom
+	 *  layer */
+	iow_t *child;
+	/** Running counters for wandio_wget_stats(), only updated using
+	 *  atomic operations */
+	struct wandio_layer_stats stats;
 };
 
 /** Enumeration of all supported compression methods */
@@ -181,6 +322,12 @@ enum {
         WANDIO_COMPRESS_BLOSC_SNAPPY  	= 9,
         WANDIO_COMPRESS_BLOSC_ZLIB  	= 10,
         WANDIO_COMPRESS_BLOSC_ZSTD  	= 11,
+	/** Blocked gzip (BGZF) compression */
+	WANDIO_COMPRESS_BGZF	= 12,
+	/** Zstandard compression */
+	WANDIO_COMPRESS_ZSTD	= 13,
+	/** LZ4 frame compression */
+	WANDIO_COMPRESS_LZ4	= 14,
 	/** All supported methods - used as a bitmask */
 	WANDIO_COMPRESS_MASK	= 15
 };
@@ -193,23 +340,40 @@ enum {
  * @{
  */
 
-io_t *bz_open(io_t *parent);
+io_t *bz_open(io_t *parent, const struct wandio_options *opts);
 io_t *zlib_open(io_t *parent);
-io_t *blosc_open(io_t *parent);
-io_t *thread_open(io_t *parent);
-io_t *lzma_open(io_t *parent);
+io_t *bgzf_open(io_t *parent, const struct wandio_options *opts,
+		io_t *index);
+io_t *blosc_open(io_t *parent, const struct wandio_options *opts);
+io_t *lzo_open(io_t *parent, const struct wandio_options *opts);
+io_t *zstd_open(io_t *parent, const struct wandio_options *opts);
+io_t *lz4_open(io_t *parent, const struct wandio_options *opts);
+io_t *thread_open(io_t *parent, const struct wandio_options *opts);
+io_t *lzma_open(io_t *parent, const struct wandio_options *opts);
 io_t *peek_open(io_t *parent);
-io_t *stdio_open(const char *filename);
+io_t *stdio_open(const char *filename, const struct wandio_options *opts);
 io_t *http_open(const char *filename);
 
-iow_t *zlib_wopen(iow_t *child, int compress_level);
+iow_t *zlib_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *bgzf_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts, iow_t *index);
 iow_t *hwzlib_wopen(iow_t *child, int compress_level);
-iow_t *blosc_wopen(iow_t *child, int compress_type, int compress_level);
-iow_t *bz_wopen(iow_t *child, int compress_level);
-iow_t *lzo_wopen(iow_t *child, int compress_level);
-iow_t *lzma_wopen(iow_t *child, int compress_level);
-iow_t *thread_wopen(iow_t *child);
-iow_t *stdio_wopen(const char *filename, int fileflags);
+iow_t *blosc_wopen(iow_t *child, int compress_type, int compress_level,
+		const struct wandio_options *opts);
+iow_t *bz_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *zstd_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *lz4_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *lzo_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *lzma_wopen(iow_t *child, int compress_level,
+		const struct wandio_options *opts);
+iow_t *thread_wopen(iow_t *child, const struct wandio_options *opts);
+iow_t *stdio_wopen(const char *filename, int fileflags,
+		const struct wandio_options *opts);
 
 /* @} */
 
@@ -227,7 +391,7 @@ iow_t *stdio_wopen(const char *filename, int fileflags);
   * method enum when configuring an output file.
   *
   * @param name          The compression method name as a string, e.g. "gzip",
-  *                      "bzip2", "lzo" or "lzma".
+  *                      "bzip2", "lzo", "lzma", "zstd" or "lz4".
   * @return A pointer to the compression_type structure representing the
   * compression method or NULL if no match can be found.
   *
@@ -246,6 +410,25 @@ struct wandio_compression_type *wandio_lookup_compression_type(const char *name)
  */
 io_t *wandio_create(const char *filename);
 
+/** Fills in a set of options with the defaults used by wandio_create() and
+ * wandio_wcreate(), including any set in the LIBTRACEIO environment
+ * variable.
+ *
+ * @param opts		The options structure to fill in
+ */
+void wandio_options_init(struct wandio_options *opts);
+
+/** Creates a new libwandio IO reader using a particular set of options and
+ * opens the provided file for reading.
+ *
+ * @param filename	The name of the file to open
+ * @param opts		The options to use for this reader, or NULL to use
+ * 			the defaults. The options are copied, so the
+ * 			structure need not outlive this call.
+ * @return A pointer to a new libwandio IO reader, or NULL if an error occurs
+ */
+io_t *wandio_create_ex(const char *filename, const struct wandio_options *opts);
+
 /** Creates a new libwandio IO reader and opens the provided file for reading.
  *
  * @param filename	The name of the file to open
@@ -300,6 +483,48 @@ int64_t wandio_read(io_t *io, void *buffer, int64_t len);
  */
 int64_t wandio_peek(io_t *io, void *buffer, int64_t len);
 
+/** Gives the caller direct access to the next chunk of data inside a
+ * libwandio IO reader, avoiding copying it into a caller-supplied buffer.
+ *
+ * @param io		The IO reader to read from
+ * @param buffer	Set to point at the data
+ * @param len		The maximum amount of data wanted
+ * @return The amount of data available at *buffer, 0 if EOF is reached, -1
+ * if an error occurs
+ *
+ * The data remains owned by the reader and is only valid until the matching
+ * call to wandio_read_release(). Exactly one chunk may be borrowed at a time
+ * and no other function may be called on the reader until it has been
+ * released. The amount returned may be less than len even if more data is
+ * available, e.g. at the end of one of the reader's internal buffers.
+ */
+int64_t wandio_read_borrow(io_t *io, const void **buffer, int64_t len);
+
+/** Returns data obtained by wandio_read_borrow() to a libwandio IO reader.
+ *
+ * @param io		The IO reader the data was borrowed from
+ * @param used		The number of borrowed bytes that were consumed. The
+ * 			read pointer is advanced by this much, any remaining
+ * 			bytes will be returned again by the next read.
+ */
+void wandio_read_release(io_t *io, int64_t used);
+
+/** Takes a snapshot of the statistics for each layer of a libwandio IO
+ * reader, starting with the layer the caller reads from and working down to
+ * the one reading the file.
+ *
+ * @param io		The IO reader to get the statistics for
+ * @param stats		An array to fill in with the statistics for each layer
+ * @param max		The number of entries in the stats array
+ * @return The number of layers in the reader, which may be more than max (in
+ * which case only the first max layers are filled in)
+ *
+ * This may be called from any thread while the reader is in use, but not
+ * concurrently with wandio_destroy(). The counters are sampled one at a time,
+ * so a snapshot taken while data is flowing is not exactly consistent.
+ */
+int wandio_get_stats(io_t *io, struct wandio_layer_stats *stats, int max);
+
 /** Destroys a libwandio IO reader, closing the file and freeing the reader
  * structure.
  *
@@ -318,6 +543,23 @@ void wandio_destroy(io_t *io);
  */
 iow_t *wandio_wcreate(const char *filename, int compression_type, int compression_level, int flags);
 
+/** Creates a new libwandio IO writer using a particular set of options and
+ * opens the provided file for writing.
+ *
+ * @param filename		The name of the file to open
+ * @param compression_type	Compression type
+ * @param compression_level	The compression level to use when writing
+ * @param flags			Flags to apply when opening the file, e.g.
+ * 				O_CREATE
+ * @param opts			The options to use for this writer, or NULL
+ * 				to use the defaults. The options are copied,
+ * 				so the structure need not outlive this call.
+ * @return A pointer to the new libwandio IO writer, or NULL if an error occurs
+ */
+iow_t *wandio_wcreate_ex(const char *filename, int compression_type,
+		int compression_level, int flags,
+		const struct wandio_options *opts);
+
 /** Writes the contents of a buffer using a libwandio IO writer.
  *
  * @param iow		The IO writer to write the data with
@@ -327,6 +569,46 @@ iow_t *wandio_wcreate(const char *filename, int compression_type, int compressio
  */
 int64_t wandio_wwrite(iow_t *iow, const void *buffer, int64_t len);
 
+/** Obtains space inside a libwandio IO writer that the caller can build
+ * data in directly, instead of building it in their own buffer and having
+ * wandio_wwrite() copy it.
+ *
+ * @param iow		The IO writer to write the data with
+ * @param min_len	The minimum amount of contiguous space needed
+ * @return A pointer to at least min_len bytes of writable space, or NULL if
+ * an error occurs
+ *
+ * The space must be handed back with wandio_wwrite_commit() before any other
+ * function is called on the writer. Writers that were created without a
+ * writing thread do not support this and return NULL with errno set to
+ * ENOSYS, in which case wandio_wwrite() should be used instead. min_len may
+ * not exceed the writer's slice size.
+ */
+void *wandio_wwrite_acquire(iow_t *iow, int64_t min_len);
+
+/** Writes out data that was placed in the space obtained with
+ * wandio_wwrite_acquire().
+ *
+ * @param iow		The IO writer to write the data with
+ * @param used		The amount of data that was placed in the space
+ * @return The amount of data written, or -1 if an error occurs
+ */
+int64_t wandio_wwrite_commit(iow_t *iow, int64_t used);
+
+/** Takes a snapshot of the statistics for each layer of a libwandio IO
+ * writer, starting with the layer the caller writes to and working down to
+ * the one writing the file.
+ *
+ * @param iow		The IO writer to get the statistics for
+ * @param stats		An array to fill in with the statistics for each layer
+ * @param max		The number of entries in the stats array
+ * @return The number of layers in the writer, which may be more than max (in
+ * which case only the first max layers are filled in)
+ *
+ * The same rules apply as for wandio_get_stats().
+ */
+int wandio_wget_stats(iow_t *iow, struct wandio_layer_stats *stats, int max);
+
 /** Destroys a libwandio IO writer, closing the file and freeing the writer
  * structure.
  *
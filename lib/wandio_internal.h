@@ -30,16 +30,279 @@
 #include <sys/types.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 
 
-/** @name libwandioio options 
+/** @name Thread synchronisation helpers
+ *
+ * The threaded modules hand buffers between a single producer and a single
+ * consumer using lock-free ring indices. A wandio_event is used only when
+ * one side actually has to sleep, i.e. when the ring is empty or full: the
+ * sleeper calls wandio_event_prepare(), re-checks its condition and then
+ * either calls wandio_event_cancel() or wandio_event_wait(). The other side
+ * calls wandio_event_signal() after publishing, which costs a single load
+ * unless somebody is asleep.
+ * @{ */
+
+/** Size used to keep producer and consumer state on separate cache lines */
+#define CACHE_LINE_SIZE 64
+
+struct wandio_event {
+	/** Futex word, bumped whenever a sleeper is woken */
+	uint32_t seq;
+	/** Non-zero while a thread is (about to be) asleep on this event */
+	uint32_t waiting;
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+void wandio_event_init(struct wandio_event *ev);
+void wandio_event_destroy(struct wandio_event *ev);
+uint32_t wandio_event_prepare(struct wandio_event *ev);
+void wandio_event_cancel(struct wandio_event *ev);
+void wandio_event_wait(struct wandio_event *ev, uint32_t token);
+void wandio_event_signal(struct wandio_event *ev);
+/* @} */
+
+/** @name Statistics helpers
+ *
+ * Each layer's struct wandio_layer_stats may be read by wandio_get_stats()
+ * from another thread at any time, so it must only be updated using these.
+ * @{ */
+
+/** Returns a monotonic timestamp in nanoseconds */
+uint64_t wandio_clock_ns(void);
+
+static inline void wandio_stat_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/** Records a wait that began at start (a wandio_clock_ns() timestamp) */
+static inline void wandio_stat_stall(uint64_t *stalls, uint64_t *stall_ns,
+		uint64_t start)
+{
+	wandio_stat_add(stalls, 1);
+	wandio_stat_add(stall_ns, wandio_clock_ns() - start);
+}
+/* @} */
+
+/** @name Worker pool
+ *
+ * Used by the compression modules that split their data into independent
+ * blocks. The caller owns the jobs, the pool runs them on its threads and
+ * hands them back in the order they were submitted. No more than "slots"
+ * jobs may be outstanding at once. See wandio_pool.c for the details.
+ * @{ */
+struct wandio_options;
+struct wandio_pool;
+
+/** Returns how many worker threads a module should use for a handle */
+unsigned int wandio_pool_threads(const struct wandio_options *opts);
+struct wandio_pool *wandio_pool_create(unsigned int threads, 
+		unsigned int slots, void (*run)(void *job, void *arg), 
+		void *arg, const char *label);
+void wandio_pool_count_stalls(struct wandio_pool *pool, uint64_t *stalls, 
+		uint64_t *stall_ns);
+unsigned int wandio_pool_pending(struct wandio_pool *pool);
+void wandio_pool_submit(struct wandio_pool *pool, void *job);
+void *wandio_pool_wait(struct wandio_pool *pool, bool block);
+void wandio_pool_destroy(struct wandio_pool *pool);
+/* @} */
+
+/** @name Ordered writer
+ *
+ * The writing half of the block based compression modules, built on a
+ * wandio_pool. The caller's data is copied into a ring of jobs, each full
+ * job is compressed on the pool and the results are handed back to the
+ * module, in order, to be written out. A module only has to supply the
+ * callbacks below. See wandio_pool.c for the details.
+ * @{ */
+struct iow_t;
+
+/** Every job must start with one of these */
+struct wandio_writer_job {
+	/** Where the caller's data is copied to, set up by the module */
+	uint8_t *in;
+	/** How much of it there is */
+	size_t in_len;
+	/** Set by the compress callback if the job couldn't be done */
+	bool failed;
+};
+
+struct wandio_writer_ops {
+	/** Name for the pool's threads */
+	const char *label;
+	/** Size of the module's job structure */
+	size_t job_size;
+	/** Compresses a job, on a pool thread */
+	void (*compress)(void *job, struct iow_t *iow);
+	/** If not NULL, called in the caller's thread just before a job is
+	 *  submitted, with the job submitted before it (NULL for the first) */
+	void (*prepare)(void *job, const void *prev, struct iow_t *iow);
+	/** Writes out a compressed job, returns false if that failed */
+	bool (*emit)(void *job, struct iow_t *iow);
+};
+
+/** What wandio_writer_finish() does with the job being filled */
+enum wandio_writer_tail {
+	/** Submit it if it holds any data */
+	WANDIO_TAIL_IF_DATA,
+	/** Likewise, but an empty file still gets one (empty) job so that the
+	 *  output is recognisable */
+	WANDIO_TAIL_AT_LEAST_ONE,
+	/** Always submit it, even empty, e.g. because it ends the stream */
+	WANDIO_TAIL_ALWAYS
+};
+
+struct wandio_writer {
+	const struct wandio_writer_ops *ops;
+	struct iow_t *iow;
+	struct wandio_pool *pool;
+	/** The jobs, ops->job_size bytes apart */
+	char *jobs;
+	unsigned int slots;
+	/** How much of the caller's data goes into each job */
+	size_t job_input;
+	/** Number of the job currently being filled */
+	uint64_t next;
+	/** Set once any job has failed to compress or be written out */
+	bool failed;
+};
+
+/** Sets up a writer. slots may be 0 for the usual two jobs per thread.
+ * Returns false if the jobs couldn't be allocated */
+bool wandio_writer_init(struct wandio_writer *w, 
+		const struct wandio_writer_ops *ops, struct iow_t *iow,
+		unsigned int threads, unsigned int slots, size_t job_input);
+/** Returns job number i, for setting up and tearing down each job */
+void *wandio_writer_slot(struct wandio_writer *w, unsigned int i);
+/** Returns the job currently being filled */
+void *wandio_writer_job(struct wandio_writer *w);
+/** Takes as much of buffer as it can, submitting every job it fills.
+ * Returns the amount taken, or -1 if a job has failed and none was */
+int64_t wandio_writer_write(struct wandio_writer *w, const void *buffer,
+		int64_t len);
+/** Submits the job being filled (see enum wandio_writer_tail) and writes
+ * out every job still in flight. Returns false if any job failed */
+bool wandio_writer_finish(struct wandio_writer *w, 
+		enum wandio_writer_tail tail);
+/** Shuts the pool down and frees the jobs */
+void wandio_writer_destroy(struct wandio_writer *w);
+/* @} */
+
+/** @name Indexed reader
+ *
+ * The reading half of the block based compression modules. The module
+ * reads runs of blocks into jobs which are decoded on a wandio_pool, and
+ * the reader hands out the results in order. If the module has an index
+ * of where each block starts, seeking restarts at the block holding the
+ * target; otherwise the reader can only seek forwards. See wandio_pool.c
+ * for the details.
  * @{ */
-extern int force_directio_read;
-extern int force_directio_write;
-extern uint64_t write_waits;
-extern uint64_t read_waits;
-extern unsigned int use_threads;
-extern unsigned int max_buffers;
+struct io_t;
+
+/** Where a block starts, both in the file and once decoded */
+struct wandio_seek_point {
+	uint64_t comp_off;
+	uint64_t unc_off;
+};
+
+/** Every job must start with one of these */
+struct wandio_reader_job {
+	/** The decoded data, set up by the module */
+	uint8_t *out;
+	/** How much of it there is */
+	size_t out_len;
+	/** Set by the decode callback if the job couldn't be done */
+	bool failed;
+};
+
+struct wandio_reader_ops {
+	/** Name for the pool's threads */
+	const char *label;
+	/** What a block is called, for error messages */
+	const char *unit;
+	/** Size of the module's job structure */
+	size_t job_size;
+	/** Decodes a job, on a pool thread */
+	void (*decode)(void *job, struct io_t *io);
+	/** Reads blocks into free jobs (see wandio_reader_free_job()) and
+	 *  submits them. Returns -1 on error */
+	int (*fill)(struct io_t *io);
+	/** If not NULL, called when there is nothing left in flight. Returns
+	 *  1 if it got somewhere, having pointed *out at *len (possibly 0)
+	 *  bytes of decoded data, 0 at the end of the file or -1 on error */
+	int (*idle)(struct io_t *io, uint8_t **out, size_t *len);
+	/** If not NULL, called once everything in flight has been dropped
+	 *  to carry on from seek point "point". Returns -1 on error */
+	int (*restart)(struct io_t *io, size_t point);
+	/** If not NULL, frees whatever the module allocated for a job, once
+	 *  the pool has shut down */
+	void (*free_job)(void *job);
+};
+
+struct wandio_reader {
+	const struct wandio_reader_ops *ops;
+	struct io_t *io;
+	struct wandio_pool *pool;
+	/** The jobs, ops->job_size bytes apart */
+	char *jobs;
+	unsigned int slots;
+	uint64_t next_job;
+
+	/** The index, with an extra point at the end of the data, or NULL if
+	 *  the module can only read forwards */
+	const struct wandio_seek_point *points;
+	size_t npoints;
+	/** The next seek point to be read from the file */
+	size_t next_point;
+
+	/** Uncompressed offset of the next byte we return. Modules that
+	 *  don't use the pool keep this up to date themselves */
+	int64_t position;
+	/** The decoded data we are currently handing out */
+	uint8_t *cur;
+	size_t cur_len;
+	size_t cur_off;
+	/** Set once decoding has failed, until the next restart */
+	bool failed;
+};
+
+/** Sets up a reader with one spare job per thread. points may be NULL.
+ * Returns false if the jobs couldn't be allocated */
+bool wandio_reader_init(struct wandio_reader *r,
+		const struct wandio_reader_ops *ops, struct io_t *io,
+		unsigned int threads, const struct wandio_seek_point *points,
+		size_t npoints);
+/** Returns job number i, for setting up and tearing down each job */
+void *wandio_reader_slot(struct wandio_reader *r, unsigned int i);
+/** Returns a job that can be filled, or NULL if they are all in flight */
+void *wandio_reader_free_job(struct wandio_reader *r);
+/** Starts decoding a job returned by wandio_reader_free_job() */
+void wandio_reader_submit(struct wandio_reader *r, void *job);
+/** Copies decoded data into buffer. Returns the amount copied, 0 at the
+ * end of the file or -1 on error */
+int64_t wandio_reader_read(struct wandio_reader *r, void *buffer,
+		int64_t len);
+/** Seeks the reader (or, without the pool, the module) using the index if
+ * there is one and discarding data to get the rest of the way */
+int64_t wandio_reader_seek(struct wandio_reader *r, struct io_t *io,
+		int64_t offset, int whence);
+/** Shuts the pool down and frees the jobs */
+void wandio_reader_destroy(struct wandio_reader *r);
 /* @} */
 
+/** Looks for a BGZF ("BC") or AHA ("EF") block size in a gzip header
+ *
+ * @param header	The start of the gzip member
+ * @param len		The amount of data available at header
+ * @return The total size of the member, 0 if the header doesn't say, or -1
+ * if more of the header is needed
+ */
+int64_t wandio_gzip_block_size(const uint8_t *header, int64_t len);
+
 #endif
@@ -0,0 +1,622 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include "wandio.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h> /* for sysconf */
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
+
+/* A small thread pool used by the compression modules that work on
+ * independent blocks.
+ *
+ * The caller keeps an array of "slots" (its own job structures) and submits
+ * them to the pool one at a time. Any worker may pick up any job, so a slow
+ * thread only holds up the jobs it is actually running, but jobs are always
+ * handed back by wandio_pool_wait() in the order they were submitted. Since
+ * at most "slots" jobs can be in flight, job n always reuses the slot that
+ * job n-slots was in, and that job has always been collected by the time
+ * job n can be submitted.
+ *
+ * Jobs are big (tens of KB to MBs), so a single mutex is plenty here.
+ */
+
+struct wandio_pool {
+	pthread_mutex_t mutex;
+	/* Signalled when a job is submitted, or we are shutting down */
+	pthread_cond_t work;
+	/* Signalled when a job finishes */
+	pthread_cond_t done;
+
+	void (*run)(void *job, void *arg);
+	void *arg;
+
+	/* Jobs in submission order, indexed by sequence number % slots */
+	unsigned int slots;
+	void **job;
+	bool *finished;
+
+	/* Sequence numbers of the next job to be submitted, started by a
+	 * worker and collected by the caller */
+	uint64_t submitted;
+	uint64_t started;
+	uint64_t collected;
+
+	bool closing;
+	unsigned int threads;
+	unsigned int next_num;
+	pthread_t *thread;
+	char label[8];
+
+	/* Where to count the times wandio_pool_wait() had to sleep */
+	uint64_t *stalls;
+	uint64_t *stall_ns;
+};
+
+static void *pool_worker(void *userdata)
+{
+	struct wandio_pool *pool = (struct wandio_pool *)userdata;
+	unsigned int slot;
+	void *job;
+
+	pthread_mutex_lock(&pool->mutex);
+#ifdef PR_SET_NAME
+	char namebuf[17];
+	if (prctl(PR_GET_NAME, namebuf, 0,0,0) == 0) {
+		char label[16];
+		namebuf[16] = '\0'; /* Make sure it's NUL terminated */
+		snprintf(label, sizeof(label), "[%s%u]", pool->label, 
+				pool->next_num);
+		/* If the filename is too long, overwrite the last few bytes */
+		if (strlen(namebuf)>=16-strlen(label)) {
+			strcpy(namebuf+15-strlen(label),label);
+		}
+		else {
+			strncat(namebuf," ",16);
+			strncat(namebuf,label,16);
+		}
+		prctl(PR_SET_NAME, namebuf, 0,0,0);
+	}
+#endif
+	pool->next_num++;
+
+	for (;;) {
+		while (pool->started == pool->submitted && !pool->closing)
+			pthread_cond_wait(&pool->work, &pool->mutex);
+		if (pool->started == pool->submitted)
+			break;
+
+		slot = pool->started++ % pool->slots;
+		job = pool->job[slot];
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->run(job, pool->arg);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->finished[slot] = true;
+		pthread_cond_broadcast(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+unsigned int wandio_pool_threads(const struct wandio_options *opts)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	return opts->threads < (unsigned long)cpus ? opts->threads : cpus;
+}
+
+struct wandio_pool *wandio_pool_create(unsigned int threads, 
+		unsigned int slots, void (*run)(void *job, void *arg), 
+		void *arg, const char *label)
+{
+	struct wandio_pool *pool;
+	unsigned int i;
+
+	pool = calloc(1, sizeof(struct wandio_pool));
+	if (!pool)
+		return NULL;
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->run = run;
+	pool->arg = arg;
+	pool->slots = slots;
+	pool->job = calloc(slots, sizeof(void *));
+	pool->finished = calloc(slots, sizeof(bool));
+	pool->thread = calloc(threads ? threads : 1, sizeof(pthread_t));
+	strncpy(pool->label, label, sizeof(pool->label)-1);
+
+	for (i = 0; i < threads; ++i) {
+		if (pthread_create(&pool->thread[i], NULL, pool_worker, pool))
+			break;
+		pool->threads++;
+	}
+	return pool;
+}
+
+void wandio_pool_count_stalls(struct wandio_pool *pool, uint64_t *stalls, 
+		uint64_t *stall_ns)
+{
+	pool->stalls = stalls;
+	pool->stall_ns = stall_ns;
+}
+
+unsigned int wandio_pool_pending(struct wandio_pool *pool)
+{
+	/* Only the caller changes submitted and collected */
+	return pool->submitted - pool->collected;
+}
+
+void wandio_pool_submit(struct wandio_pool *pool, void *job)
+{
+	unsigned int slot = pool->submitted % pool->slots;
+
+	assert(wandio_pool_pending(pool) < pool->slots);
+
+	/* Without any threads of our own, just do the work right now */
+	if (!pool->threads) {
+		pool->run(job, pool->arg);
+		pool->job[slot] = job;
+		pool->finished[slot] = true;
+		pool->submitted++;
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->job[slot] = job;
+	pool->finished[slot] = false;
+	pool->submitted++;
+	pthread_cond_signal(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+void *wandio_pool_wait(struct wandio_pool *pool, bool block)
+{
+	unsigned int slot = pool->collected % pool->slots;
+	uint64_t start;
+	void *job;
+
+	if (pool->collected == pool->submitted)
+		return NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->finished[slot]) {
+		if (!block) {
+			pthread_mutex_unlock(&pool->mutex);
+			return NULL;
+		}
+		start = wandio_clock_ns();
+		while (!pool->finished[slot])
+			pthread_cond_wait(&pool->done, &pool->mutex);
+		if (pool->stalls)
+			wandio_stat_stall(pool->stalls, pool->stall_ns, start);
+	}
+	job = pool->job[slot];
+	pool->finished[slot] = false;
+	pool->collected++;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return job;
+}
+
+void wandio_pool_destroy(struct wandio_pool *pool)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->closing = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->threads; ++i)
+		pthread_join(pool->thread[i], NULL);
+
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->done);
+	free(pool->thread);
+	free(pool->finished);
+	free(pool->job);
+	free(pool);
+}
+
+/* The ordered writer.
+ *
+ * The caller fills the job numbered "next" and submits it once it is full.
+ * Whatever has already been compressed is written out straight away, and
+ * the caller only waits for the oldest job when every slot is still busy,
+ * so it can carry on filling while the pool compresses. Once a job has
+ * failed (or couldn't be written out) nothing after it is written, as the
+ * output would have a hole in it.
+ */
+
+static void writer_run(void *job, void *arg)
+{
+	struct wandio_writer *w = (struct wandio_writer *)arg;
+
+	w->ops->compress(job, w->iow);
+}
+
+bool wandio_writer_init(struct wandio_writer *w, 
+		const struct wandio_writer_ops *ops, struct iow_t *iow,
+		unsigned int threads, unsigned int slots, size_t job_input)
+{
+	w->ops = ops;
+	w->iow = iow;
+	w->pool = NULL;
+	w->jobs = NULL;
+	w->job_input = job_input;
+	w->next = 0;
+	w->failed = false;
+
+	/* Enough jobs to keep every thread busy while we write out the ones
+	 * that are done */
+	w->slots = slots ? slots : (threads ? threads * 2 : 1);
+	w->jobs = calloc(w->slots, ops->job_size);
+	if (!w->jobs)
+		return false;
+	w->pool = wandio_pool_create(threads, w->slots, writer_run, w, 
+			ops->label);
+	if (!w->pool) {
+		free(w->jobs);
+		w->jobs = NULL;
+		return false;
+	}
+	wandio_pool_count_stalls(w->pool, &iow->stats.producer_stalls,
+			&iow->stats.producer_stall_ns);
+	return true;
+}
+
+void *wandio_writer_slot(struct wandio_writer *w, unsigned int i)
+{
+	return w->jobs + (size_t)i * w->ops->job_size;
+}
+
+void *wandio_writer_job(struct wandio_writer *w)
+{
+	return wandio_writer_slot(w, w->next % w->slots);
+}
+
+/* Writes out the oldest finished job, waiting for it if block is set.
+ * Returns false if there was nothing to write */
+static bool writer_collect(struct wandio_writer *w, bool block)
+{
+	struct wandio_writer_job *job = wandio_pool_wait(w->pool, block);
+
+	if (!job)
+		return false;
+	if (job->failed)
+		w->failed = true;
+	if (!w->failed && !w->ops->emit(job, w->iow))
+		w->failed = true;
+	return true;
+}
+
+static void writer_submit(struct wandio_writer *w)
+{
+	struct wandio_writer_job *job = wandio_writer_job(w);
+	const void *prev = NULL;
+
+	/* With a single slot the previous job has already been overwritten */
+	if (w->next > 0 && w->slots > 1)
+		prev = wandio_writer_slot(w, (w->next - 1) % w->slots);
+	if (w->ops->prepare)
+		w->ops->prepare(job, prev, w->iow);
+	job->failed = false;
+	wandio_pool_submit(w->pool, job);
+	w->next++;
+
+	while (writer_collect(w, false))
+		;
+	while (wandio_pool_pending(w->pool) >= w->slots)
+		writer_collect(w, true);
+	job = wandio_writer_job(w);
+	job->in_len = 0;
+}
+
+int64_t wandio_writer_write(struct wandio_writer *w, const void *buffer,
+		int64_t len)
+{
+	struct wandio_writer_job *job;
+	int64_t done = 0;
+	size_t size;
+
+	while (done < len && !w->failed) {
+		job = wandio_writer_job(w);
+		size = w->job_input - job->in_len;
+		if ((int64_t)size > len - done)
+			size = len - done;
+
+		memcpy(job->in + job->in_len, (const char *)buffer + done, 
+				size);
+		job->in_len += size;
+		done += size;
+		if (job->in_len == w->job_input)
+			writer_submit(w);
+	}
+	if (done == 0 && w->failed)
+		return -1;
+	return done;
+}
+
+bool wandio_writer_finish(struct wandio_writer *w, 
+		enum wandio_writer_tail tail)
+{
+	struct wandio_writer_job *job = wandio_writer_job(w);
+
+	if (!w->failed && (job->in_len > 0 || tail == WANDIO_TAIL_ALWAYS ||
+			(tail == WANDIO_TAIL_AT_LEAST_ONE && w->next == 0)))
+		writer_submit(w);
+	while (writer_collect(w, true))
+		;
+	return !w->failed;
+}
+
+void wandio_writer_destroy(struct wandio_writer *w)
+{
+	if (w->pool)
+		wandio_pool_destroy(w->pool);
+	free(w->jobs);
+	w->pool = NULL;
+	w->jobs = NULL;
+}
+
+/* The indexed reader.
+ *
+ * The module fills free jobs with runs of blocks, which are decoded on the
+ * pool and handed out in the order they were submitted. There is one spare
+ * job so the pool stays busy while we hand out the contents of another, and
+ * the job we were handing out only becomes free again once all of it has
+ * been read.
+ */
+
+static void reader_run(void *job, void *arg)
+{
+	struct wandio_reader *r = (struct wandio_reader *)arg;
+
+	r->ops->decode(job, r->io);
+}
+
+bool wandio_reader_init(struct wandio_reader *r,
+		const struct wandio_reader_ops *ops, struct io_t *io,
+		unsigned int threads, const struct wandio_seek_point *points,
+		size_t npoints)
+{
+	r->ops = ops;
+	r->io = io;
+	r->pool = NULL;
+	r->slots = threads + 1;
+	r->next_job = 0;
+	r->points = points;
+	r->npoints = npoints;
+	r->next_point = 0;
+	r->cur = NULL;
+	r->cur_len = 0;
+	r->cur_off = 0;
+	r->failed = false;
+
+	r->jobs = calloc(r->slots, ops->job_size);
+	if (!r->jobs)
+		return false;
+	r->pool = wandio_pool_create(threads, r->slots, reader_run, r,
+			ops->label);
+	if (!r->pool) {
+		free(r->jobs);
+		r->jobs = NULL;
+		return false;
+	}
+	wandio_pool_count_stalls(r->pool, &io->stats.consumer_stalls,
+			&io->stats.consumer_stall_ns);
+	return true;
+}
+
+void *wandio_reader_slot(struct wandio_reader *r, unsigned int i)
+{
+	return r->jobs + (size_t)i * r->ops->job_size;
+}
+
+void *wandio_reader_free_job(struct wandio_reader *r)
+{
+	if (wandio_pool_pending(r->pool) >= r->slots)
+		return NULL;
+	return wandio_reader_slot(r, r->next_job % r->slots);
+}
+
+void wandio_reader_submit(struct wandio_reader *r, void *job)
+{
+	((struct wandio_reader_job *)job)->failed = false;
+	wandio_pool_submit(r->pool, job);
+	r->next_job++;
+}
+
+/* Makes sure there is decoded data to hand out. Returns the amount
+ * available, 0 at the end of the file or -1 on error */
+static int64_t reader_next(struct wandio_reader *r)
+{
+	struct wandio_reader_job *job;
+	int ret;
+
+	while (r->cur_off >= r->cur_len) {
+		/* The job we were handing out is free again */
+		if (r->ops->fill(r->io) < 0)
+			return -1;
+		job = wandio_pool_wait(r->pool, true);
+		if (job) {
+			if (job->failed)
+				return -1;
+			r->cur = job->out;
+			r->cur_len = job->out_len;
+			r->cur_off = 0;
+			continue;
+		}
+
+		/* Nothing in flight, which is the end of the file unless the
+		 * module has something else to give us */
+		ret = r->ops->idle ? r->ops->idle(r->io, &r->cur, &r->cur_len) 
+				: 0;
+		if (ret <= 0)
+			return ret;
+		r->cur_off = 0;
+	}
+	return r->cur_len - r->cur_off;
+}
+
+int64_t wandio_reader_read(struct wandio_reader *r, void *buffer,
+		int64_t len)
+{
+	int64_t copied = 0;
+	int64_t avail;
+
+	if (r->failed) {
+		errno = EIO;
+		return -1;
+	}
+	while (copied < len) {
+		avail = reader_next(r);
+		if (avail < 0) {
+			fprintf(stderr, "Error decoding %s\n", r->ops->unit);
+			r->failed = true;
+			if (copied)
+				break;
+			errno = EIO;
+			return -1;
+		}
+		if (avail == 0)
+			break;
+		if (avail > len - copied)
+			avail = len - copied;
+		memcpy((char *)buffer + copied, r->cur + r->cur_off, avail);
+		r->cur_off += avail;
+		copied += avail;
+	}
+	r->position += copied;
+	return copied;
+}
+
+/* Drops everything in flight and starts again from a seek point, which
+ * may be the one at the end of the data */
+static int reader_restart(struct wandio_reader *r, size_t point)
+{
+	while (wandio_pool_wait(r->pool, true))
+		;
+	r->cur_len = 0;
+	r->cur_off = 0;
+	r->next_point = point;
+	r->position = r->points[point].unc_off;
+	r->failed = false;
+	if (r->ops->restart && r->ops->restart(r->io, point) < 0) {
+		r->failed = true;
+		return -1;
+	}
+	return 0;
+}
+
+int64_t wandio_reader_seek(struct wandio_reader *r, struct io_t *io,
+		int64_t offset, int whence)
+{
+	char discard[64*1024];
+	size_t lo, hi, mid;
+	int64_t ret;
+
+	if (whence == SEEK_CUR)
+		offset += r->position;
+	else if (whence == SEEK_END && r->points)
+		offset += r->points[r->npoints].unc_off;
+	else if (whence != SEEK_SET) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (r->points) {
+		/* Find the last block starting at or before the offset */
+		lo = 0;
+		hi = r->npoints;
+		while (hi - lo > 1) {
+			mid = (lo + hi) / 2;
+			if (r->points[mid].unc_off <= (uint64_t)offset)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		/* Only go back to the start of a block if we have to, or if
+		 * it's a long way ahead */
+		if (offset < r->position || 
+				r->points[lo].unc_off > (uint64_t)r->position) {
+			if (reader_restart(r, lo) < 0)
+				return -1;
+		}
+	}
+	else if (offset < r->position) {
+		/* Without the index we can only go forwards */
+		errno = ESPIPE;
+		return -1;
+	}
+
+	while (r->position < offset) {
+		ret = io->source->read(io, discard, 
+				offset - r->position < (int64_t)sizeof(discard) ?
+				offset - r->position : (int64_t)sizeof(discard));
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			break;
+	}
+	return r->position;
+}
+
+void wandio_reader_destroy(struct wandio_reader *r)
+{
+	unsigned int i;
+
+	if (r->pool)
+		wandio_pool_destroy(r->pool);
+	for (i = 0; r->jobs && r->ops->free_job && i < r->slots; ++i)
+		r->ops->free_job(wandio_reader_slot(r, i));
+	free(r->jobs);
+	r->pool = NULL;
+	r->jobs = NULL;
+}
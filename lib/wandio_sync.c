@@ -0,0 +1,140 @@
+/*
+ *
+ * Copyright (c) 2007-2016 The University of Waikato, Hamilton, New Zealand.
+ * All rights reserved.
+ *
+ * This file is part of libwandio.
+ *
+ * This code has been developed by the University of Waikato WAND
+ * research group. For further information please see http://www.wand.net.nz/
+ *
+ * libwandio is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * libwandio is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ */
+
+
+#include "config.h"
+#include "wandio_internal.h"
+#include <pthread.h>
+#include <limits.h>
+#include <time.h>
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Sleep/wakeup support for the lock-free rings used by the threaded IO
+ * modules.
+ *
+ * The producer and consumer normally never touch this at all -- they just
+ * look at each other's ring index. Only once a thread decides the ring is
+ * empty (or full) does it announce that it is going to sleep by setting
+ * "waiting", re-check the ring and then block on the futex word. The other
+ * side only needs to make a system call if it sees "waiting" set after
+ * publishing a new index.
+ *
+ * All the accesses to "waiting" and the ring indices that this relies on are
+ * sequentially consistent, so either the sleeper sees the new index or the
+ * publisher sees the sleeper.
+ */
+
+#ifdef HAVE_LINUX_FUTEX_H
+static void futex_wait(uint32_t *addr, uint32_t val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+void wandio_event_init(struct wandio_event *ev)
+{
+	ev->seq = 0;
+	ev->waiting = 0;
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_init(&ev->mutex, NULL);
+	pthread_cond_init(&ev->cond, NULL);
+#endif
+}
+
+void wandio_event_destroy(struct wandio_event *ev)
+{
+#ifndef HAVE_LINUX_FUTEX_H
+	pthread_mutex_destroy(&ev->mutex);
+	pthread_cond_destroy(&ev->cond);
+#else
+	(void)ev;
+#endif
+}
+
+/* Announce that we're about to sleep. The caller must re-check whatever it
+ * is waiting for after this and before calling wandio_event_wait() */
+uint32_t wandio_event_prepare(struct wandio_event *ev)
+{
+	__atomic_store_n(&ev->waiting, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST);
+}
+
+/* The condition came true while we were preparing to sleep */
+void wandio_event_cancel(struct wandio_event *ev)
+{
+	__atomic_store_n(&ev->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+void wandio_event_wait(struct wandio_event *ev, uint32_t token)
+{
+#ifdef HAVE_LINUX_FUTEX_H
+	/* Returns immediately if we've already been signalled since
+	 * wandio_event_prepare() */
+	futex_wait(&ev->seq, token);
+#else
+	pthread_mutex_lock(&ev->mutex);
+	while (__atomic_load_n(&ev->seq, __ATOMIC_SEQ_CST) == token)
+		pthread_cond_wait(&ev->cond, &ev->mutex);
+	pthread_mutex_unlock(&ev->mutex);
+#endif
+	__atomic_store_n(&ev->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+/* Wake the other side if (and only if) it is asleep. Must be called after
+ * the new ring index has been published */
+void wandio_event_signal(struct wandio_event *ev)
+{
+	if (!__atomic_load_n(&ev->waiting, __ATOMIC_SEQ_CST))
+		return;
+#ifdef HAVE_LINUX_FUTEX_H
+	__atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+	futex_wake(&ev->seq);
+#else
+	pthread_mutex_lock(&ev->mutex);
+	__atomic_add_fetch(&ev->seq, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_broadcast(&ev->cond);
+	pthread_mutex_unlock(&ev->mutex);
+#endif
+}
+
+/* Timestamps for the per-layer statistics, which include how long each
+ * side of the rings above spends asleep */
+uint64_t wandio_clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
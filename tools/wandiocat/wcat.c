@@ -41,8 +41,8 @@ static void printhelp() {
         printf("    Default is 0.\n");
         printf(" -Z <method>\n");
         printf("    Set the compression method. Must be one of 'gzip', \n");
-        printf("    'bzip2', 'lzo' or 'lzma'. If not specified, no\n");
-        printf("    compression is performed.\n");
+        printf("    'bgzf', 'bzip2', 'lzo', 'lzma', 'zstd' or 'lz4'. If not\n");
+        printf("    specified, no compression is performed.\n");
         printf(" -o <file>\n");
         printf("    The name of the output file. If not specified, output\n");
         printf("    is written to standard output.\n");
@@ -88,18 +88,22 @@ int main(int argc, char *argv[])
         /* stdout */
         int i;
         for(i=optind; i<argc; ++i) {
-                char buffer[1024*1024];
+                const void *buffer;
                 io_t *ior = wandio_create(argv[i]);
                 if (!ior) {
                         fprintf(stderr, "Failed to open %s\n", argv[i]);
                         continue;
                 }
 
+                /* Write straight out of the reader's buffers rather than
+                 * copying everything into our own first */
                 int64_t len;
                 do {
-                        len = wandio_read(ior, buffer, sizeof(buffer));
-                        if (len > 0)
+                        len = wandio_read_borrow(ior, &buffer, 1024*1024);
+                        if (len > 0) {
                                 wandio_wwrite(iow, buffer, len);
+                                wandio_read_release(ior, len);
+                        }
                 } while(len > 0);
 
                 wandio_destroy(ior);